@@ -0,0 +1,589 @@
+// Implementation of the Content ADT
+// Byte offset o lives in chunks[o / CHUNK_SIZE] at o % CHUNK_SIZE, so
+// reads and writes only touch the chunks they cover, and growing a file
+// adds chunks instead of moving the bytes already stored. A compressed
+// content keeps each chunk compressed on its own, so a read only
+// decompresses the chunks it covers. A deduplicated content is instead a
+// list of blocks of a Store, found by binary search on where they end;
+// like a mapped or compressed one, it gets chunks of its own when it is
+// first changed.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Content.h"
+#include "Lz.h"
+
+// smallest buffer given to the last chunk of a small file
+#define MIN_TAIL 16
+
+struct ContentRep {
+    char **chunks;      // chunk buffers in offset order
+    size_t nchunks;     // chunks in use
+    size_t slots;       // length of the chunks array
+    size_t tail_cap;    // capacity of the last chunk, at most CHUNK_SIZE
+    size_t size;        // bytes stored
+    bool mapped;        // the chunks belong to the caller of ContentMap
+    char *adopted;      // or are in this buffer of ContentAdopt's caller
+    uint32_t *packed;   // compressed size of each chunk, 0 for one kept as
+                        // it is; NULL unless the content is compressed
+    ChunkCache cache;   // where a compressed one's chunks are decompressed
+    uint64_t id;        // tells compressed contents apart in caches
+    size_t packed_bytes;    // the compressed chunks take
+    struct ContentBlock *blocks;    // NULL unless made by ContentDedup
+    size_t nblocks;
+    Store store;        // that the blocks belong to
+    size_t *meter;      // counts the memory it takes, see ContentSetMeter
+};
+
+// a block of a deduplicated content
+struct ContentBlock {
+    size_t end;         // offset just past it in the content
+    const char *data;
+    Block block;
+};
+
+// a chunk of a compressed content, decompressed
+struct CachedChunk {
+    uint64_t id;        // of the content, 0 while unused
+    size_t index;
+    unsigned long used; // the cache's clock when it was last read
+    char *data;
+};
+
+struct ChunkCacheRep {
+    pthread_mutex_t lock;
+    struct CachedChunk *chunks;
+    size_t n;
+    unsigned long clock;
+};
+
+// the chunk of a compressed content a thread last got from ContentSpan
+static _Thread_local struct {
+    uint64_t id;
+    size_t index;
+    char data[CHUNK_SIZE];
+} span_chunk;
+
+static uint64_t next_id = 1;
+
+// helper function declaration
+static void content_grow(Content c, size_t size, size_t zero_end);
+static void content_own(Content c);
+static size_t chunk_len(Content c, size_t i);
+static size_t chunk_cap(Content c, size_t i);
+static bool chunk_packed(Content c, size_t i);
+static void chunk_copy(Content c, size_t i, char *dst);
+static void cache_read(Content c, size_t i, size_t in_chunk, char *buf, size_t len);
+static size_t block_at(Content c, size_t offset);
+static void blocks_release(Content c);
+static void content_metered(Content c, size_t before);
+
+ChunkCache ChunkCacheNew(size_t n) {
+    ChunkCache cache = malloc(sizeof(struct ChunkCacheRep));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->chunks = calloc(n, sizeof(struct CachedChunk));
+    cache->n = n;
+    cache->clock = 0;
+    return cache;
+}
+
+void ChunkCacheFree(ChunkCache cache) {
+    for (size_t i = 0; i < cache->n; i++) {
+        free(cache->chunks[i].data);
+    }
+    free(cache->chunks);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+Content ContentNew(void) {
+    Content c = malloc(sizeof(struct ContentRep));
+    c->chunks = NULL;
+    c->nchunks = 0;
+    c->slots = 0;
+    c->tail_cap = 0;
+    c->size = 0;
+    c->mapped = false;
+    c->adopted = NULL;
+    c->packed = NULL;
+    c->cache = NULL;
+    c->id = 0;
+    c->blocks = NULL;
+    c->nblocks = 0;
+    c->store = NULL;
+    c->packed_bytes = 0;
+    c->meter = NULL;
+    return c;
+}
+
+void ContentFree(Content c) {
+    if (c == NULL) {
+        return;
+    }
+    ContentSetMeter(c, NULL);
+    for (size_t i = 0; i < c->nchunks && !c->mapped; i++) {
+        free(c->chunks[i]);
+    }
+    free(c->chunks);
+    free(c->adopted);
+    free(c->packed);
+    blocks_release(c);
+    free(c);
+}
+
+Content ContentCopy(Content c) {
+    Content copy = ContentNew();
+    if (c->blocks != NULL) {
+        content_grow(copy, c->size, 0);
+        for (size_t i = 0; i < c->nblocks; i++) {
+            size_t start = (i > 0) ? c->blocks[i - 1].end : 0;
+            ContentWrite(copy, start, c->blocks[i].data, c->blocks[i].end - start);
+        }
+    } else if (c->size > 0) {
+        // one allocation per chunk of the original
+        content_grow(copy, c->size, 0);
+        for (size_t i = 0; i < c->nchunks; i++) {
+            chunk_copy(c, i, copy->chunks[i]);
+        }
+    }
+    return copy;
+}
+
+Content ContentMap(const char *data, size_t size) {
+    Content c = ContentNew();
+    c->nchunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    c->slots = c->nchunks;
+    c->chunks = malloc(c->slots * sizeof(char *));
+    for (size_t i = 0; i < c->nchunks; i++) {
+        c->chunks[i] = (char *)data + i * (size_t)CHUNK_SIZE;
+    }
+    c->tail_cap = (c->nchunks > 0) ? size - (c->nchunks - 1) * (size_t)CHUNK_SIZE : 0;
+    c->size = size;
+    c->mapped = true;
+    return c;
+}
+
+Content ContentAdopt(char *buf, size_t size) {
+    Content c = ContentMap(buf, size);
+    c->adopted = buf;
+    return c;
+}
+
+Content ContentDedup(Store s, const char *data, size_t size) {
+    Content c = ContentNew();
+    size_t cap = 0;
+    for (size_t pos = 0; pos < size;) {
+        size_t len = StoreCut(data + pos, size - pos);
+        if (c->nblocks == cap) {
+            cap = (cap == 0) ? 4 : cap * 2;
+            c->blocks = realloc(c->blocks, cap * sizeof(struct ContentBlock));
+        }
+        Block b = StorePut(s, data + pos, len);
+        pos += len;
+        c->blocks[c->nblocks++] = (struct ContentBlock){pos, BlockData(b), b};
+    }
+    c->store = s;
+    c->size = size;
+    return c;
+}
+
+bool ContentDeduped(Content c) {
+    return c->blocks != NULL;
+}
+
+Content ContentCompress(Content c, ChunkCache cache) {
+    if (c->mapped || c->packed != NULL || c->blocks != NULL || c->size == 0) {
+        return NULL;
+    }
+    Content p = ContentNew();
+    p->chunks = malloc(c->nchunks * sizeof(char *));
+    p->packed = malloc(c->nchunks * sizeof(uint32_t));
+    p->nchunks = c->nchunks;
+    p->slots = c->nchunks;
+    p->tail_cap = c->tail_cap;
+    p->size = c->size;
+    p->cache = cache;
+    p->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    char *buf = malloc(CHUNK_SIZE);
+    for (size_t i = 0; i < c->nchunks; i++) {
+        size_t len = chunk_len(c, i);
+        // a chunk that doesn't lose an eighth is kept as it is
+        size_t k = LzCompress(c->chunks[i], len, buf, len - len / 8);
+        p->packed[i] = k;
+        p->packed_bytes += (k > 0) ? k : chunk_cap(c, i);
+        p->chunks[i] = malloc((k > 0) ? k : chunk_cap(c, i));
+        memcpy(p->chunks[i], (k > 0) ? buf : c->chunks[i], (k > 0) ? k : len);
+    }
+    free(buf);
+    size_t before = ContentBytes(c);
+    if (ContentBytes(p) > before - before / 8) {
+        ContentFree(p);
+        return NULL;
+    }
+    return p;
+}
+
+bool ContentCompressed(Content c) {
+    return c->packed != NULL;
+}
+
+size_t ContentBytes(Content c) {
+    if (c->adopted != NULL) {
+        return c->size;
+    } else if (c->mapped || c->nchunks == 0) {
+        return 0;
+    } else if (c->packed != NULL) {
+        return c->packed_bytes;
+    }
+    // every chunk but the last is full
+    return (c->nchunks - 1) * (size_t)CHUNK_SIZE + c->tail_cap;
+}
+
+void ContentSetMeter(Content c, size_t *meter) {
+    size_t bytes = ContentBytes(c);
+    if (c->meter != NULL) {
+        __atomic_sub_fetch(c->meter, bytes, __ATOMIC_RELAXED);
+    }
+    c->meter = meter;
+    if (meter != NULL) {
+        __atomic_add_fetch(meter, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+size_t ContentSize(Content c) {
+    return c->size;
+}
+
+size_t ContentRead(Content c, size_t offset, char *buf, size_t len) {
+    if (offset >= c->size) {
+        return 0;
+    }
+    if (len > c->size - offset) {
+        len = c->size - offset;
+    }
+    if (c->blocks != NULL) {
+        size_t done = 0;
+        for (size_t i = block_at(c, offset); done < len; i++) {
+            size_t start = (i > 0) ? c->blocks[i - 1].end : 0;
+            size_t from = offset + done - start;
+            size_t n = c->blocks[i].end - start - from;
+            if (n > len - done) {
+                n = len - done;
+            }
+            memcpy(buf + done, c->blocks[i].data + from, n);
+            done += n;
+        }
+        return len;
+    }
+    size_t done = 0;
+    while (done < len) {
+        size_t pos = offset + done;
+        size_t in_chunk = pos % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - in_chunk;
+        if (n > len - done) {
+            n = len - done;
+        }
+        size_t i = pos / CHUNK_SIZE;
+        if (!chunk_packed(c, i)) {
+            memcpy(buf + done, c->chunks[i] + in_chunk, n);
+        } else if (n == chunk_len(c, i)) {
+            // all of it: the cache would only lose what it holds
+            chunk_copy(c, i, buf + done);
+        } else {
+            cache_read(c, i, in_chunk, buf + done, n);
+        }
+        done += n;
+    }
+    return len;
+}
+
+const char *ContentSpan(Content c, size_t offset, size_t *len) {
+    if (offset >= c->size) {
+        *len = 0;
+        return NULL;
+    }
+    if (c->blocks != NULL) {
+        size_t i = block_at(c, offset);
+        size_t start = (i > 0) ? c->blocks[i - 1].end : 0;
+        *len = c->blocks[i].end - offset;
+        return c->blocks[i].data + offset - start;
+    }
+    size_t in_chunk = offset % CHUNK_SIZE;
+    size_t n = CHUNK_SIZE - in_chunk;
+    *len = (n < c->size - offset) ? n : c->size - offset;
+    size_t i = offset / CHUNK_SIZE;
+    if (!chunk_packed(c, i)) {
+        return c->chunks[i] + in_chunk;
+    }
+    if (span_chunk.id != c->id || span_chunk.index != i) {
+        chunk_copy(c, i, span_chunk.data);
+        span_chunk.id = c->id;
+        span_chunk.index = i;
+    }
+    return span_chunk.data + in_chunk;
+}
+
+void ContentWrite(Content c, size_t offset, const char *buf, size_t len) {
+    size_t before = ContentBytes(c);
+    content_own(c);
+    if (offset + len > c->size) {
+        // only a hole before offset needs zeroing, the rest is written below
+        content_grow(c, offset + len, offset);
+    }
+    size_t done = 0;
+    while (done < len) {
+        size_t pos = offset + done;
+        size_t in_chunk = pos % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - in_chunk;
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy(c->chunks[pos / CHUNK_SIZE] + in_chunk, buf + done, n);
+        done += n;
+    }
+    content_metered(c, before);
+}
+
+void ContentAppend(Content c, const char *buf, size_t len) {
+    ContentWrite(c, c->size, buf, len);
+}
+
+void ContentTruncate(Content c, size_t size) {
+    if (size >= c->size) {
+        return;
+    }
+    size_t before = ContentBytes(c);
+    content_own(c);
+    size_t keep = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    for (size_t i = keep; i < c->nchunks; i++) {
+        free(c->chunks[i]);
+    }
+    if (keep < c->nchunks) {
+        // the new last chunk was a full one
+        c->tail_cap = (keep > 0) ? CHUNK_SIZE : 0;
+        c->nchunks = keep;
+    }
+    c->size = size;
+    content_metered(c, before);
+}
+
+void ContentPrint(Content c, Output out) {
+    for (size_t i = 0; i < c->nblocks; i++) {
+        size_t start = (i > 0) ? c->blocks[i - 1].end : 0;
+        OutputWrite(out, c->blocks[i].data, c->blocks[i].end - start);
+    }
+    char *buf = (c->packed != NULL) ? malloc(CHUNK_SIZE) : NULL;
+    for (size_t i = 0; i < c->nchunks; i++) {
+        if (chunk_packed(c, i)) {
+            chunk_copy(c, i, buf);
+            OutputWrite(out, buf, chunk_len(c, i));
+        } else {
+            OutputWrite(out, c->chunks[i], chunk_len(c, i));
+        }
+    }
+    free(buf);
+}
+
+//        helper functions         //
+
+// make room for size bytes, zero-filling from the old end up to zero_end.
+// Only the last chunk is ever reallocated, and only while it is smaller
+// than CHUNK_SIZE.
+static void content_grow(Content c, size_t size, size_t zero_end) {
+    size_t need = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (need > c->slots) {
+        size_t slots = (c->slots == 0) ? 4 : c->slots;
+        while (slots < need) {
+            slots *= 2;
+        }
+        c->chunks = realloc(c->chunks, slots * sizeof(char *));
+        c->slots = slots;
+    }
+    // bytes the last chunk has to hold once size is reached
+    size_t last = size - (need - 1) * (size_t)CHUNK_SIZE;
+    if (c->nchunks > 0 && c->tail_cap < CHUNK_SIZE) {
+        // the old tail is no longer last or has to grow
+        size_t cap = (need > c->nchunks) ? CHUNK_SIZE : last;
+        if (cap > c->tail_cap) {
+            size_t new_cap = c->tail_cap * 2;
+            if (new_cap < cap) {
+                new_cap = cap;
+            }
+            if (new_cap > CHUNK_SIZE) {
+                new_cap = CHUNK_SIZE;
+            }
+            c->chunks[c->nchunks - 1] = realloc(c->chunks[c->nchunks - 1], new_cap);
+            c->tail_cap = new_cap;
+        }
+    }
+    while (c->nchunks < need) {
+        size_t cap = CHUNK_SIZE;
+        if (c->nchunks == need - 1) {
+            // the new tail only gets what it needs
+            cap = (last < MIN_TAIL) ? MIN_TAIL : last;
+        }
+        c->chunks[c->nchunks++] = malloc(cap);
+        c->tail_cap = cap;
+    }
+    // zero the gap between the old end and zero_end
+    size_t pos = c->size;
+    while (pos < zero_end) {
+        size_t in_chunk = pos % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - in_chunk;
+        if (n > zero_end - pos) {
+            n = zero_end - pos;
+        }
+        memset(c->chunks[pos / CHUNK_SIZE] + in_chunk, 0, n);
+        pos += n;
+    }
+    c->size = size;
+}
+
+// give a mapped, adopted or deduplicated content chunks of its own, and
+// decompress a compressed one, before it is changed
+static void content_own(Content c) {
+    if (c->blocks != NULL) {
+        size_t size = c->size;
+        c->size = 0;
+        content_grow(c, size, 0);
+        for (size_t i = 0; i < c->nblocks; i++) {
+            size_t start = (i > 0) ? c->blocks[i - 1].end : 0;
+            size_t done = 0;
+            while (start + done < c->blocks[i].end) {
+                size_t pos = start + done;
+                size_t n = CHUNK_SIZE - pos % CHUNK_SIZE;
+                if (n > c->blocks[i].end - pos) {
+                    n = c->blocks[i].end - pos;
+                }
+                memcpy(c->chunks[pos / CHUNK_SIZE] + pos % CHUNK_SIZE, c->blocks[i].data + done, n);
+                done += n;
+            }
+        }
+        blocks_release(c);
+        return;
+    }
+    if (c->packed != NULL) {
+        for (size_t i = 0; i < c->nchunks; i++) {
+            if (c->packed[i] > 0) {
+                char *chunk = malloc(chunk_cap(c, i));
+                chunk_copy(c, i, chunk);
+                free(c->chunks[i]);
+                c->chunks[i] = chunk;
+            }
+        }
+        free(c->packed);
+        c->packed = NULL;
+        c->cache = NULL;
+    }
+    if (!c->mapped) {
+        return;
+    }
+    for (size_t i = 0; i < c->nchunks; i++) {
+        size_t cap = (i + 1 < c->nchunks) ? CHUNK_SIZE : c->tail_cap;
+        char *chunk = malloc((cap < MIN_TAIL) ? MIN_TAIL : cap);
+        memcpy(chunk, c->chunks[i], cap);
+        c->chunks[i] = chunk;
+    }
+    if (c->tail_cap < MIN_TAIL && c->nchunks > 0) {
+        c->tail_cap = MIN_TAIL;
+    }
+    free(c->adopted);
+    c->adopted = NULL;
+    c->mapped = false;
+}
+
+// the bytes chunk i holds
+static size_t chunk_len(Content c, size_t i) {
+    return (i + 1 < c->nchunks) ? CHUNK_SIZE : c->size - i * (size_t)CHUNK_SIZE;
+}
+
+// the size of chunk i's buffer when it isn't compressed
+static size_t chunk_cap(Content c, size_t i) {
+    return (i + 1 < c->nchunks) ? CHUNK_SIZE : c->tail_cap;
+}
+
+static bool chunk_packed(Content c, size_t i) {
+    return c->packed != NULL && c->packed[i] > 0;
+}
+
+// the bytes of chunk i, decompressed if they have to be, into dst
+static void chunk_copy(Content c, size_t i, char *dst) {
+    if (chunk_packed(c, i)) {
+        LzDecompress(c->chunks[i], c->packed[i], dst, chunk_len(c, i));
+    } else {
+        memcpy(dst, c->chunks[i], chunk_len(c, i));
+    }
+}
+
+// copy len bytes from in_chunk on of compressed chunk i into buf, through
+// the content's cache: the chunk is decompressed in place of the one read
+// longest ago unless the cache holds it
+static void cache_read(Content c, size_t i, size_t in_chunk, char *buf, size_t len) {
+    ChunkCache cache = c->cache;
+    pthread_mutex_lock(&cache->lock);
+    struct CachedChunk *hit = NULL;
+    struct CachedChunk *oldest = &cache->chunks[0];
+    for (size_t k = 0; k < cache->n && hit == NULL; k++) {
+        struct CachedChunk *e = &cache->chunks[k];
+        if (e->id == c->id && e->index == i) {
+            hit = e;
+        } else if (e->used < oldest->used) {
+            oldest = e;
+        }
+    }
+    if (hit == NULL) {
+        hit = oldest;
+        if (hit->data == NULL) {
+            hit->data = malloc(CHUNK_SIZE);
+        }
+        chunk_copy(c, i, hit->data);
+        hit->id = c->id;
+        hit->index = i;
+    }
+    hit->used = ++cache->clock;
+    memcpy(buf, hit->data + in_chunk, len);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// the block of a deduplicated content that holds offset, which is in it
+static size_t block_at(Content c, size_t offset) {
+    size_t lo = 0;
+    size_t hi = c->nblocks - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->blocks[mid].end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// give a deduplicated content's blocks back to the store
+static void blocks_release(Content c) {
+    for (size_t i = 0; i < c->nblocks; i++) {
+        StoreRelease(c->store, c->blocks[i].block);
+    }
+    free(c->blocks);
+    c->blocks = NULL;
+    c->nblocks = 0;
+    c->store = NULL;
+}
+
+// add what c gained or lost since it took before bytes to its meter
+static void content_metered(Content c, size_t before) {
+    size_t after = ContentBytes(c);
+    if (c->meter == NULL || after == before) {
+        return;
+    } else if (after > before) {
+        __atomic_add_fetch(c->meter, after - before, __ATOMIC_RELAXED);
+    } else {
+        __atomic_sub_fetch(c->meter, before - after, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,89 @@
+// Interface to the Content ADT, which stores the bytes of a regular file
+// as a list of fixed-size chunks
+
+#ifndef CONTENT_H
+#define CONTENT_H
+
+#include <sys/types.h>
+
+#include "Output.h"
+#include "Store.h"
+
+// every chunk but the last holds exactly this many bytes
+#define CHUNK_SIZE (64 * 1024)
+
+typedef struct ContentRep *Content;
+
+// a few decompressed chunks of compressed contents, kept for the reads
+// that come next; several threads may use one at once
+typedef struct ChunkCacheRep *ChunkCache;
+
+// holds up to n chunks
+ChunkCache ChunkCacheNew(size_t n);
+
+void ChunkCacheFree(ChunkCache cache);
+
+Content ContentNew(void);
+
+void ContentFree(Content c);
+
+// a private copy of c
+Content ContentCopy(Content c);
+
+// the size bytes at data as a content, without copying them; data has
+// to outlive the content, which makes its own copy on the first change
+Content ContentMap(const char *data, size_t size);
+
+// a content holding the size bytes at buf, a heap buffer it takes over
+// and reads where it is; like a mapped content, it gets chunks of its own,
+// and frees buf, on its first change
+Content ContentAdopt(char *buf, size_t size);
+
+// a content holding the size bytes at data in blocks of s, cut where
+// StoreCut says, so bytes s already holds take no more memory; it gets
+// chunks of its own on its first change
+Content ContentDedup(Store s, const char *data, size_t size);
+
+bool ContentDeduped(Content c);
+
+// a compressed copy of c, read through cache until its first change
+// decompresses it for good; NULL if c is mapped, deduplicated or already
+// compressed, or wouldn't take an eighth less memory
+Content ContentCompress(Content c, ChunkCache cache);
+
+bool ContentCompressed(Content c);
+
+// the memory taken by c's chunks, or by its adopted buffer; 0 for a
+// mapped or deduplicated content
+size_t ContentBytes(Content c);
+
+// keeps *meter counting the memory c takes: adds it now and what it
+// gains or loses from here on, and takes it off when c is freed or
+// another meter, or NULL, is set
+void ContentSetMeter(Content c, size_t *meter);
+
+size_t ContentSize(Content c);
+
+// copies up to len bytes starting at offset into buf, returns the number
+// of bytes copied (0 at or past the end). Compressed chunks only read in
+// part go through the cache.
+size_t ContentRead(Content c, size_t offset, char *buf, size_t len);
+
+// the bytes from offset to the end of the chunk holding it, in place,
+// with their number in *len; NULL at or past the end. A compressed chunk
+// is decompressed into a buffer of the calling thread's, which the next
+// call for another chunk reuses.
+const char *ContentSpan(Content c, size_t offset, size_t *len);
+
+// writes len bytes at offset, growing the content (zero-filled) as needed
+void ContentWrite(Content c, size_t offset, const char *buf, size_t len);
+
+void ContentAppend(Content c, const char *buf, size_t len);
+
+// drops everything after the first size bytes
+void ContentTruncate(Content c, size_t size);
+
+// writes the whole content to out, one chunk at a time
+void ContentPrint(Content c, Output out);
+
+#endif
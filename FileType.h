@@ -2,12 +2,15 @@
 #ifndef FILE_TYPE_H
 #define FILE_TYPE_H
 
+#include "Output.h"
+
 typedef enum {
     REGULAR_FILE,
     DIRECTORY,
 } FileType;
 
-void listFile(char *name, FileType type);
+// writes name to out, colored by type if out is colored
+void listFile(Output out, char *name, FileType type);
 
 #endif
 
@@ -3,721 +3,5084 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
+#include "Content.h"
 #include "FileType.h"
 #include "Fs.h"
+#include "Journal.h"
+#include "Pattern.h"
+#include "Reader.h"
+#include "Scan.h"
+#include "Spill.h"
+#include "Store.h"
+#include "utility.h"
+
+// with CONCURRENT, links are published with release stores and followed
+// with acquire loads, so a reader that finds a node also sees it filled in
+#ifdef CONCURRENT
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define SET_FLAG(n, f) __atomic_fetch_or(&(n)->flags, (f), __ATOMIC_RELEASE)
+#define CLEAR_FLAG(n, f) __atomic_fetch_and(&(n)->flags, (uint8_t)~(f), __ATOMIC_RELEASE)
+#else
+#define LOAD(x) (x)
+#define STORE(x, v) ((x) = (v))
+#define SET_FLAG(n, f) ((n)->flags |= (f))
+#define CLEAR_FLAG(n, f) ((n)->flags &= (uint8_t)~(f))
+#endif
+#define HAS_FLAG(n, f) ((LOAD((n)->flags) & (f)) != 0)
+
+// with COMPACT_NODES a link is a 32-bit distance, counted in nodes, to
+// another slot of the node slab (0 standing for NULL, as a node never
+// links to itself), and names shorter than SHORT_NAME live in the node
+#ifdef COMPACT_NODES
+typedef int32_t Link;
+#define LINK(n, f) link_at((n), LOAD((n)->f))
+#define SET_LINK(n, f, v) STORE((n)->f, ((v) != NULL) ? (Link)((Node)(v) - (n)) : 0)
+#define NAME(n) ((LOAD((n)->flags) & LONG_NAME) ? (n)->long_name : (n)->short_name)
+#else
+typedef struct FsNode *Link;
+#define LINK(n, f) LOAD((n)->f)
+#define SET_LINK(n, f, v) STORE((n)->f, (v))
+#define NAME(n) ((n)->name)
+#endif
+
+#define SHORT_NAME 16
+
+// FsNode flags
+#define LONG_NAME 0x01      // the name lives in the arena
+#define SHADOW 0x02         // a directory copied by cp whose entries aren't
+                            // made yet: index links to the directory copied
+                            // and l_next to the next pending copy of it
+#define SHADOWED 0x04       // a directory with pending copies, see unshare
+#define DETACHED 0x08       // removed: nothing may be made in a directory,
+                            // or written to a file, once it is set
 
 struct FsNode {
+#ifdef COMPACT_NODES
+    union {
+        char short_name[SHORT_NAME];
+        char *long_name;
+    };
+#else
     char *name;
-    struct FsNode *h_prev;
-    struct FsNode *l_next;
-    struct FsNode *prev;
-    struct FsNode *next;
-    FileType type;
+#endif
+    Link h_prev;            // the directory containing this node
+    Link next;              // next entry in the same directory
+    Link left;              // search tree: entries with smaller names
+    Link right;             // search tree: entries with larger names
+    union {
+        struct {
+            Link l_next;    // first entry of a directory (canonical order)
+            Link index;     // root of a directory's search tree
+        };
+        unsigned content;   // id of a regular file's Content, 0 if none
+    };
+    uint16_t prio;          // search tree heap priority (hash of the name)
+    uint8_t type;           // FileType
+    uint8_t flags;
 };
 
+// nodes are slab objects and are saved in images as they are in memory,
+// so a change to their layout should be a deliberate one
+#ifdef COMPACT_NODES
+_Static_assert(sizeof(struct FsNode) == 48, "compact node size");
+#else
+_Static_assert(sizeof(struct FsNode) == 64, "node size");
+#endif
+_Static_assert(_Alignof(struct FsNode) == 8, "node alignment");
+
 typedef struct FsNode *Node;
 
-struct FsRep {
-    Node root;
-    Node curr_dir;
-};
+// outcome of walking a path
+typedef enum {
+    PATH_OK,
+    PATH_NOT_FOUND,  // a directory on the way doesn't exist
+    PATH_NOT_DIR,    // a name on the way is a regular file
+} PathError;
+
+// where a path leads, see resolve_path
+struct PathResult {
+    Node parent;     // directory holding the last name
+    Node node;       // node named by the path, NULL if it doesn't exist
+    char *name;      // last name, pointing into the path (not terminated)
+    int len;         // length of the last name
+    PathError err;
+};
+
+// what walk_tree calls for each node it passes, with depth 1 for the
+// entries of the directory walked. A pre-order visitor returns whether
+// to walk the node's entries; what a post-order one returns is ignored.
+typedef bool (*Visitor)(Fs fs, Node node, int depth, void *arg);
+
+// where copy_into is putting the entries it walks
+struct CopyWalk {
+    Node *dirs;             // dirs[depth - 1] receives entries at depth
+    int cap;
+};
+
+// directories left for each thread before the threads of FsFind start
+#define FIND_UNITS 8
+
+// a directory FsFind searches below, with its path in FindState.paths
+struct FindUnit {
+    Node dir;
+    size_t path;
+    size_t len;
+    int depth;
+};
+
+// an FsFind on its way; the units from next_unit on are left to search
+struct FindState {
+    Pattern pattern;
+    struct FsFindQuery *query;
+    FsFindFn found;
+    bool (*take)(void *arg, Node node, char *path);    // instead of found
+    void *arg;
+    bool split;             // directories to search become units
+    struct FindUnit *units;
+    size_t nunits;
+    size_t units_cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    size_t next_unit;
+    long matches;
+    bool stop;
+    bool shared;            // several threads search, calls go through lock
+    pthread_mutex_t lock;
+};
+
+// the directories a thread of FsFind is inside and its path buffer
+struct FindFrame {
+    Node next;              // entry to look at next
+    size_t len;             // of the directory's path
+};
+
+struct FindWalk {
+    struct FindFrame *frames;
+    size_t nframes;
+    size_t frames_cap;
+    char *path;
+    size_t len;
+    size_t cap;
+};
+
+// a regular file FsGrep searches, with its path in GrepState.paths, or
+// one FsExport writes, with its path in ExportState.paths
+struct GrepFile {
+    Node file;
+    size_t path;
+    size_t size;
+};
+
+// an FsGrep on its way; the files from next_file on are left to search
+struct GrepState {
+    Fs fs;
+    Scan scan;
+    FsGrepFn found;
+    void *arg;
+    struct GrepFile *files;
+    size_t nfiles;
+    size_t files_cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    size_t next_file;
+    long matches;
+    bool stop;
+    bool shared;            // several threads search, calls go through lock
+    pthread_mutex_t lock;
+};
+
+// the file a thread of FsGrep is searching
+struct GrepCall {
+    struct GrepState *g;
+    char *path;
+};
+
+// host files a thread of FsImport reads at once, the bytes read that
+// its threads other than the caller hold at most before they are made,
+// and iovecs FsExport hands one write
+#define IMPORT_READS 64
+#define IMPORT_AHEAD (64 << 20)
+#define EXPORT_IOV 64
+
+// a host directory FsImport has yet to read, and the path it goes to
+struct ImportDir {
+    char *host;
+    char *path;             // "" for the root
+};
+
+// the entries of a host directory, made with one FsBatch
+struct ImportBatch {
+    struct ImportBatch *next;
+    struct FsOp *ops;
+    int n;
+    int cap;
+    char *paths;            // of the ops, one after another
+    size_t paths_len;
+    size_t paths_cap;
+    size_t *path_at;        // where each op's path is, till paths is done
+    size_t bytes;           // read into the buffers of the ops
+    char *failed;           // host paths that couldn't be read, likewise
+    size_t failed_len;
+};
+
+// an FsImport on its way. Batches are made in the order their
+// directories are read, and a directory is only left to read once the
+// batch making it is in, so every batch finds its parent made.
+struct ImportState {
+    Fs fs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // something to do came, or the end did
+    struct ImportDir *dirs; // left to read, taken last in first out
+    size_t ndirs;
+    size_t dirs_cap;
+    int busy;               // threads reading a directory
+    struct ImportBatch *ready;
+    struct ImportBatch **ready_end;
+    size_t ahead;           // bytes in the batches ready
+    long imported;
+};
+
+// an FsExport on its way; the files from next_file on are left to write
+struct ExportState {
+    Fs fs;
+    char *host;
+    size_t start_len;       // of the path exported, left off every path
+    struct GrepFile *files;
+    size_t nfiles;
+    size_t files_cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    size_t next_file;
+    long exported;
+    char *failed;           // host paths that couldn't be written
+    size_t failed_len;
+    pthread_mutex_t lock;   // for failed
+};
+
+// an open view of a file's content, see FsOpenView
+struct FsViewRep {
+    Fs fs;
+    struct ContentSlot *slot;   // whose reference the view holds, or NULL
+    Content c;                  // NULL for an empty file
+    bool copied;                // c is the view's own decompressed copy
+};
+
+// a slot of the content table, addressed by a file's content id
+struct ContentSlot {
+    void *free_link;        // used by the slab while the slot is free
+    Content content;        // NULL while the slot is free
+    unsigned refs;          // files sharing the content, see file_content
+    unsigned image;         // 1 + its entry in the loaded image, 0 if none
+    unsigned touched;       // fs_tick when a file last used it, see content_use
+    bool used;              // since evict_cold last passed it
+    unsigned views;         // of the refs, the ones FsOpenView holds
+    const char *spill;      // where the content is in the spill file, or NULL
+};
+
+// an image written by FsSave starts with this header; every offset is
+// from the start of the file. Nodes are stored as they are in memory,
+// numbered in pre-order from the root, with each link replaced by the
+// distance between the two node numbers and each name by its offset in
+// the names section, so an image can be mapped anywhere.
+#define IMAGE_MAGIC "MIMFSIMG"
+#define IMAGE_VERSION 2
+#define IMAGE_ALIGN 4096
+
+struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint16_t node_size;     // sizeof(struct FsNode) of the build that saved it
+    uint16_t link_size;     // sizeof(Link)
+    uint64_t nodes;
+    uint64_t nodes_off;     // IMAGE_ALIGN aligned, mapped as the node slab
+    uint64_t names_off;     // NUL-terminated names that aren't in the node
+    uint64_t names_size;
+    uint64_t long_names;    // COMPACT_NODES only: nodes with a name there
+    uint64_t long_names_off;    // uint32_t node numbers
+    uint64_t contents;
+    uint64_t contents_off;  // struct ImageContent for each content id
+    uint64_t data_off;      // the bytes of every content
+    uint64_t data_size;
+    uint64_t shadows;
+    uint64_t shadows_off;   // uint32_t node numbers of pending copies
+    uint64_t journal_seq;   // last journaled change the image includes
+    uint64_t size;
+};
+
+// the changes a journal records, see journal_begin
+typedef enum {
+    OP_MKDIR = 1,
+    OP_MKFILE,
+    OP_PUT,
+    OP_APPEND,
+    OP_PWRITE,
+    OP_DLDIR,
+    OP_DL,
+    OP_CP,
+    OP_MV,
+} JournalOp;
+
+// an operation of FsBatch, with its path made absolute and split
+struct BatchItem {
+    char *path;
+    int parent_len;         // path[0 .. parent_len) names the parent
+    int name_len;           // the name follows the '/' after the parent
+    int index;              // in the caller's arrays
+    unsigned hash;          // of the parent
+    int group;              // -1 for a path with "." or "..", see FsBatch
+};
+
+// the operations of a batch that share a parent directory
+struct BatchGroup {
+    char *parent;
+    int parent_len;
+    unsigned hash;
+    int start;              // items of the group in sorted order
+    int count;
+};
+
+struct ImageContent {
+    uint64_t offset;        // in the data section
+    uint64_t size;
+    uint32_t refs;
+    uint32_t unused;
+};
+
+// the dentry cache maps the absolute path of a lookup, spelled without
+// "." or "..", to where the lookup led, including to nothing. Its entries
+// are spread over DCACHE_SHARDS shards of DCACHE_WAYS slots each, and a
+// full shard evicts with a CLOCK hand. An entry is only used while
+// fs->dc_gen is what it was when the lookup started: it moves when names
+// go away and when cp adds a tree of them. A create drops the entry for
+// its own path, and moves fs->dc_adds, which an entry for a path that
+// failed on the way also has to match.
+#define DCACHE_SHARDS 16
+#define DCACHE_WAYS 4096
+
+struct Dentry {
+    char *key;              // NULL while the slot is free
+    int len;
+    uint64_t hash;
+    Node node;
+    Node parent;
+    PathError err;
+    bool referenced;        // used since the clock hand last passed
+    unsigned long gen;      // fs->dc_gen when the lookup started
+    unsigned long adds;     // fs->dc_adds when the lookup started
+};
+
+struct DcacheShard {
+#ifdef CONCURRENT
+    pthread_mutex_t lock;
+#endif
+    struct Dentry *slots;   // DCACHE_WAYS of them
+    uint32_t *table;        // 2 * DCACHE_WAYS, 1 + the slot of a key or 0
+    int used;               // slots handed out so far
+    int count;              // entries in them
+    int hand;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+#ifdef CONCURRENT
+// writers to a directory (or a file's content) hold the lock of the stripe
+// the node hashes to; directory lookups don't lock, they retry if the
+// stripe's sequence number moved while they searched
+#define STRIPES 256
+
+struct Stripe {
+    pthread_mutex_t lock;
+    unsigned seq;           // odd while a writer is changing a directory
+};
+
+// something unlinked that a reader may still be looking at
+struct Retired {
+    void *obj;
+    void (*release)(Fs fs, void *obj);
+    unsigned long epoch;    // global epoch when it was unlinked
+};
+#endif
+
+#ifdef STATS
+// every public operation but FsNew, FsLoad, FsFree and the ones that
+// only report on fs is counted and timed by the thread that calls it.
+// Bucket b of a histogram counts the calls that took under 2^b ns.
+#define STAT_BUCKETS 40
+#define STAT_BEGIN() uint64_t stat_start = stat_now()
+#define STAT_END(fs, op) stat_record((fs), (op), stat_start)
+
+typedef enum {
+    STAT_SAVE, STAT_JOURNAL, STAT_CHECKPOINT, STAT_GETCWD, STAT_REALPATH,
+    STAT_MKDIR, STAT_MKFILE, STAT_CD, STAT_LS, STAT_PWD, STAT_TREE, STAT_PUT,
+    STAT_APPEND, STAT_PREAD, STAT_PWRITE, STAT_CAT, STAT_BATCH, STAT_DLDIR,
+    STAT_DL, STAT_CP, STAT_MV, STAT_FIND, STAT_GREP, STAT_VIEW, STAT_IMPORT,
+    STAT_EXPORT, STAT_OPS,
+} StatOp;
+
+static char *stat_names[STAT_OPS] = {
+    "save", "journal", "checkpoint", "getcwd", "realpath", "mkdir", "mkfile",
+    "cd", "ls", "pwd", "tree", "put", "append", "pread", "pwrite", "cat",
+    "batch", "dldir", "dl", "cp", "mv", "find",
+    "grep", "view", "import", "export",
+};
+
+// only the thread owning it writes to one, a dump may read it meanwhile
+struct OpStats {
+    uint64_t calls;
+    uint64_t ns;
+    uint64_t buckets[STAT_BUCKETS];
+};
+#else
+#define STAT_BEGIN()
+#define STAT_END(fs, op)
+#endif
+
+// detached nodes every public operation frees on its way out
+#define DETACHED_STEP 64
+
+// content table slots a public operation looks at on its way out for
+// cold contents to compress, and the bytes it compresses at most
+#define COMPRESS_SCAN 64
+#define COMPRESS_STEP (1 << 20)
+// decompressed chunks kept for reads of compressed contents
+#define CHUNK_CACHE 32
+
+// what a thread keeps for itself while using a file system
+struct FsThread {
+    Node curr_dir;
+    char *cwd;              // canonical path of curr_dir, kept up to date by FsCd
+    size_t cwd_len;
+    size_t cwd_cap;
+    Output out;             // what the thread prints, handed on by fs_exit
+    int depth;              // nesting of fs_enter
+#ifdef STATS
+    struct OpStats stats[STAT_OPS];
+#endif
+#ifdef CONCURRENT
+    pthread_t thread;
+    unsigned long epoch;    // global epoch seen on entry, 0 outside the fs
+    struct Retired *retired;
+    size_t nretired;
+    size_t retired_cap;
+    struct FsThread *next;
+#endif
+};
+
+struct FsRep {
+    Node root;
+    Slab nodes;     // every FsNode of this file system
+    Arena names;    // node names that don't fit in the node
+    Slab contents;  // struct ContentSlot for every content id
+    Map shadows;    // directory -> its first pending copy
+    size_t shadowed;    // directories with pending copies
+    char *image;        // mapping of the image loaded by FsLoad, or NULL
+    size_t image_size;
+    Journal journal;    // where changes are logged, NULL without FsJournal
+    uint64_t seq;       // last change journaled or included in the image
+    struct DcacheShard dcache[DCACHE_SHARDS];
+    unsigned long dc_gen;   // see struct Dentry
+    unsigned long dc_adds;
+    Node detached;      // subtrees removed but not yet freed, see free_detached
+    Node detached_at;   // where freeing the first of them got to
+    FsWriter write;     // where every thread's output goes, see FsSetOutput
+    void *write_arg;
+    bool colored;
+    int cold_ms;        // contents unused this long get compressed, off if < 0
+    struct timespec born;   // fs_tick counts from here
+    unsigned compressed_at; // fs_tick of the last compress_some
+    size_t compress_next;   // slot compress_cold looks at next
+    ChunkCache chunk_cache;
+    bool dedup;         // FsPut stores contents in blocks of store
+    Store store;
+    size_t resident;    // memory contents take, outside the store
+    size_t budget;      // for resident, 0 if there is none
+    Spill spill;        // where contents go over the budget, see evict_cold
+    size_t evict_next;  // slot evict_cold looks at next
+#ifdef CONCURRENT
+    unsigned long id;               // tells file systems apart in thread caches
+    unsigned long epoch;            // global epoch, see fs_reclaim
+    pthread_mutex_t threads_lock;
+    struct FsThread *threads;       // one for every thread that used the fs
+    pthread_mutex_t alloc_lock;     // guards nodes, names and contents
+    pthread_mutex_t shadow_lock;    // guards shadows and pending copies
+    pthread_mutex_t journal_lock;   // changes take effect in journal order
+    pthread_mutex_t output_lock;    // one block of output written at a time
+    pthread_mutex_t detached_lock;  // one thread frees detached nodes at a time
+    pthread_mutex_t compress_lock;  // one thread compresses contents at a time
+    pthread_mutex_t spill_lock;     // one thread evicts contents at a time
+    struct Stripe stripes[STRIPES];
+    pthread_rwlock_t content_locks[STRIPES];
+#else
+    struct FsThread main;
+#endif
+};
+
+#ifdef CONCURRENT
+// the FsThread last used by this thread, checked before the fs's list
+static _Thread_local struct {
+    unsigned long id;
+    struct FsThread *me;
+} cached_thread;
+
+static unsigned long next_fs_id = 1;
+#endif
+
+// helper function declaration
+Fs fs_create(void);
+Node NewNode(Fs fs, char name[], int len, FileType type);
+void NodeFree(Fs fs, Node node);
+bool free_enter(Fs fs, Node node, int depth, void *arg);
+bool free_node(Fs fs, Node node, int depth, void *arg);
+void node_release(Fs fs, void *node);
+PathError resolve_path(Fs fs, char *path, struct PathResult *res);
+PathError walk_path(Fs fs, char *path, struct PathResult *res);
+char *path_error(PathError err);
+Node find_node(Fs fs, char *path, char *cmd);
+Node find_dir(Fs fs, char *path, char *cmd);
+Node find_file(Fs fs, char *path, char *cmd);
+Content file_content(Fs fs, Node file);
+Content node_content(Fs fs, Node file);
+Content image_content(Fs fs, struct ContentSlot *slot);
+unsigned content_ref(Fs fs, Node file);
+void content_release(Fs fs, Node file);
+void slot_unref(Fs fs, struct ContentSlot *slot);
+void slot_release(Fs fs, void *slot);
+void content_replace(Fs fs, Node file, Content c);
+void content_use(Fs fs, Node file);
+bool put(Fs fs, char *path, char *data, size_t len, bool adopt);
+unsigned fs_tick(Fs fs);
+void compress_some(Fs fs);
+size_t compress_cold(Fs fs, unsigned cold, size_t scan, size_t step);
+void content_retired(Fs fs, void *c);
+void evict_some(Fs fs);
+void evict_cold(Fs fs);
+void copy_path(Fs fs, bool recursive, char *src, char *dest);
+void copy_into(Fs fs, Node src, Node dir);
+bool copy_entry(Fs fs, Node e, int depth, void *arg);
+bool is_within(Node node, Node dir);
+Node clone_here(Fs fs, Node src, Node dir, char *name, int len);
+Node entries(Fs fs, Node dir);
+void materialize(Fs fs, Node copy);
+void materialize_one(Fs fs, Node copy);
+void unshare(Fs fs, Node node);
+void shadow_add(Fs fs, Node src, Node copy);
+void shadow_remove(Fs fs, Node src, Node copy);
+void shadow_lock(Fs fs);
+void shadow_unlock(Fs fs);
+Node lookInDir (Fs fs, Node dir, char* name, int len);
+Node search_index (Node dir, char *name, int len);
+int name_cmp (char *name, int len, char *other);
+void create_entry (Fs fs, char *cmd, char *path, FileType type);
+bool is_root_parent(Fs fs, char *path);
+void remove_entry (Fs fs, char *cmd, char *path, bool dir_only, bool recursive);
+bool in_use(Fs fs, Node node);
+bool is_detached(Node node);
+bool seal(Fs fs, Node dir);
+Node create_here (Fs fs, Node dir, char *name, int len, FileType type);
+void link_entry (Node dir, Node new, Node *prev, Node *next);
+void unlink_entry (Node dir, Node old);
+void index_insert (Node dir, Node new, Node *prev, Node *next);
+Node index_remove (Node dir, Node old);
+void set_child (Node dir, Node parent, bool left, Node child);
+void set_name(Fs fs, Node node, char *name, int len);
+unsigned name_hash (char *name);
+struct FsThread *fs_self(Fs fs);
+void thread_init(Fs fs, struct FsThread *me);
+Output fs_out(Fs fs);
+void fs_write(void *arg, const char *buf, size_t len);
+void stdout_write(void *arg, const char *buf, size_t len);
+bool stats_entry(Fs fs, Node node, int depth, void *arg);
+size_t fan_out(Node dir);
+#ifdef STATS
+uint64_t stat_now(void);
+void stat_record(Fs fs, StatOp op, uint64_t start);
+void stat_add(struct OpStats total[], struct FsThread *me);
+void stat_dump(Fs fs, Output out);
+#endif
+void fs_enter(Fs fs);
+void fs_exit(Fs fs);
+void detach(Fs fs, Node node);
+bool free_detached(Fs fs, size_t max, bool wait);
+void dir_lock(Fs fs, Node dir);
+void dir_unlock(Fs fs, Node dir);
+void content_lock(Fs fs, Node file, bool write);
+void content_unlock(Fs fs, Node file);
+void content_lock_all(Fs fs);
+bool content_lock_live(Fs fs, Node file);
+void cwd_lock(Fs fs);
+void cwd_unlock(Fs fs);
+void content_unlock_all(Fs fs);
+void alloc_lock(Fs fs);
+void alloc_unlock(Fs fs);
+void cwd_follow(struct FsThread *me, char *path);
+void cwd_append(struct FsThread *me, char *name, size_t len);
+int node_path(Node node, char *buf, size_t size);
+void tree(Fs fs, Node dir);
+bool tree_entry(Fs fs, Node node, int depth, void *arg);
+void walk_tree(Fs fs, Node dir, Visitor pre, Visitor post, void *arg);
+long find(Node dir, char *path, struct FindState *s);
+void find_walk(struct FindState *s, struct FindWalk *w, Node dir, int depth);
+void find_push(struct FindWalk *w, Node dir);
+void find_append(struct FindWalk *w, size_t at, char *text, size_t len);
+void find_unit(struct FindState *s, Node dir, char *path, size_t len, int depth);
+void find_report(struct FindState *s, Node node, char *path);
+void *find_worker(void *arg);
+Node find_entries(Node dir);
+long grep(struct GrepState *g, int threads);
+bool grep_add(void *arg, Node file, char *path);
+void grep_file(struct GrepState *g, struct GrepFile *f);
+bool grep_line(void *arg, size_t offset, size_t line);
+void *grep_worker(void *arg);
+int grep_size_cmp(const void *a, const void *b);
+void import_run(struct ImportState *s, bool apply);
+void *import_worker(void *arg);
+struct ImportBatch *import_read(Reader r, struct ImportDir *d, struct ImportDir **subs,
+                                size_t *nsubs);
+void import_files(struct ImportBatch *b, Reader r, int n, int fds[], char *bufs[],
+                  size_t lens[], char names[][NAME_MAX + 1], struct ImportDir *d);
+size_t import_op(struct ImportBatch *b, FsOpType type, char *dir, char *name);
+void import_fail(char **failed, size_t *len, char *host, char *name);
+void import_apply(struct ImportState *s, struct ImportBatch *b);
+char *batch_error(FsStatus status);
+bool export_add(void *arg, Node node, char *path);
+void export_file(struct ExportState *e, struct GrepFile *f);
+void *export_worker(void *arg);
+void dcache_init(Fs fs);
+void dcache_destroy(Fs fs);
+int dcache_key(Fs fs, char *path, char *key, struct PathResult *res);
+uint64_t path_hash(char *key, int len);
+struct DcacheShard *dcache_shard(Fs fs, uint64_t hash);
+uint32_t *dcache_find(struct DcacheShard *s, char *key, int len, uint64_t hash);
+bool dcache_lookup(Fs fs, char *key, int len, uint64_t hash, struct PathResult *res);
+void dcache_insert(Fs fs, char *key, int len, uint64_t hash, struct PathResult *res,
+                   unsigned long gen, unsigned long adds);
+void dcache_evict(struct DcacheShard *s, uint32_t *at);
+void dcache_created(Fs fs, char *key, int len);
+void dcache_created_in(Fs fs, Node dir, char *name, int len);
+void dcache_invalidate(Fs fs);
+void dcache_lock(struct DcacheShard *s);
+void dcache_unlock(struct DcacheShard *s);
+void batch_split(char *cwd, char *path, char *buf, struct BatchItem *item);
+int batch_group_cmp(const void *a, const void *b);
+int batch_item_cmp(const void *a, const void *b);
+void batch_apply(Fs fs, struct FsOp ops[], FsStatus status[], struct BatchGroup *g,
+                 struct BatchItem *items, Node **stack, size_t *cap);
+FsStatus batch_one(Fs fs, struct FsOp *op);
+FsStatus batch_put(Fs fs, Node file, struct FsOp *op);
+void batch_log(Fs fs, struct FsOp *op, char *path);
+void index_rebuild(Node dir, Node **stack, size_t *cap);
+Node preorder_next(Node top, Node n);
+bool image_write(Fs fs, FILE *out);
+bool image_valid(struct ImageHeader *h, size_t size);
+bool image_section(uint64_t off, uint64_t count, uint64_t item, uint64_t end);
+bool image_nodes(Fs fs, struct ImageHeader *h);
+bool image_target(uint64_t i, int64_t distance, uint64_t nodes);
+Link image_link(Fs fs, uint32_t *number, Node n, Node target);
+void image_pad(FILE *out, uint64_t offset);
+void journal_begin(Fs fs, JournalOp op, bool flag, char *src[], char *path,
+                   char *data, size_t len, size_t offset);
+void journal_hold(Fs fs);
+void journal_log(Fs fs, JournalOp op, bool flag, char *src[], char *path,
+                 char *data, size_t len, size_t offset);
+void journal_end(Fs fs);
+void journal_apply(Fs fs, struct JournalRecord *r);
+void sync_dir(char *path);
+void fs_quiesce(Fs fs);
+void fs_resume(Fs fs);
+#ifdef COMPACT_NODES
+static inline Node link_at(Node n, Link distance);
+#endif
+#ifdef CONCURRENT
+void fs_retire(Fs fs, void *obj, void (*release)(Fs fs, void *obj));
+void fs_reclaim(Fs fs, struct FsThread *me);
+struct Stripe *stripe_of(Fs fs, Node node);
+#endif
+
+
+Fs FsNew(void) {
+    Fs fs = fs_create();
+    fs->root = NewNode(fs, "simple_root", strlen("simple_root"), DIRECTORY);
+#ifndef CONCURRENT
+    thread_init(fs, &fs->main);
+#endif
+    return fs;
+}
+
+bool FsSave(Fs fs, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    // an image only holds nodes reachable from the root
+    free_detached(fs, SIZE_MAX, true);
+    fs_quiesce(fs);
+    // written next to path and renamed over it, so path always holds a
+    // complete image
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    bool saved = out != NULL && image_write(fs, out);
+    if (out != NULL && fclose(out) != 0) {
+        saved = false;
+    }
+    if (saved && rename(tmp, path) != 0) {
+        saved = false;
+    }
+    if (saved) {
+        sync_dir(path);
+    }
+    if (!saved) {
+        OutputPrintf(fs_out(fs), "save: \'%s\': %s\n", path, strerror(errno));
+        remove(tmp);
+    }
+    fs_resume(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_SAVE);
+    return saved;
+}
+
+Fs FsLoad(char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("load: \'%s\': %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED || !image_valid((struct ImageHeader *)image, st.st_size)) {
+        printf("load: \'%s\': Not a file system image\n", path);
+        if (image != MAP_FAILED) {
+            munmap(image, st.st_size);
+        }
+        close(fd);
+        return NULL;
+    }
+    struct ImageHeader *h = (struct ImageHeader *)image;
+    Fs fs = fs_create();
+    fs->image = image;
+    fs->image_size = st.st_size;
+    // the root's place in the slab is known before the nodes are mapped,
+    // and a thread set up now can be freed if they turn out bad
+    fs->root = SlabAt(fs->nodes, 0);
+#ifndef CONCURRENT
+    thread_init(fs, &fs->main);
+#endif
+    // the nodes are used where they are mapped
+    bool mapped = SlabMap(fs->nodes, fd, h->nodes_off, h->nodes);
+    close(fd);
+    if (!mapped) {
+        printf("load: \'%s\': %s\n", path, strerror(errno));
+        FsFree(fs);
+        return NULL;
+    }
+    if (!image_nodes(fs, h)) {
+        printf("load: \'%s\': Not a file system image\n", path);
+        FsFree(fs);
+        return NULL;
+    }
+    // content ids keep their numbers and are read on first use
+    struct ImageContent *contents = (struct ImageContent *)(image + h->contents_off);
+    for (uint64_t i = 0; i < h->contents; i++) {
+        struct ContentSlot *slot = SlabAlloc(fs->contents);
+        slot->content = NULL;
+        slot->refs = contents[i].refs;
+        slot->image = i + 1;
+        slot->touched = 0;
+        slot->used = false;
+        slot->views = 0;
+        slot->spill = NULL;
+    }
+    uint32_t *shadows = (uint32_t *)(image + h->shadows_off);
+    for (uint64_t i = 0; i < h->shadows; i++) {
+        Node copy = SlabAt(fs->nodes, shadows[i] - 1);
+        shadow_add(fs, LINK(copy, index), copy);
+    }
+    fs->seq = h->journal_seq;
+    return fs;
+}
+
+bool FsJournal(Fs fs, char *path, int sync_ms) {
+    STAT_BEGIN();
+    Journal journal = JournalOpen(path, sync_ms);
+    if (journal == NULL) {
+        OutputPrintf(fs_out(fs), "journal: \'%s\': cannot open journal\n", path);
+        OutputFlush(fs_out(fs));
+        STAT_END(fs, STAT_JOURNAL);
+        return false;
+    }
+    // bring fs up to date with what was logged after its image was saved
+    struct JournalRecord r;
+    while (JournalRead(journal, &r)) {
+        if (r.seq > fs->seq) {
+            journal_apply(fs, &r);
+            fs->seq = r.seq;
+        }
+    }
+    fs->journal = journal;
+    STAT_END(fs, STAT_JOURNAL);
+    return true;
+}
+
+bool FsCheckpoint(Fs fs, char *path) {
+    STAT_BEGIN();
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->journal_lock);
+#endif
+    // once the image is safely in place, the journal holds nothing it lacks
+    bool saved = FsSave(fs, path);
+    if (saved && fs->journal != NULL) {
+        JournalTruncate(fs->journal);
+    }
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->journal_lock);
+#endif
+    STAT_END(fs, STAT_CHECKPOINT);
+    return saved;
+}
+
+void FsGetCwd(Fs fs, char cwd[PATH_MAX + 1]) {
+    STAT_BEGIN();
+    struct FsThread *me = fs_self(fs);
+    // the cached path, cut short if it is longer than PATH_MAX
+    size_t len = (me->cwd_len > PATH_MAX) ? PATH_MAX : me->cwd_len;
+    memcpy(cwd, me->cwd, len);
+    cwd[len] = '\0';
+    STAT_END(fs, STAT_GETCWD);
+}
+
+bool FsRealpath(Fs fs, char *path, char resolved[PATH_MAX + 1]) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    bool found = false;
+    struct PathResult res;
+    if (resolve_path(fs, path, &res) != PATH_OK) {
+        OutputPrintf(fs_out(fs), "realpath: \'%s\': %s\n", path, path_error(res.err));
+    } else if (res.node == NULL) {
+        OutputPrintf(fs_out(fs), "realpath: \'%s\': No Such file or directory\n", path);
+    } else if (node_path(res.node, resolved, PATH_MAX + 1) < 0) {
+        OutputPrintf(fs_out(fs), "realpath: \'%s\': File name too long\n", path);
+    } else {
+        found = true;
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_REALPATH);
+    return found;
+}
+
+void FsGetCacheStats(Fs fs, struct FsCacheStats *stats) {
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->entries = 0;
+    for (int i = 0; i < DCACHE_SHARDS; i++) {
+        struct DcacheShard *s = &fs->dcache[i];
+        dcache_lock(s);
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->entries += s->count;
+        dcache_unlock(s);
+    }
+}
+
+void FsGetStats(Fs fs, struct FsStats *stats) {
+    fs_enter(fs);
+    free_detached(fs, SIZE_MAX, true);
+    memset(stats, 0, sizeof(*stats));
+    stats->directories = 1;
+    stats->max_fanout = fan_out(fs->root);
+    walk_tree(fs, fs->root, stats_entry, NULL, stats);
+    alloc_lock(fs);
+    size_t count = SlabCount(fs->contents);
+    for (size_t i = 0; i < count; i++) {
+        struct ContentSlot *slot = SlabAt(fs->contents, i);
+        if (slot->refs == 0) {
+            continue;
+        }
+        stats->contents++;
+        if (slot->content != NULL) {
+            stats->content_bytes += ContentSize(slot->content);
+            if (ContentCompressed(slot->content)) {
+                stats->compressed++;
+                stats->compressed_bytes += ContentBytes(slot->content);
+            }
+            if (slot->spill != NULL) {
+                stats->spilled++;
+                stats->spilled_bytes += ContentSize(slot->content);
+            }
+        } else {
+            // still in the image
+            struct ImageHeader *h = (struct ImageHeader *)fs->image;
+            struct ImageContent *entry = (struct ImageContent *)(fs->image + h->contents_off);
+            stats->content_bytes += entry[slot->image - 1].size;
+        }
+    }
+    stats->node_bytes = SlabBytes(fs->nodes);
+    stats->name_arena_bytes = ArenaBytes(fs->names);
+    stats->content_table_bytes = SlabBytes(fs->contents);
+    alloc_unlock(fs);
+    struct StoreStats blocks;
+    StoreGetStats(fs->store, &blocks);
+    stats->blocks = blocks.blocks;
+    stats->block_bytes = blocks.bytes;
+    stats->block_referenced = blocks.referenced;
+    stats->resident_bytes = LOAD(fs->resident);
+    fs_exit(fs);
+}
+
+void FsDumpStats(Fs fs) {
+    fs_enter(fs);
+    struct FsStats stats;
+    FsGetStats(fs, &stats);
+    struct FsCacheStats cache;
+    FsGetCacheStats(fs, &cache);
+    Output out = fs_out(fs);
+    OutputPrintf(out, "fs_directories %zu\n", stats.directories);
+    OutputPrintf(out, "fs_files %zu\n", stats.files);
+    OutputPrintf(out, "fs_name_bytes %zu\n", stats.name_bytes);
+    OutputPrintf(out, "fs_contents %zu\n", stats.contents);
+    OutputPrintf(out, "fs_content_bytes %zu\n", stats.content_bytes);
+    OutputPrintf(out, "fs_compressed %zu\n", stats.compressed);
+    OutputPrintf(out, "fs_compressed_bytes %zu\n", stats.compressed_bytes);
+    OutputPrintf(out, "fs_spilled %zu\n", stats.spilled);
+    OutputPrintf(out, "fs_spilled_bytes %zu\n", stats.spilled_bytes);
+    OutputPrintf(out, "fs_resident_bytes %zu\n", stats.resident_bytes);
+    OutputPrintf(out, "fs_max_fanout %zu\n", stats.max_fanout);
+    OutputPrintf(out, "fs_max_depth %zu\n", stats.max_depth);
+    OutputPrintf(out, "fs_node_bytes %zu\n", stats.node_bytes);
+    OutputPrintf(out, "fs_name_arena_bytes %zu\n", stats.name_arena_bytes);
+    OutputPrintf(out, "fs_content_table_bytes %zu\n", stats.content_table_bytes);
+    OutputPrintf(out, "fs_blocks %zu\n", stats.blocks);
+    OutputPrintf(out, "fs_block_bytes %zu\n", stats.block_bytes);
+    OutputPrintf(out, "fs_block_referenced %zu\n", stats.block_referenced);
+    OutputPrintf(out, "fs_cache_hits %lu\n", cache.hits);
+    OutputPrintf(out, "fs_cache_misses %lu\n", cache.misses);
+    OutputPrintf(out, "fs_cache_entries %zu\n", cache.entries);
+#ifdef STATS
+    stat_dump(fs, out);
+#endif
+    fs_exit(fs);
+}
+
+bool FsReclaim(Fs fs, size_t max) {
+    fs_enter(fs);
+    bool left = free_detached(fs, max, true);
+    fs_exit(fs);
+    return left;
+}
+
+bool FsSetBudget(Fs fs, size_t bytes, char *spill_path) {
+    if (bytes > 0 && fs->spill == NULL) {
+        fs->spill = SpillNew(spill_path);
+        if (fs->spill == NULL) {
+            return false;
+        }
+    }
+    fs->budget = bytes;
+    return true;
+}
+
+void FsSetDedup(Fs fs, bool on) {
+    STORE(fs->dedup, on);
+}
+
+void FsSetCompression(Fs fs, int cold_ms) {
+    STORE(fs->cold_ms, cold_ms);
+}
+
+size_t FsCompress(Fs fs) {
+    fs_enter(fs);
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->compress_lock);
+#endif
+    int cold_ms = LOAD(fs->cold_ms);
+    size_t n = compress_cold(fs, (cold_ms > 0) ? cold_ms : 0, SIZE_MAX, SIZE_MAX);
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->compress_lock);
+#endif
+    fs_exit(fs);
+    return n;
+}
+
+void FsSetOutput(Fs fs, FsWriter write, void *arg, bool colored) {
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->threads_lock);
+    for (struct FsThread *me = fs->threads; me != NULL; me = me->next) {
+        OutputFlush(me->out);
+        OutputSetColored(me->out, colored);
+    }
+    pthread_mutex_unlock(&fs->threads_lock);
+#else
+    OutputFlush(fs->main.out);
+    OutputSetColored(fs->main.out, colored);
+#endif
+    fs->write = (write != NULL) ? write : stdout_write;
+    fs->write_arg = arg;
+    fs->colored = colored;
+}
+
+void FsFree(Fs fs) {
+    if (fs->journal != NULL) {
+        JournalClose(fs->journal);
+    }
+#ifdef CONCURRENT
+    // contents replaced by compressed copies are out of the table already
+    for (struct FsThread *me = fs->threads; me != NULL; me = me->next) {
+        for (size_t i = 0; i < me->nretired; i++) {
+            if (me->retired[i].release == content_retired) {
+                ContentFree(me->retired[i].obj);
+            }
+        }
+    }
+#endif
+    // file contents are the only per-node allocations left, and the
+    // content table finds each of them once, however many files share it
+    size_t count = SlabCount(fs->contents);
+    for (size_t i = 0; i < count; i++) {
+        struct ContentSlot *slot = SlabAt(fs->contents, i);
+        ContentFree(slot->content);
+    }
+#ifdef CONCURRENT
+    struct FsThread *me = fs->threads;
+    while (me != NULL) {
+        struct FsThread *next = me->next;
+        // what is still retired lives in the slabs and goes with them
+        free(me->retired);
+        free(me->cwd);
+        OutputFree(me->out);
+        free(me);
+        me = next;
+    }
+    for (int i = 0; i < STRIPES; i++) {
+        pthread_mutex_destroy(&fs->stripes[i].lock);
+        pthread_rwlock_destroy(&fs->content_locks[i]);
+    }
+    pthread_mutex_destroy(&fs->threads_lock);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->shadow_lock);
+    pthread_mutex_destroy(&fs->journal_lock);
+    pthread_mutex_destroy(&fs->output_lock);
+    pthread_mutex_destroy(&fs->detached_lock);
+    pthread_mutex_destroy(&fs->compress_lock);
+    pthread_mutex_destroy(&fs->spill_lock);
+    // forget this fs in the calling thread's cache
+    cached_thread.id = 0;
+#else
+    free(fs->main.cwd);
+    OutputFree(fs->main.out);
+#endif
+    dcache_destroy(fs);
+    MapFree(fs->shadows);
+    ChunkCacheFree(fs->chunk_cache);
+    StoreFree(fs->store);
+    if (fs->spill != NULL) {
+        SpillFree(fs->spill);
+    }
+    if (fs->image != NULL) {
+        munmap(fs->image, fs->image_size);
+    }
+    SlabDestroy(fs->contents);
+    SlabDestroy(fs->nodes);
+    ArenaDestroy(fs->names);
+    free(fs);
+}
+
+void FsMkdir(Fs fs, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    journal_begin(fs, OP_MKDIR, false, NULL, path, NULL, 0, 0);
+    create_entry(fs, "mkdir", path, DIRECTORY);
+    journal_end(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_MKDIR);
+}
+
+void FsMkfile(Fs fs, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    journal_begin(fs, OP_MKFILE, false, NULL, path, NULL, 0, 0);
+    create_entry(fs, "mkfile", path, REGULAR_FILE);
+    journal_end(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_MKFILE);
+}
+
+void FsCd(Fs fs, char *path) {
+    STAT_BEGIN();
+    struct FsThread *me = fs_self(fs);
+    // if the path is NULL
+    // back to the root
+    if (path == NULL) {
+        cwd_lock(fs);
+        me->curr_dir = fs->root;
+        cwd_unlock(fs);
+        me->cwd_len = 1;
+        me->cwd[1] = '\0';
+        STAT_END(fs, STAT_CD);
+        return;
+    }
+    fs_enter(fs);
+    Node dir = find_dir(fs, path, "cd");
+    if (dir != NULL) {
+        // make the current directory the found node, unless a dl -r has
+        // taken it away since; dl checks for current directories under
+        // the same lock
+        cwd_lock(fs);
+        bool removed = is_detached(dir);
+        if (!removed) {
+            me->curr_dir = dir;
+        }
+        cwd_unlock(fs);
+        if (removed) {
+            OutputPrintf(fs_out(fs), "cd: \'%s\': No Such file or directory\n", path);
+        } else {
+            cwd_follow(me, path);
+        }
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_CD);
+}
+
+void FsLs(Fs fs, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    Node dir = find_dir(fs, path, "ls");
+    if (dir != NULL) {
+        // display the names under the directory
+        // that is the lower level of the dir node
+        Output out = fs_out(fs);
+        for (Node curr = entries(fs, dir); curr != NULL; curr = LINK(curr, next)) {
+            listFile(out, NAME(curr), curr->type);
+            OutputWrite(out, "\n", 1);
+        }
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_LS);
+}
+
+void FsPwd(Fs fs) {
+    STAT_BEGIN();
+    struct FsThread *me = fs_self(fs);
+    OutputWrite(me->out, me->cwd, me->cwd_len);
+    OutputWrite(me->out, "\n", 1);
+    OutputFlush(me->out);
+    STAT_END(fs, STAT_PWD);
+}
+
+void FsTree(Fs fs, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    if (path == NULL) {
+        OutputWrite(fs_out(fs), "/\n", 2);
+        tree(fs, fs->root);
+    } else {
+        Node dir = find_dir(fs, path, "tree");
+        if (dir != NULL) {
+            OutputPrintf(fs_out(fs), "%s\n", path);
+            tree(fs, dir);
+        }
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_TREE);
+}
+
+void FsPut(Fs fs, char *path, char *content) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    put(fs, path, content, strlen(content), false);
+    fs_exit(fs);
+    STAT_END(fs, STAT_PUT);
+}
+
+bool FsAdopt(Fs fs, char *path, char *buf, size_t len) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    bool done = put(fs, path, buf, len, true);
+    fs_exit(fs);
+    STAT_END(fs, STAT_PUT);
+    return done;
+}
+
+void FsAppend(Fs fs, char *path, char *content) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    journal_begin(fs, OP_APPEND, false, NULL, path, content, strlen(content), 0);
+    Node file = find_file(fs, path, "append");
+    if (file != NULL) {
+        unshare(fs, LINK(file, h_prev));
+    }
+    if (file != NULL && content_lock_live(fs, file)) {
+        ContentAppend(file_content(fs, file), content, strlen(content));
+        content_unlock(fs, file);
+    } else if (file != NULL) {
+        OutputPrintf(fs_out(fs), "append: \'%s\': No Such file or directory\n", path);
+    }
+    journal_end(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_APPEND);
+}
+
+ssize_t FsPread(Fs fs, char *path, char *buf, size_t size, size_t offset) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    ssize_t n = -1;
+    Node file = find_file(fs, path, "pread");
+    if (file != NULL) {
+        content_lock(fs, file, false);
+        content_use(fs, file);
+        Content c = node_content(fs, file);
+        n = (c != NULL) ? (ssize_t)ContentRead(c, offset, buf, size) : 0;
+        content_unlock(fs, file);
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_PREAD);
+    return n;
+}
+
+ssize_t FsPwrite(Fs fs, char *path, char *buf, size_t size, size_t offset) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    journal_begin(fs, OP_PWRITE, false, NULL, path, buf, size, offset);
+    ssize_t n = -1;
+    Node file = find_file(fs, path, "pwrite");
+    if (file != NULL) {
+        unshare(fs, LINK(file, h_prev));
+    }
+    if (file != NULL && content_lock_live(fs, file)) {
+        ContentWrite(file_content(fs, file), offset, buf, size);
+        content_unlock(fs, file);
+        n = size;
+    }
+    journal_end(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_PWRITE);
+    return n;
+}
+
+FsView FsOpenView(Fs fs, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    FsView v = NULL;
+    Node file = find_file(fs, path, "view");
+    if (file != NULL) {
+        v = malloc(sizeof(struct FsViewRep));
+        v->fs = fs;
+        v->slot = NULL;
+        v->c = NULL;
+        v->copied = false;
+        content_lock(fs, file, false);
+        content_use(fs, file);
+        if (file->content != 0) {
+            // a reference of the view's own: a change to the file copies
+            // the content first, and compress_cold and evict_cold leave it
+            alloc_lock(fs);
+            v->slot = SlabAt(fs->contents, file->content - 1);
+            v->slot->refs++;
+            v->slot->views++;
+            v->c = v->slot->content;
+            alloc_unlock(fs);
+            if (v->c == NULL) {
+                v->c = image_content(fs, v->slot);
+            }
+        }
+        content_unlock(fs, file);
+        if (v->c != NULL && ContentCompressed(v->c)) {
+            v->c = ContentCopy(v->c);
+            v->copied = true;
+        }
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_VIEW);
+    return v;
+}
+
+size_t FsViewSize(FsView v) {
+    return (v->c != NULL) ? ContentSize(v->c) : 0;
+}
+
+int FsViewRead(FsView v, size_t offset, size_t len, struct iovec iov[], int max) {
+    int n = 0;
+    while (n < max && len > 0 && offset < FsViewSize(v)) {
+        size_t k;
+        const char *data = ContentSpan(v->c, offset, &k);
+        if (k > len) {
+            k = len;
+        }
+        iov[n].iov_base = (void *)data;
+        iov[n].iov_len = k;
+        n++;
+        offset += k;
+        len -= k;
+    }
+    return n;
+}
+
+void FsCloseView(FsView v) {
+    Fs fs = v->fs;
+    fs_enter(fs);
+    if (v->copied) {
+        ContentFree(v->c);
+    }
+    if (v->slot != NULL) {
+        alloc_lock(fs);
+        v->slot->views--;
+        alloc_unlock(fs);
+        slot_unref(fs, v->slot);
+    }
+    free(v);
+    fs_exit(fs);
+}
+
+void FsCat(Fs fs, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    Node file = find_file(fs, path, "cat");
+    if (file != NULL) {
+        content_lock(fs, file, false);
+        content_use(fs, file);
+        Content c = node_content(fs, file);
+        if (c != NULL) {
+            ContentPrint(c, fs_out(fs));
+        }
+        content_unlock(fs, file);
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_CAT);
+}
+
+void FsBatch(Fs fs, struct FsOp ops[], int n, FsStatus status[]) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    struct FsThread *me = fs_self(fs);
+    // every path made absolute, in one buffer
+    size_t size = 0;
+    for (int i = 0; i < n; i++) {
+        size += me->cwd_len + strlen(ops[i].path) + 2;
+    }
+    char *paths = malloc(size + 1);
+    struct BatchItem *items = malloc((n + 1) * sizeof(struct BatchItem));
+    char *p = paths;
+    for (int i = 0; i < n; i++) {
+        items[i].index = i;
+        status[i] = FS_OK;
+        batch_split(me->cwd, ops[i].path, p, &items[i]);
+        p += strlen(p) + 1;
+    }
+    // group the items by parent with a hash table of group numbers
+    size_t slots = 16;
+    while (slots < 2 * (size_t)n) {
+        slots *= 2;
+    }
+    int *table = malloc(slots * sizeof(int));
+    memset(table, -1, slots * sizeof(int));
+    struct BatchGroup *groups = malloc((n + 1) * sizeof(struct BatchGroup));
+    int ngroups = 0;
+    for (int i = 0; i < n; i++) {
+        struct BatchItem *item = &items[i];
+        if (item->group < 0) {
+            continue;
+        }
+        size_t slot = item->hash & (slots - 1);
+        while (table[slot] >= 0) {
+            struct BatchGroup *g = &groups[table[slot]];
+            if (g->hash == item->hash && g->parent_len == item->parent_len &&
+                memcmp(g->parent, item->path, item->parent_len) == 0) {
+                break;
+            }
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (table[slot] < 0) {
+            table[slot] = ngroups;
+            groups[ngroups] = (struct BatchGroup){item->path, item->parent_len, item->hash, 0, 0};
+            ngroups++;
+        }
+        item->group = table[slot];
+        groups[item->group].count++;
+    }
+    free(table);
+    // a parent sorts before anything below it, so directories created by
+    // the batch exist by the time their own group comes
+    for (int i = 0, start = 0; i < ngroups; i++) {
+        groups[i].start = start;
+        start += groups[i].count;
+    }
+    struct BatchItem *sorted = malloc((n + 1) * sizeof(struct BatchItem));
+    for (int i = 0; i < n; i++) {
+        if (items[i].group >= 0) {
+            struct BatchGroup *g = &groups[items[i].group];
+            sorted[g->start++] = items[i];
+        }
+    }
+    for (int i = 0; i < ngroups; i++) {
+        groups[i].start -= groups[i].count;
+        qsort(sorted + groups[i].start, groups[i].count, sizeof(struct BatchItem), batch_item_cmp);
+    }
+    qsort(groups, ngroups, sizeof(struct BatchGroup), batch_group_cmp);
+    if (fs->journal != NULL) {
+#ifdef CONCURRENT
+        pthread_mutex_lock(&fs->journal_lock);
+#endif
+        // logged in the order the batch applies them
+        for (int i = 0; i < ngroups; i++) {
+            for (int j = groups[i].start; j < groups[i].start + groups[i].count; j++) {
+                batch_log(fs, &ops[sorted[j].index], sorted[j].path);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (items[i].group < 0) {
+                batch_log(fs, &ops[i], ops[i].path);
+            }
+        }
+    }
+    Node *stack = NULL;
+    size_t cap = 0;
+    for (int i = 0; i < ngroups; i++) {
+        batch_apply(fs, ops, status, &groups[i], sorted, &stack, &cap);
+    }
+    for (int i = 0; i < n; i++) {
+        if (items[i].group < 0) {
+            status[i] = batch_one(fs, &ops[i]);
+        }
+    }
+    journal_end(fs);
+    for (int i = 0; i < n; i++) {
+        if (ops[i].type == FS_ADOPT && status[i] != FS_OK) {
+            free(ops[i].content);
+        }
+    }
+    free(stack);
+    free(sorted);
+    free(groups);
+    free(items);
+    free(paths);
+    fs_exit(fs);
+    STAT_END(fs, STAT_BATCH);
+}
+
+void FsDldir(Fs fs, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    journal_hold(fs);
+    remove_entry(fs, "dldir", path, true, false);
+    journal_end(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_DLDIR);
+}
+
+void FsDl(Fs fs, bool recursive, char *path) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    journal_hold(fs);
+    remove_entry(fs, "dl", path, false, recursive);
+    journal_end(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_DL);
+}
+
+void FsCp(Fs fs, bool recursive, char *src[], char *dest) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    journal_begin(fs, OP_CP, recursive, src, dest, NULL, 0, 0);
+    for (int i = 0; src[i] != NULL; i++) {
+        copy_path(fs, recursive, src[i], dest);
+    }
+    // the names a copy adds are too many to drop one by one
+    dcache_invalidate(fs);
+    journal_end(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_CP);
+}
+
+void FsMv(Fs fs, char *src[], char *dest) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    journal_begin(fs, OP_MV, false, src, dest, NULL, 0, 0);
+    // TODO
+    journal_end(fs);
+    fs_exit(fs);
+    STAT_END(fs, STAT_MV);
+}
+
+long FsFind(Fs fs, char *path, struct FsFindQuery *query, FsFindFn found, void *arg) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    long matches = -1;
+    Node dir = (path == NULL) ? fs->root : find_dir(fs, path, "find");
+    if (dir != NULL) {
+        char *text = (query->pattern != NULL) ? query->pattern : "*";
+        struct FindState s = {
+            .pattern = PatternNew(text, query->regex && query->pattern != NULL),
+            .query = query,
+            .found = found,
+            .arg = arg,
+        };
+        char start[PATH_MAX + 1];
+        if (s.pattern == NULL) {
+            OutputPrintf(fs_out(fs), "find: \'%s\': Invalid pattern\n", text);
+        } else if (node_path(dir, start, sizeof(start)) < 0) {
+            OutputPrintf(fs_out(fs), "find: \'%s\': File name too long\n", path);
+            PatternFree(s.pattern);
+        } else {
+            matches = find(dir, (dir == fs->root) ? "" : start, &s);
+            PatternFree(s.pattern);
+        }
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_FIND);
+    return matches;
+}
+
+long FsGrep(Fs fs, char *path, struct FsGrepQuery *query, FsGrepFn found, void *arg) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    long matches = -1;
+    Node node = find_node(fs, path, "grep");
+    Scan scan = NULL;
+    char start[PATH_MAX + 1];
+    if (node != NULL && node_path(node, start, sizeof(start)) < 0) {
+        OutputPrintf(fs_out(fs), "grep: \'%s\': File name too long\n", path);
+    } else if (node != NULL) {
+        scan = ScanNew(query->pattern, query->regex);
+        if (scan == NULL) {
+            OutputPrintf(fs_out(fs), "grep: \'%s\': Invalid pattern\n", query->pattern);
+        }
+    }
+    if (scan != NULL) {
+        struct GrepState g = {.fs = fs, .scan = scan, .found = found, .arg = arg};
+        if (node->type == REGULAR_FILE) {
+            grep_add(&g, node, start);
+        } else {
+            // the files are found the way FsFind finds them
+            struct FsFindQuery files = {NULL, false, FS_FIND_FILES, 0, -1, query->threads};
+            struct FindState s = {
+                .pattern = PatternNew("*", false),
+                .query = &files,
+                .take = grep_add,
+                .arg = &g,
+            };
+            find(node, (node == fs->root) ? "" : start, &s);
+            PatternFree(s.pattern);
+        }
+        matches = grep(&g, query->threads);
+        ScanFree(scan);
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_GREP);
+    return matches;
+}
+
+long FsImport(Fs fs, char *host_path, char *path, int threads) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    Node dir = find_dir(fs, path, "import");
+    char start[PATH_MAX + 1];
+    struct stat st;
+    if (dir != NULL && stat(host_path, &st) != 0) {
+        OutputPrintf(fs_out(fs), "import: '%s': No Such file or directory\n", host_path);
+        dir = NULL;
+    } else if (dir != NULL && !S_ISDIR(st.st_mode)) {
+        OutputPrintf(fs_out(fs), "import: '%s': Not a directory\n", host_path);
+        dir = NULL;
+    } else if (dir != NULL && node_path(dir, start, sizeof(start)) < 0) {
+        OutputPrintf(fs_out(fs), "import: '%s': File name too long\n", path);
+        dir = NULL;
+    }
+    bool root = dir == fs->root;
+    // each batch is an operation of its own, so the work operations do on
+    // their way out keeps up with what the import adds
+    fs_exit(fs);
+    if (dir == NULL) {
+        STAT_END(fs, STAT_IMPORT);
+        return -1;
+    }
+    struct ImportState s = {.fs = fs};
+    s.ready_end = &s.ready;
+    s.dirs_cap = 16;
+    s.dirs = malloc(s.dirs_cap * sizeof(struct ImportDir));
+    s.dirs[s.ndirs++] = (struct ImportDir){strdup(host_path), strdup(root ? "" : start)};
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    int nworkers = (threads > 1) ? threads - 1 : 0;
+    pthread_t *workers = malloc((nworkers + 1) * sizeof(pthread_t));
+    for (int i = 0; i < nworkers; i++) {
+        pthread_create(&workers[i], NULL, import_worker, &s);
+    }
+    import_run(&s, true);
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(s.dirs);
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    STAT_END(fs, STAT_IMPORT);
+    return s.imported;
+}
+
+long FsExport(Fs fs, char *path, char *host_path, int threads) {
+    STAT_BEGIN();
+    fs_enter(fs);
+    long exported = -1;
+    Node dir = find_dir(fs, path, "export");
+    char start[PATH_MAX + 1];
+    struct stat st;
+    if (dir != NULL && node_path(dir, start, sizeof(start)) < 0) {
+        OutputPrintf(fs_out(fs), "export: '%s': File name too long\n", path);
+        dir = NULL;
+    } else if (dir != NULL && mkdir(host_path, 0755) != 0 &&
+        (errno != EEXIST || stat(host_path, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        OutputPrintf(fs_out(fs), "export: '%s': Cannot create directory\n", host_path);
+        dir = NULL;
+    }
+    if (dir != NULL) {
+        struct ExportState e = {.fs = fs, .host = host_path};
+        pthread_mutex_init(&e.lock, NULL);
+        e.start_len = (dir == fs->root) ? 0 : strlen(start);
+        // found in the caller, in depth-first order, so directories are
+        // made on the host before anything below them
+        struct FsFindQuery all = {NULL, false, FS_FIND_ANY, 0, -1, 0};
+        struct FindState s = {
+            .pattern = PatternNew("*", false),
+            .query = &all,
+            .take = export_add,
+            .arg = &e,
+        };
+        find(dir, (dir == fs->root) ? "" : start, &s);
+        PatternFree(s.pattern);
+        // unlike FsGrep's, the files go in the order found: contents made
+        // or spilled together are then read together, which keeps the
+        // read-around of the reads of one thread of use to the others
+        if (threads <= 1) {
+            export_worker(&e);
+        } else {
+            pthread_t *workers = malloc((threads - 1) * sizeof(pthread_t));
+            for (int i = 0; i < threads - 1; i++) {
+                pthread_create(&workers[i], NULL, export_worker, &e);
+            }
+            export_worker(&e);
+            for (int i = 0; i < threads - 1; i++) {
+                pthread_join(workers[i], NULL);
+            }
+            free(workers);
+        }
+        for (size_t at = 0; at < e.failed_len; at += strlen(e.failed + at) + 1) {
+            OutputPrintf(fs_out(fs), "export: '%s': Cannot write\n", e.failed + at);
+        }
+        exported = e.exported;
+        free(e.failed);
+        free(e.files);
+        free(e.paths);
+        pthread_mutex_destroy(&e.lock);
+    }
+    fs_exit(fs);
+    STAT_END(fs, STAT_EXPORT);
+    return exported;
+}
+
+//        helper functions         //
+
+// find where path leads from the current directory (or from the root when
+// it starts with '/'). On success res->node is the node named by the path,
+// or NULL when only the last component is missing, in which case
+// res->parent, res->name and res->len say where it would be created.
+// The dentry cache answers for paths it has seen before.
+PathError resolve_path(Fs fs, char *path, struct PathResult *res) {
+    char key[PATH_MAX + 1];
+    int len = dcache_key(fs, path, key, res);
+    if (len < 0) {
+        return walk_path(fs, path, res);
+    }
+    uint64_t hash = path_hash(key, len);
+    if (dcache_lookup(fs, key, len, hash, res)) {
+        return res->err;
+    }
+    // what the cache learns is only as new as the counters read before
+    unsigned long gen = LOAD(fs->dc_gen);
+    unsigned long adds = LOAD(fs->dc_adds);
+    char *name = res->name;
+    int name_len = res->len;
+    walk_path(fs, path, res);
+    dcache_insert(fs, key, len, hash, res, gen, adds);
+    if (res->err == PATH_OK) {
+        res->name = name;
+        res->len = name_len;
+    }
+    return res->err;
+}
+
+// resolve_path without the cache: walk path one name at a time, without
+// copying it
+PathError walk_path(Fs fs, char *path, struct PathResult *res) {
+    Node curr = fs_self(fs)->curr_dir;
+    if (path != NULL && path[0] == '/') {
+        curr = fs->root;
+    }
+    res->parent = LINK(curr, h_prev);
+    res->node = curr;
+    res->name = NULL;
+    res->len = 0;
+    res->err = PATH_OK;
+    char *p = path;
+    while (p != NULL && *p != '\0') {
+        // skip the delimiters and cut the next name out of the path
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        char *name = p;
+        while (*p != '\0' && *p != '/') {
+            p++;
+        }
+        int len = p - name;
+        // the previous name has to be an existing directory
+        Node dir = res->node;
+        if (dir == NULL) {
+            res->err = PATH_NOT_FOUND;
+            return res->err;
+        } else if (dir->type != DIRECTORY) {
+            res->err = PATH_NOT_DIR;
+            return res->err;
+        }
+        if (len == 1 && name[0] == '.') {
+            // stay in the same directory
+        } else if (len == 2 && name[0] == '.' && name[1] == '.') {
+            // back to the upper dir, which the root doesn't have
+            if (LINK(dir, h_prev) == NULL) {
+                res->err = PATH_NOT_FOUND;
+                return res->err;
+            }
+            res->node = LINK(dir, h_prev);
+            res->parent = LINK(res->node, h_prev);
+        } else {
+            res->parent = dir;
+            res->node = lookInDir(fs, dir, name, len);
+        }
+        res->name = name;
+        res->len = len;
+    }
+    return res->err;
+}
+
+// the message printed for a failed path walk
+char *path_error(PathError err) {
+    switch (err) {
+        case PATH_NOT_FOUND:    return "No Such file or directory";
+        case PATH_NOT_DIR:      return "Not a directory";
+        default:                return "Success";
+    }
+}
+
+// resolve a path that has to name an existing file or directory,
+// printing the error for the command cmd if it doesn't
+Node find_node(Fs fs, char *path, char *cmd) {
+    struct PathResult res;
+    if (resolve_path(fs, path, &res) != PATH_OK) {
+        OutputPrintf(fs_out(fs), "%s: \'%s\': %s\n", cmd, path, path_error(res.err));
+        return NULL;
+    } else if (res.node == NULL) {
+        OutputPrintf(fs_out(fs), "%s: \'%s\': No Such file or directory\n", cmd, path);
+        return NULL;
+    }
+    return res.node;
+}
+
+// resolve a path that has to name an existing directory, printing
+// the error for the command cmd if it doesn't
+Node find_dir(Fs fs, char *path, char *cmd) {
+    struct PathResult res;
+    if (resolve_path(fs, path, &res) != PATH_OK) {
+        OutputPrintf(fs_out(fs), "%s: \'%s\': %s\n", cmd, path, path_error(res.err));
+        return NULL;
+    } else if (res.node == NULL) {
+        OutputPrintf(fs_out(fs), "%s: \'%s\': No Such file or directory\n", cmd, path);
+        return NULL;
+    } else if (res.node->type != DIRECTORY) {
+        OutputPrintf(fs_out(fs), "%s: \'%s\': Not a directory\n", cmd, path);
+        return NULL;
+    }
+    return res.node;
+}
+
+// an empty file system without a root
+Fs fs_create(void) {
+    Fs fs = malloc(sizeof(struct FsRep));
+    fs->nodes = SlabNew(sizeof(struct FsNode));
+    fs->names = ArenaNew();
+    fs->contents = SlabNew(sizeof(struct ContentSlot));
+    fs->shadows = MapNew();
+    fs->shadowed = 0;
+    fs->image = NULL;
+    fs->image_size = 0;
+    fs->journal = NULL;
+    fs->seq = 0;
+    dcache_init(fs);
+    fs->detached = NULL;
+    fs->detached_at = NULL;
+    fs->write = stdout_write;
+    fs->write_arg = NULL;
+    fs->cold_ms = -1;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &fs->born);
+    fs->compressed_at = 0;
+    fs->compress_next = 0;
+    fs->chunk_cache = ChunkCacheNew(CHUNK_CACHE);
+    fs->dedup = false;
+    fs->store = StoreNew();
+    fs->resident = 0;
+    fs->budget = 0;
+    fs->spill = NULL;
+    fs->evict_next = 0;
+#ifdef COLORED
+    fs->colored = true;
+#else
+    fs->colored = false;
+#endif
+#ifdef CONCURRENT
+    fs->id = __atomic_fetch_add(&next_fs_id, 1, __ATOMIC_RELAXED);
+    fs->epoch = 1;
+    pthread_mutex_init(&fs->threads_lock, NULL);
+    fs->threads = NULL;
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->shadow_lock, NULL);
+    pthread_mutex_init(&fs->journal_lock, NULL);
+    pthread_mutex_init(&fs->output_lock, NULL);
+    pthread_mutex_init(&fs->detached_lock, NULL);
+    pthread_mutex_init(&fs->compress_lock, NULL);
+    pthread_mutex_init(&fs->spill_lock, NULL);
+    for (int i = 0; i < STRIPES; i++) {
+        pthread_mutex_init(&fs->stripes[i].lock, NULL);
+        fs->stripes[i].seq = 0;
+        pthread_rwlock_init(&fs->content_locks[i], NULL);
+    }
+#endif
+    return fs;
+}
+
+// create a new node
+Node NewNode(Fs fs, char name[], int len, FileType type) {
+    alloc_lock(fs);
+    Node node = SlabAlloc(fs->nodes);
+    node->flags = 0;
+    set_name(fs, node, name, len);
+    alloc_unlock(fs);
+    SET_LINK(node, h_prev, NULL);
+    SET_LINK(node, next, NULL);
+    SET_LINK(node, left, NULL);
+    SET_LINK(node, right, NULL);
+    if (type == DIRECTORY) {
+        SET_LINK(node, l_next, NULL);
+        SET_LINK(node, index, NULL);
+    } else {
+        node->content = 0;
+    }
+    node->prio = name_hash(NAME(node)) >> 16;
+    node->type = type;
+    return node;
+}
+
+// give node, which is no longer linked into the tree, and everything
+// below it back to the slab; their long names stay in the arena until
+// the file system is freed. With CONCURRENT they are only reused once no
+// reader can still see them.
+void NodeFree(Fs fs, Node node) {
+    dcache_invalidate(fs);
+    if (free_enter(fs, node, 0, NULL)) {
+        walk_tree(fs, node, free_enter, free_node, NULL);
+    }
+    free_node(fs, node, 0, NULL);
+}
+
+// hand node, unlinked already, and everything below it to free_detached,
+// so a recursive remove returns without visiting the subtree. No thread
+// is in it (see in_use) and no lookup can reach it any more.
+void detach(Fs fs, Node node) {
+    dcache_invalidate(fs);
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->detached_lock);
+#endif
+    // queued through next, which the unlinked node no longer needs,
+    // behind the subtree being freed
+    if (fs->detached == NULL) {
+        SET_LINK(node, next, NULL);
+        STORE(fs->detached, node);
+        fs->detached_at = node;
+    } else {
+        SET_LINK(node, next, LINK(fs->detached, next));
+        SET_LINK(fs->detached, next, node);
+    }
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->detached_lock);
+#endif
+}
+
+// free up to max detached nodes, returning whether any are left. Each
+// step goes down first entries to a node without any, frees it and
+// unlinks it from its parent, so freeing can stop after any node and
+// picks up at fs->detached_at. It goes top-down, so the copies of a
+// directory get their entries (see free_enter) before any of them goes.
+// Without wait, another thread already freeing is left to it.
+bool free_detached(Fs fs, size_t max, bool wait) {
+#ifdef CONCURRENT
+    if (wait) {
+        pthread_mutex_lock(&fs->detached_lock);
+    } else if (pthread_mutex_trylock(&fs->detached_lock) != 0) {
+        return true;
+    }
+#endif
+    Node n = fs->detached_at;
+    for (size_t freed = 0; freed < max && n != NULL; freed++) {
+        free_enter(fs, n, 0, NULL);
+        while (n->type == DIRECTORY && !HAS_FLAG(n, SHADOW) && LINK(n, l_next) != NULL) {
+            n = LINK(n, l_next);
+            free_enter(fs, n, 0, NULL);
+        }
+        if (n->type == DIRECTORY && !seal(fs, n)) {
+            // a writer that found it before its subtree was removed
+            // made an entry in it, which goes first
+            continue;
+        }
+        Node parent = NULL;
+        if (n == fs->detached) {
+            // the whole subtree is gone, on to the next one
+            STORE(fs->detached, LINK(n, next));
+        } else {
+            parent = LINK(n, h_prev);
+            dir_lock(fs, parent);
+            SET_LINK(parent, l_next, LINK(n, next));
+            dir_unlock(fs, parent);
+        }
+        free_node(fs, n, 0, NULL);
+        n = (parent != NULL) ? parent : fs->detached;
+    }
+    fs->detached_at = n;
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->detached_lock);
+#endif
+    return n != NULL;
+}
+
+// about to free node: directories copied from it get their entries
+// first, so they keep what they copied
+bool free_enter(Fs fs, Node node, int depth, void *arg) {
+    if (HAS_FLAG(node, SHADOWED)) {
+        shadow_lock(fs);
+        while (HAS_FLAG(node, SHADOWED)) {
+            materialize(fs, MapGet(fs->shadows, node));
+        }
+        shadow_unlock(fs);
+    }
+    return true;
+}
+
+// free a single node, whose entries are gone already
+bool free_node(Fs fs, Node node, int depth, void *arg) {
+    if (HAS_FLAG(node, SHADOW)) {
+        // a copy with no entries of its own yet
+        shadow_lock(fs);
+        shadow_remove(fs, LINK(node, index), node);
+        shadow_unlock(fs);
+    } else if (node->type == REGULAR_FILE) {
+        // writers that found the file before it was removed leave it be
+        content_lock(fs, node, true);
+        SET_FLAG(node, DETACHED);
+        content_release(fs, node);
+        content_unlock(fs, node);
+    }
+#ifdef CONCURRENT
+    fs_retire(fs, node, node_release);
+#else
+    node_release(fs, node);
+#endif
+    return true;
+}
+
+// put a single node back on the slab's free list
+void node_release(Fs fs, void *node) {
+    alloc_lock(fs);
+    SlabFree(fs->nodes, node);
+    alloc_unlock(fs);
+}
+
+// store the first len characters of name as the node's name
+void set_name(Fs fs, Node node, char *name, int len) {
+#ifdef COMPACT_NODES
+    if (len < SHORT_NAME) {
+        memcpy(node->short_name, name, len);
+        node->short_name[len] = '\0';
+        node->flags &= ~LONG_NAME;
+        return;
+    }
+    node->long_name = ArenaStrndup(fs->names, name, len);
+    node->flags |= LONG_NAME;
+#else
+    node->name = ArenaStrndup(fs->names, name, len);
+#endif
+}
+
+// resolve a path that has to name an existing regular file, printing
+// the error for the command cmd if it doesn't
+Node find_file(Fs fs, char *path, char *cmd) {
+    struct PathResult res;
+    if (resolve_path(fs, path, &res) != PATH_OK) {
+        OutputPrintf(fs_out(fs), "%s: \'%s\': %s\n", cmd, path, path_error(res.err));
+        return NULL;
+    } else if (res.node == NULL) {
+        OutputPrintf(fs_out(fs), "%s: \'%s\': No Such file or directory\n", cmd, path);
+        return NULL;
+    } else if (res.node->type != REGULAR_FILE) {
+        OutputPrintf(fs_out(fs), "%s: \'%s\': Is a directory\n", cmd, path);
+        return NULL;
+    }
+    return res.node;
+}
+
+// the body of FsPut and FsAdopt: make the len bytes at data the content
+// of the regular file at path, taking data over if adopt, and freeing it
+// if there is no such file
+bool put(Fs fs, char *path, char *data, size_t len, bool adopt) {
+    journal_begin(fs, OP_PUT, false, NULL, path, data, len, 0);
+    Node file = find_file(fs, path, "put");
+    if (file != NULL) {
+        unshare(fs, LINK(file, h_prev));
+        if (!content_lock_live(fs, file)) {
+            OutputPrintf(fs_out(fs), "put: \'%s\': No Such file or directory\n", path);
+            file = NULL;
+        }
+    }
+    if (file != NULL && LOAD(fs->dedup)) {
+        // a new content, of blocks the store may have already
+        content_replace(fs, file, ContentDedup(fs->store, data, len));
+    } else if (file != NULL && adopt) {
+        content_replace(fs, file, ContentAdopt(data, len));
+        data = NULL;
+    } else if (file != NULL) {
+        // overwrite, reusing the chunks already allocated
+        Content c = file_content(fs, file);
+        ContentTruncate(c, len);
+        ContentWrite(c, 0, data, len);
+    }
+    if (file != NULL) {
+        content_unlock(fs, file);
+    }
+    if (adopt) {
+        free(data);
+    }
+    journal_end(fs);
+    return file != NULL;
+}
+
+// the content of a regular file for writing, created on its first write
+// and copied first if other files share it; the caller holds the file's
+// content lock for writing
+Content file_content(Fs fs, Node file) {
+    if (file->content != 0) {
+        alloc_lock(fs);
+        struct ContentSlot *slot = SlabAt(fs->contents, file->content - 1);
+        // a spilled content is copied back like a shared one
+        bool shared = slot->refs > 1 || slot->spill != NULL;
+        alloc_unlock(fs);
+        if (!shared) {
+            content_use(fs, file);
+            return node_content(fs, file);
+        }
+    }
+    Content c = (file->content != 0) ? ContentCopy(node_content(fs, file)) : ContentNew();
+    content_replace(fs, file, c);
+    return c;
+}
+
+// make c the content of a regular file, dropping the one it had; the
+// caller holds the file's content lock for writing
+void content_replace(Fs fs, Node file, Content c) {
+    content_release(fs, file);
+    alloc_lock(fs);
+    struct ContentSlot *slot = SlabAlloc(fs->contents);
+    file->content = SlabIndex(fs->contents, slot) + 1;
+    slot->refs = 1;
+    slot->image = 0;
+    slot->touched = fs_tick(fs);
+    slot->used = true;
+    slot->views = 0;
+    slot->spill = NULL;
+    ContentSetMeter(c, &fs->resident);
+    STORE(slot->content, c);
+    alloc_unlock(fs);
+}
+
+// the content of a regular file, NULL if it was never written
+Content node_content(Fs fs, Node file) {
+    if (file->content == 0) {
+        return NULL;
+    }
+    struct ContentSlot *slot = SlabAt(fs->contents, file->content - 1);
+    Content c = LOAD(slot->content);
+    return (c != NULL) ? c : image_content(fs, slot);
+}
+
+// the content of a slot filled by FsLoad, made on first use from the
+// bytes in the image
+Content image_content(Fs fs, struct ContentSlot *slot) {
+    alloc_lock(fs);
+    if (slot->content == NULL) {
+        struct ImageHeader *h = (struct ImageHeader *)fs->image;
+        struct ImageContent *entry = (struct ImageContent *)(fs->image + h->contents_off);
+        entry += slot->image - 1;
+        Content c = ContentMap(fs->image + h->data_off + entry->offset, entry->size);
+        // it takes memory once it is changed
+        ContentSetMeter(c, &fs->resident);
+        STORE(slot->content, c);
+    }
+    alloc_unlock(fs);
+    return slot->content;
+}
+
+// the content id of a regular file, counting one more file sharing it
+unsigned content_ref(Fs fs, Node file) {
+    content_lock(fs, file, false);
+    unsigned id = file->content;
+    if (id != 0) {
+        alloc_lock(fs);
+        struct ContentSlot *slot = SlabAt(fs->contents, id - 1);
+        slot->refs++;
+        alloc_unlock(fs);
+    }
+    content_unlock(fs, file);
+    return id;
+}
+
+// drop a regular file's content, freeing it and giving its id back
+// when no other file shares it
+void content_release(Fs fs, Node file) {
+    if (file->content == 0) {
+        return;
+    }
+    struct ContentSlot *slot = SlabAt(fs->contents, file->content - 1);
+    file->content = 0;
+    slot_unref(fs, slot);
+}
+
+// drop a reference to a slot of the content table, releasing it with the
+// last one
+void slot_unref(Fs fs, struct ContentSlot *slot) {
+    alloc_lock(fs);
+    unsigned refs = --slot->refs;
+    alloc_unlock(fs);
+    if (refs > 0) {
+        return;
+    }
+#ifdef CONCURRENT
+    fs_retire(fs, slot, slot_release);
+#else
+    slot_release(fs, slot);
+#endif
+}
+
+// free the content held by a slot of the content table and reuse the slot
+void slot_release(Fs fs, void *slot) {
+    struct ContentSlot *s = slot;
+    ContentFree(s->content);
+    if (s->spill != NULL) {
+        SpillRelease(fs->spill, s->spill);
+    }
+    alloc_lock(fs);
+    s->content = NULL;
+    s->spill = NULL;
+    s->image = 0;
+    SlabFree(fs->contents, s);
+    alloc_unlock(fs);
+}
+
+// note that a file's content is in use, which keeps it from being
+// compressed for the next fs->cold_ms and from the next eviction
+void content_use(Fs fs, Node file) {
+    if (file->content == 0) {
+        return;
+    }
+    struct ContentSlot *slot = SlabAt(fs->contents, file->content - 1);
+    if (LOAD(fs->cold_ms) >= 0) {
+        STORE(slot->touched, fs_tick(fs));
+    }
+    if (fs->budget > 0 && !LOAD(slot->used)) {
+        STORE(slot->used, true);
+    }
+}
+
+// milliseconds since fs was created, from the clock that is cheapest to
+// read; it wraps after 49 days, which differences of it survive
+unsigned fs_tick(Fs fs) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (now.tv_sec - fs->born.tv_sec) * 1000 + (now.tv_nsec - fs->born.tv_nsec) / 1000000;
+}
+
+// compress a few cold contents on the way out of an operation, at most
+// once a millisecond, leaving it to another thread that is at it already
+void compress_some(Fs fs) {
+    unsigned now = fs_tick(fs);
+    if (LOAD(fs->compressed_at) == now) {
+        return;
+    }
+#ifdef CONCURRENT
+    if (pthread_mutex_trylock(&fs->compress_lock) != 0) {
+        return;
+    }
+#endif
+    STORE(fs->compressed_at, now);
+    compress_cold(fs, LOAD(fs->cold_ms), COMPRESS_SCAN, COMPRESS_STEP);
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->compress_lock);
+#endif
+}
+
+// replace the contents no file has used for cold milliseconds with
+// compressed copies, going round the content table from where the last
+// call stopped, until scan slots are looked at or about step bytes are
+// compressed, returning the contents compressed. Holding every content
+// lock for reading keeps writers out while readers go on: one that has
+// the old content keeps it until it leaves the fs. Contents that don't
+// compress count as used, so they are only tried again after cold more.
+// The caller holds compress_lock with CONCURRENT.
+size_t compress_cold(Fs fs, unsigned cold, size_t scan, size_t step) {
+    unsigned now = fs_tick(fs);
+    size_t compressed = 0;
+    size_t bytes = 0;
+    content_lock_all(fs);
+    alloc_lock(fs);
+    size_t count = SlabCount(fs->contents);
+    alloc_unlock(fs);
+    for (size_t i = 0; i < scan && i < count && bytes < step; i++) {
+        alloc_lock(fs);
+        struct ContentSlot *slot = SlabAt(fs->contents, fs->compress_next++ % count);
+        Content c = (slot->refs > 0 && slot->views == 0) ? slot->content : NULL;
+        bool is_cold = c != NULL && now - LOAD(slot->touched) >= cold;
+        alloc_unlock(fs);
+        if (!is_cold || ContentCompressed(c) || ContentBytes(c) == 0) {
+            continue;
+        }
+        Content packed = ContentCompress(c, fs->chunk_cache);
+        bytes += ContentSize(c);
+        alloc_lock(fs);
+        if (packed != NULL && slot->views > 0) {
+            // a view took the content meanwhile
+            ContentFree(packed);
+            packed = NULL;
+        } else if (packed != NULL) {
+            ContentSetMeter(packed, &fs->resident);
+            ContentSetMeter(c, NULL);
+            STORE(slot->content, packed);
+        } else {
+            STORE(slot->touched, now);
+        }
+        alloc_unlock(fs);
+        if (packed == NULL) {
+            continue;
+        }
+        compressed++;
+#ifdef CONCURRENT
+        fs_retire(fs, c, content_retired);
+#else
+        ContentFree(c);
+#endif
+    }
+    content_unlock_all(fs);
+    return compressed;
+}
+
+// free a content a compressed copy replaced
+void content_retired(Fs fs, void *c) {
+    ContentFree(c);
+}
+
+// spill contents until they fit the budget, on the way out of an
+// operation, leaving it to another thread that is at it already
+void evict_some(Fs fs) {
+#ifdef CONCURRENT
+    if (pthread_mutex_trylock(&fs->spill_lock) != 0) {
+        return;
+    }
+#endif
+    evict_cold(fs);
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->spill_lock);
+#endif
+}
+
+// write contents out to the spill file, and read them through its mapping
+// from then on, until the ones left take no more than fs->budget. The
+// content table is gone round as a clock: a content used since the hand
+// last passed it gets one more round, so it is the ones used least
+// recently that go. Every content lock is held for reading as in
+// compress_cold, and a content with memory held elsewhere, in the image,
+// the block store or the spill file already, is passed over. The caller
+// holds spill_lock with CONCURRENT.
+void evict_cold(Fs fs) {
+    content_lock_all(fs);
+    alloc_lock(fs);
+    size_t count = SlabCount(fs->contents);
+    alloc_unlock(fs);
+    for (size_t i = 0; i < 2 * count && LOAD(fs->resident) > fs->budget; i++) {
+        alloc_lock(fs);
+        struct ContentSlot *slot = SlabAt(fs->contents, fs->evict_next++ % count);
+        Content c = (slot->refs > 0 && slot->views == 0) ? slot->content : NULL;
+        bool used = LOAD(slot->used);
+        STORE(slot->used, false);
+        alloc_unlock(fs);
+        if (c == NULL || used || ContentBytes(c) == 0) {
+            continue;
+        }
+        const char *data = SpillWrite(fs->spill, c);
+        if (data == NULL) {
+            break;
+        }
+        alloc_lock(fs);
+        bool viewed = slot->views > 0;  // a view took the content meanwhile
+        if (!viewed) {
+            Content mapped = ContentMap(data, ContentSize(c));
+            ContentSetMeter(mapped, &fs->resident);
+            ContentSetMeter(c, NULL);
+            STORE(slot->content, mapped);
+            slot->spill = data;
+        }
+        alloc_unlock(fs);
+        if (viewed) {
+            SpillRelease(fs->spill, data);
+            continue;
+        }
+#ifdef CONCURRENT
+        fs_retire(fs, c, content_retired);
+#else
+        ContentFree(c);
+#endif
+    }
+    content_unlock_all(fs);
+}
+
+// the body of cp for a single source path
+void copy_path(Fs fs, bool recursive, char *src, char *dest) {
+    struct PathResult from;
+    if (resolve_path(fs, src, &from) != PATH_OK) {
+        OutputPrintf(fs_out(fs), "cp: cannot stat \'%s\': %s\n", src, path_error(from.err));
+        return;
+    } else if (from.node == NULL) {
+        OutputPrintf(fs_out(fs), "cp: cannot stat \'%s\': No Such file or directory\n", src);
+        return;
+    }
+    Node node = from.node;
+    if (node->type == DIRECTORY && !recursive) {
+        OutputPrintf(fs_out(fs), "cp: -r not specified; omitting directory \'%s\'\n", src);
+        return;
+    }
+    struct PathResult to;
+    if (resolve_path(fs, dest, &to) != PATH_OK) {
+        OutputPrintf(fs_out(fs), "cp: cannot create \'%s\': %s\n", dest, path_error(to.err));
+        return;
+    }
+    Node dir = to.parent;
+    char *name = to.name;
+    int len = to.len;
+    Node target = to.node;
+    if (target != NULL && target->type == DIRECTORY) {
+        // copy into the directory, keeping the source's name
+        dir = target;
+        name = NAME(node);
+        len = strlen(name);
+        target = lookInDir(fs, dir, name, len);
+    }
+    if (node->type == DIRECTORY && is_within(dir, node)) {
+        OutputPrintf(fs_out(fs), "cp: cannot copy a directory, \'%s\', into itself, \'%s\'\n", src, dest);
+        return;
+    } else if (target == node) {
+        OutputPrintf(fs_out(fs), "cp: \'%s\' and \'%s\' are the same file\n", src, dest);
+        return;
+    }
+    unshare(fs, dir);
+    if (target == NULL) {
+        shadow_lock(fs);
+        dir_lock(fs, dir);
+#ifdef CONCURRENT
+        // another writer may have got there first
+        target = search_index(dir, name, len);
+#endif
+        bool removed = false;
+#ifdef CONCURRENT
+        removed = HAS_FLAG(dir, DETACHED);
+#endif
+        if (target == NULL && !removed) {
+            clone_here(fs, node, dir, name, len);
+        }
+        dir_unlock(fs, dir);
+        shadow_unlock(fs);
+        if (removed) {
+            OutputPrintf(fs_out(fs), "cp: cannot create \'%s\': No Such file or directory\n", dest);
+            return;
+        } else if (target == NULL) {
+            return;
+        }
+    }
+    if (node->type == DIRECTORY && target->type == DIRECTORY) {
+        // the directories are merged
+        copy_into(fs, node, target);
+    } else if (node->type == DIRECTORY) {
+        OutputPrintf(fs_out(fs), "cp: cannot overwrite non-directory \'%s\' with directory \'%s\'\n", dest, src);
+    } else if (target->type == DIRECTORY) {
+        OutputPrintf(fs_out(fs), "cp: cannot overwrite directory \'%s\' with non-directory\n", dest);
+    } else {
+        // the target shares the source's content from now on
+        unsigned id = content_ref(fs, node);
+        if (content_lock_live(fs, target)) {
+            content_release(fs, target);
+            target->content = id;
+            content_unlock(fs, target);
+        } else if (id != 0) {
+            slot_unref(fs, SlabAt(fs->contents, id - 1));
+        }
+    }
+}
+
+// copy the entries of the directory src into the directory dir, merging
+// the directories both have and overwriting the files
+void copy_into(Fs fs, Node src, Node dir) {
+    struct CopyWalk w = {malloc(16 * sizeof(Node)), 16};
+    w.dirs[0] = dir;
+    unshare(fs, dir);
+    // dir may be a pending copy itself
+    entries(fs, dir);
+    entries(fs, src);
+    walk_tree(fs, src, copy_entry, NULL, &w);
+    free(w.dirs);
+}
+
+// copy the entry e of a directory being copied by copy_into; only the
+// directories that are merged are walked into
+bool copy_entry(Fs fs, Node e, int depth, void *arg) {
+    struct CopyWalk *w = arg;
+    Node dir = w->dirs[depth - 1];
+    int len = strlen(NAME(e));
+    shadow_lock(fs);
+    dir_lock(fs, dir);
+    Node target = search_index(dir, NAME(e), len);
+    if (target == NULL) {
+        clone_here(fs, e, dir, NAME(e), len);
+    }
+    dir_unlock(fs, dir);
+    shadow_unlock(fs);
+    if (target == NULL) {
+        // copied
+    } else if (e->type == DIRECTORY && target->type == DIRECTORY) {
+        unshare(fs, target);
+        entries(fs, target);
+        entries(fs, e);
+        if (depth == w->cap) {
+            w->cap *= 2;
+            w->dirs = realloc(w->dirs, w->cap * sizeof(Node));
+        }
+        w->dirs[depth] = target;
+        return true;
+    } else if (e->type == DIRECTORY || target->type == DIRECTORY) {
+        OutputPrintf(fs_out(fs), "cp: cannot overwrite \'%s\' in \'%s\'\n", NAME(e), NAME(dir));
+    } else {
+        unsigned id = content_ref(fs, e);
+        content_lock(fs, target, true);
+        content_release(fs, target);
+        target->content = id;
+        content_unlock(fs, target);
+    }
+    return false;
+}
+
+// whether node is dir or lies somewhere below it
+bool is_within(Node node, Node dir) {
+    for (Node curr = node; curr != NULL; curr = LINK(curr, h_prev)) {
+        if (curr == dir) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// make a copy of src named name in dir in O(1): a file shares the
+// source's content and a directory is left as a pending copy, which gets
+// its entries on first use. The caller holds the shadow lock and the
+// directory's lock.
+Node clone_here(Fs fs, Node src, Node dir, char *name, int len) {
+    Node new = NewNode(fs, name, len, src->type);
+    SET_LINK(new, h_prev, dir);
+    if (src->type == DIRECTORY) {
+        SET_FLAG(new, SHADOW);
+        SET_LINK(new, index, src);
+        shadow_add(fs, src, new);
+    } else {
+        new->content = content_ref(fs, src);
+    }
+    Node prev = NULL;
+    Node next = NULL;
+    link_entry(dir, new, &prev, &next);
+    return new;
+}
+
+// the first entry of a directory, making the entries of a pending copy
+Node entries(Fs fs, Node dir) {
+    if (HAS_FLAG(dir, SHADOW)) {
+        shadow_lock(fs);
+        if (HAS_FLAG(dir, SHADOW)) {
+            materialize(fs, dir);
+        }
+        shadow_unlock(fs);
+    }
+    return LINK(dir, l_next);
+}
+
+// give a pending copy the entries of the directory it copies, one level
+// deep: files share their content and directories become pending copies
+// in turn. A copy of a copy needs its source's entries first, so the
+// chain of copies is done from its far end. The caller holds the shadow
+// lock.
+void materialize(Fs fs, Node copy) {
+    Node local[16];
+    size_t depth = 0;
+    for (Node c = copy; HAS_FLAG(c, SHADOW); c = LINK(c, index)) {
+        depth++;
+    }
+    Node *chain = (depth <= 16) ? local : malloc(depth * sizeof(Node));
+    size_t i = 0;
+    for (Node c = copy; HAS_FLAG(c, SHADOW); c = LINK(c, index)) {
+        chain[i++] = c;
+    }
+    while (i > 0) {
+        materialize_one(fs, chain[--i]);
+    }
+    if (chain != local) {
+        free(chain);
+    }
+}
+
+// materialize a pending copy of a directory that isn't one
+void materialize_one(Fs fs, Node copy) {
+    Node src = LINK(copy, index);
+    shadow_remove(fs, src, copy);
+    dir_lock(fs, copy);
+    SET_LINK(copy, l_next, NULL);
+    SET_LINK(copy, index, NULL);
+    for (Node e = LINK(src, l_next); e != NULL; e = LINK(e, next)) {
+        clone_here(fs, e, copy, NAME(e), strlen(NAME(e)));
+    }
+    CLEAR_FLAG(copy, SHADOW);
+    dir_unlock(fs, copy);
+}
+
+// about to change node: the pending copies of the directories from the
+// root down to it get their entries first, so they keep what they copied
+void unshare(Fs fs, Node node) {
+    if (LOAD(fs->shadowed) == 0) {
+        return;
+    }
+    size_t depth = 0;
+    for (Node curr = node; curr != NULL; curr = LINK(curr, h_prev)) {
+        depth++;
+    }
+    Node *path = malloc(depth * sizeof(Node));
+    size_t i = depth;
+    for (Node curr = node; curr != NULL; curr = LINK(curr, h_prev)) {
+        path[--i] = curr;
+    }
+    shadow_lock(fs);
+    // a copy made above pushes pending copies one level down
+    for (i = 0; i < depth; i++) {
+        while (HAS_FLAG(path[i], SHADOWED)) {
+            materialize(fs, MapGet(fs->shadows, path[i]));
+        }
+    }
+    shadow_unlock(fs);
+    free(path);
+}
+
+// record copy as a pending copy of src
+void shadow_add(Fs fs, Node src, Node copy) {
+    Node first = MapGet(fs->shadows, src);
+    SET_LINK(copy, l_next, first);
+    MapPut(fs->shadows, src, copy);
+    if (first == NULL) {
+        SET_FLAG(src, SHADOWED);
+        STORE(fs->shadowed, fs->shadowed + 1);
+    }
+}
+
+void shadow_remove(Fs fs, Node src, Node copy) {
+    Node first = MapGet(fs->shadows, src);
+    if (first == copy) {
+        Node next = LINK(copy, l_next);
+        if (next != NULL) {
+            MapPut(fs->shadows, src, next);
+        } else {
+            MapRemove(fs->shadows, src);
+            CLEAR_FLAG(src, SHADOWED);
+            STORE(fs->shadowed, fs->shadowed - 1);
+        }
+        return;
+    }
+    Node prev = first;
+    while (LINK(prev, l_next) != copy) {
+        prev = LINK(prev, l_next);
+    }
+    SET_LINK(prev, l_next, LINK(copy, l_next));
+}
+
+// look into the directory's search tree for the entry whose name is
+// the first len characters of name
+Node lookInDir (Fs fs, Node dir, char* name, int len) {
+    entries(fs, dir);
+#ifdef CONCURRENT
+    // search without locking, again if a writer changed the tree meanwhile
+    struct Stripe *stripe = stripe_of(fs, dir);
+    for (;;) {
+        unsigned seq = __atomic_load_n(&stripe->seq, __ATOMIC_ACQUIRE);
+        if (seq % 2 == 1) {
+            continue;
+        }
+        Node node = search_index(dir, name, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&stripe->seq, __ATOMIC_RELAXED) == seq) {
+            return node;
+        }
+    }
+#else
+    return search_index(dir, name, len);
+#endif
+}
+
+// walk down the search tree of dir
+Node search_index (Node dir, char *name, int len) {
+    Node node = LINK(dir, index);
+    while (node != NULL) {
+        int cmp = name_cmp(name, len, NAME(node));
+        if (cmp == 0) {
+            // find it
+            return node;
+        }
+        node = (cmp < 0) ? LINK(node, left) : LINK(node, right);
+    }
+    // not exist
+    return NULL;
+}
+
+// compare the first len characters of name with the string other
+int name_cmp (char *name, int len, char *other) {
+    int cmp = strncmp(name, other, len);
+    if (cmp == 0 && other[len] != '\0') {
+        // name is a proper prefix of other
+        return -1;
+    }
+    return cmp;
+}
+
+// the body of mkdir and mkfile: create path as a node of the given type
+void create_entry (Fs fs, char *cmd, char *path, FileType type) {
+    struct PathResult res;
+    if (resolve_path(fs, path, &res) != PATH_OK) {
+        char *err = is_root_parent(fs, path) ? "File exists" : path_error(res.err);
+        OutputPrintf(fs_out(fs), "%s: cannot create directory \'%s\': %s\n", cmd, path, err);
+        return;
+    }
+    Node exists = res.node;
+    if (exists == NULL) {
+        unshare(fs, res.parent);
+        dir_lock(fs, res.parent);
+        bool removed = false;
+#ifdef CONCURRENT
+        // another writer may have got there first, or removed the parent
+        exists = search_index(res.parent, res.name, res.len);
+        removed = HAS_FLAG(res.parent, DETACHED);
+#endif
+        if (exists == NULL && !removed) {
+            // this is the one we are creating
+            create_here(fs, res.parent, res.name, res.len, type);
+        }
+        dir_unlock(fs, res.parent);
+        if (removed) {
+            OutputPrintf(fs_out(fs), "%s: cannot create directory \'%s\': No Such file or directory\n", cmd, path);
+            return;
+        }
+        if (exists == NULL) {
+            dcache_created_in(fs, res.parent, res.name, res.len);
+        }
+    }
+    if (exists != NULL) {
+        // find a duplicated name
+        OutputPrintf(fs_out(fs), "%s: cannot create directory \'%s\': File exists\n", cmd, path);
+    }
+}
+
+// whether path ends in a ".." of the root, which mkdir and mkfile have
+// always reported as existing rather than missing
+bool is_root_parent(Fs fs, char *path) {
+    size_t end = strlen(path);
+    while (end > 0 && path[end - 1] == '/') {
+        end--;
+    }
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    if (end - start != 2 || strncmp(path + start, "..", 2) != 0 || start > PATH_MAX) {
+        return false;
+    }
+    char dir[PATH_MAX + 1];
+    memcpy(dir, path, start);
+    dir[start] = '\0';
+    struct PathResult res;
+    return resolve_path(fs, dir, &res) == PATH_OK && res.node == fs->root;
+}
+
+// the body of dldir and dl: remove what path names. dldir only removes
+// an empty directory, dl a file, or a directory and everything in it
+// when recursive. It is only journaled once it goes ahead, as whether a
+// directory is in use depends on the current directories. Those are held
+// from the check to the unlink, so no thread can cd into the directory
+// in between.
+void remove_entry (Fs fs, char *cmd, char *path, bool dir_only, bool recursive) {
+    struct PathResult res;
+    if (resolve_path(fs, path, &res) != PATH_OK) {
+        OutputPrintf(fs_out(fs), "%s: cannot remove \'%s\': %s\n", cmd, path, path_error(res.err));
+        return;
+    }
+    Node node = res.node;
+    char *err = NULL;
+    if (node == NULL) {
+        err = "No Such file or directory";
+    } else if (dir_only && node->type != DIRECTORY) {
+        err = "Not a directory";
+    } else if (!dir_only && !recursive && node->type == DIRECTORY) {
+        err = "Is a directory";
+    }
+    if (err != NULL) {
+        OutputPrintf(fs_out(fs), "%s: cannot remove \'%s\': %s\n", cmd, path, err);
+        return;
+    }
+    Node dir = LINK(node, h_prev);
+    unshare(fs, node);
+    cwd_lock(fs);
+    if (in_use(fs, node)) {
+        // the root, or where some thread is
+        err = "Device or resource busy";
+    } else if (dir_only && entries(fs, node) != NULL) {
+        err = "Directory not empty";
+    } else {
+        dir_lock(fs, dir);
+#ifdef CONCURRENT
+        // another writer may have got there first
+        if (search_index(dir, NAME(node), strlen(NAME(node))) != node) {
+            err = "No Such file or directory";
+        }
+#endif
+        if (err == NULL) {
+            if (fs->journal != NULL) {
+                journal_log(fs, dir_only ? OP_DLDIR : OP_DL, recursive, NULL, path, NULL, 0, 0);
+            }
+            unlink_entry(dir, node);
+        }
+        dir_unlock(fs, dir);
+        if (err == NULL && node->type == DIRECTORY) {
+            // writers that found it before the unlink make nothing in it
+            dir_lock(fs, node);
+            SET_FLAG(node, DETACHED);
+            dir_unlock(fs, node);
+        }
+    }
+    cwd_unlock(fs);
+    if (err != NULL) {
+        OutputPrintf(fs_out(fs), "%s: cannot remove \'%s\': %s\n", cmd, path, err);
+    } else if (node->type == DIRECTORY && recursive) {
+        detach(fs, node);
+    } else {
+        NodeFree(fs, node);
+    }
+}
+
+// whether node is some thread's current directory or lies above it; the
+// caller holds the current directories (see cwd_lock)
+bool in_use(Fs fs, Node node) {
+#ifdef CONCURRENT
+    bool used = false;
+    for (struct FsThread *t = fs->threads; t != NULL && !used; t = t->next) {
+        used = is_within(t->curr_dir, node);
+    }
+    return used;
+#else
+    return is_within(fs->main.curr_dir, node);
+#endif
+}
+
+// whether node, or a directory above it, has been removed
+bool is_detached(Node node) {
+    for (Node curr = node; curr != NULL; curr = LINK(curr, h_prev)) {
+        if (HAS_FLAG(curr, DETACHED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// mark dir, about to be freed, as removed unless an entry has been made
+// in it meanwhile; returns whether it was
+bool seal(Fs fs, Node dir) {
+    dir_lock(fs, dir);
+    bool empty = HAS_FLAG(dir, SHADOW) || LINK(dir, l_next) == NULL;
+    if (empty) {
+        SET_FLAG(dir, DETACHED);
+    }
+    dir_unlock(fs, dir);
+    return empty;
+}
+
+// create a new entry in dir, keeping both the search tree and the
+// canonical-order list of entries up to date; the caller holds the
+// directory's lock
+Node create_here (Fs fs, Node dir, char *name, int len, FileType type) {
+    Node new = NewNode(fs, name, len, type);
+    SET_LINK(new, h_prev, dir);
+    Node prev = NULL;
+    Node next = NULL;
+    link_entry(dir, new, &prev, &next);
+    Output out = fs_out(fs);
+    OutputPrintf(out, "created %s under %s ", NAME(new), NAME(dir));
+    if (prev != NULL && next != NULL) {
+        OutputPrintf(out, "after %s before %s\n", NAME(prev), NAME(next));
+    } else if (prev != NULL) {
+        OutputPrintf(out, "after %s\n", NAME(prev));
+    } else if (next != NULL) {
+        OutputPrintf(out, "before %s\n", NAME(next));
+    } else {
+        OutputWrite(out, "\n", 1);
+    }
+    return new;
+}
+
+// write path, made absolute from cwd, into buf and split it into parent
+// and name. A path with a "." or ".." in it is only copied: what it names
+// depends on what the names before them are, so it isn't grouped.
+void batch_split(char *cwd, char *path, char *buf, struct BatchItem *item) {
+    size_t len = 0;
+    if (path[0] != '/') {
+        len = strlen(cwd);
+        memcpy(buf, cwd, len);
+    }
+    item->group = 0;
+    char *p = path;
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        char *name = p;
+        while (*p != '\0' && *p != '/') {
+            p++;
+        }
+        size_t name_len = p - name;
+        if (name_len == 0) {
+            break;
+        } else if (name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.'))) {
+            item->group = -1;
+        }
+        if (len == 0 || buf[len - 1] != '/') {
+            buf[len++] = '/';
+        }
+        memcpy(buf + len, name, name_len);
+        len += name_len;
+    }
+    if (len == 0) {
+        buf[len++] = '/';
+    }
+    buf[len] = '\0';
+    item->path = buf;
+    char *slash = strrchr(buf, '/');
+    item->parent_len = slash - buf;
+    item->name_len = len - item->parent_len - 1;
+    if (item->name_len == 0) {
+        // the root itself
+        item->parent_len = 1;
+    }
+    item->hash = 2166136261u;
+    for (int i = 0; i < item->parent_len; i++) {
+        item->hash = (item->hash ^ (unsigned char)buf[i]) * 16777619u;
+    }
+}
+
+// parents in name order, which puts a directory before its subdirectories
+int batch_group_cmp(const void *a, const void *b) {
+    const struct BatchGroup *x = a;
+    const struct BatchGroup *y = b;
+    int len = (x->parent_len < y->parent_len) ? x->parent_len : y->parent_len;
+    int cmp = memcmp(x->parent, y->parent, len);
+    return (cmp != 0) ? cmp : x->parent_len - y->parent_len;
+}
+
+// names in directory order, operations on one name in batch order
+int batch_item_cmp(const void *a, const void *b) {
+    const struct BatchItem *x = a;
+    const struct BatchItem *y = b;
+    int cmp = strcmp(x->path + x->parent_len + 1, y->path + y->parent_len + 1);
+    return (cmp != 0) ? cmp : x->index - y->index;
+}
+
+// apply the operations of one group: resolve the parent once, then merge
+// the sorted names into its sorted entry list in a single pass and
+// rebuild its search tree, using stack (of *cap nodes) for that. A
+// directory with many more entries than the group gets single insertions
+// instead, as does every directory with CONCURRENT.
+void batch_apply(Fs fs, struct FsOp ops[], FsStatus status[], struct BatchGroup *g,
+                 struct BatchItem *items, Node **stack, size_t *cap) {
+    struct BatchItem *first = &items[g->start];
+    struct BatchItem *end = first + g->count;
+    char saved = g->parent[g->parent_len];
+    g->parent[g->parent_len] = '\0';
+    struct PathResult res;
+    PathError err = resolve_path(fs, (g->parent_len > 0) ? g->parent : "/", &res);
+    g->parent[g->parent_len] = saved;
+    Node dir = res.node;
+    FsStatus dir_status = (err == PATH_NOT_DIR) ? FS_NOT_DIR :
+                          (err != PATH_OK || dir == NULL) ? FS_NOT_FOUND :
+                          (dir->type != DIRECTORY) ? FS_NOT_DIR : FS_OK;
+    if (dir_status != FS_OK) {
+        for (struct BatchItem *item = first; item < end; item++) {
+            if (status[item->index] == FS_OK) {
+                status[item->index] = dir_status;
+            }
+        }
+        return;
+    }
+    unshare(fs, dir);
+    entries(fs, dir);
+    dir_lock(fs, dir);
+#ifdef CONCURRENT
+    if (HAS_FLAG(dir, DETACHED)) {
+        // the parent was removed after it was found
+        dir_unlock(fs, dir);
+        for (struct BatchItem *item = first; item < end; item++) {
+            if (status[item->index] == FS_OK) {
+                status[item->index] = FS_NOT_FOUND;
+            }
+        }
+        return;
+    }
+#endif
+    Node prev = NULL;
+    Node cursor = LINK(dir, l_next);
+    bool merge = false;
+    bool created = false;
+#ifndef CONCURRENT
+    // lookups may be walking the search tree with CONCURRENT, and it may
+    // only change by single insertions then
+    int entries = 0;
+    for (Node n = cursor; n != NULL && entries <= 8 * g->count; n = LINK(n, next)) {
+        entries++;
+    }
+    merge = entries <= 8 * g->count;
+#endif
+    for (struct BatchItem *item = first; item < end; item++) {
+        struct FsOp *op = &ops[item->index];
+        char *name = item->path + item->parent_len + 1;
+        if (status[item->index] != FS_OK) {
+            continue;
+        } else if (item->name_len == 0) {
+            // the root
+            status[item->index] = (op->type == FS_PUT || op->type == FS_ADOPT) ? FS_IS_DIR : FS_EXISTS;
+            continue;
+        }
+        Node found = NULL;
+        if (merge) {
+            // move along the entries to where name is or would be
+            while (cursor != NULL && strcmp(NAME(cursor), name) < 0) {
+                prev = cursor;
+                cursor = LINK(cursor, next);
+            }
+            found = (cursor != NULL && strcmp(NAME(cursor), name) == 0) ? cursor :
+                    (prev != NULL && strcmp(NAME(prev), name) == 0) ? prev : NULL;
+        } else {
+            found = search_index(dir, name, item->name_len);
+        }
+        if (op->type == FS_PUT || op->type == FS_ADOPT) {
+            if (found == NULL) {
+                status[item->index] = FS_NOT_FOUND;
+            } else if (found->type == DIRECTORY) {
+                status[item->index] = FS_IS_DIR;
+            } else {
+                status[item->index] = batch_put(fs, found, op);
+            }
+            continue;
+        } else if (found != NULL) {
+            status[item->index] = FS_EXISTS;
+            continue;
+        }
+        Node new = NewNode(fs, name, item->name_len,
+                           (op->type == FS_MKDIR) ? DIRECTORY : REGULAR_FILE);
+        SET_LINK(new, h_prev, dir);
+        if (merge) {
+            SET_LINK(new, next, cursor);
+            if (prev != NULL) {
+                SET_LINK(prev, next, new);
+            } else {
+                SET_LINK(dir, l_next, new);
+            }
+            prev = new;
+            created = true;
+        } else {
+            Node before = NULL;
+            Node after = NULL;
+            link_entry(dir, new, &before, &after);
+        }
+    }
+    if (created) {
+        // the entries are in order, build their search tree in one go
+        index_rebuild(dir, stack, cap);
+    }
+    dir_unlock(fs, dir);
+    for (struct BatchItem *item = first; item < end; item++) {
+        FsOpType type = ops[item->index].type;
+        if (status[item->index] == FS_OK && (type == FS_MKDIR || type == FS_MKFILE)) {
+            dcache_created(fs, item->path, item->parent_len + 1 + item->name_len);
+        }
+    }
+}
+
+// apply an operation of a batch on its own, like FsMkdir, FsMkfile or
+// FsPut but without printing
+FsStatus batch_one(Fs fs, struct FsOp *op) {
+    struct PathResult res;
+    if (resolve_path(fs, op->path, &res) != PATH_OK) {
+        return (res.err == PATH_NOT_DIR) ? FS_NOT_DIR : FS_NOT_FOUND;
+    }
+    Node node = res.node;
+    if (op->type == FS_PUT || op->type == FS_ADOPT) {
+        if (node == NULL) {
+            return FS_NOT_FOUND;
+        } else if (node->type == DIRECTORY) {
+            return FS_IS_DIR;
+        }
+        unshare(fs, LINK(node, h_prev));
+        return batch_put(fs, node, op);
+    }
+    if (node == NULL) {
+        unshare(fs, res.parent);
+        dir_lock(fs, res.parent);
+#ifdef CONCURRENT
+        node = search_index(res.parent, res.name, res.len);
+        if (HAS_FLAG(res.parent, DETACHED)) {
+            // the parent was removed after it was found
+            dir_unlock(fs, res.parent);
+            return FS_NOT_FOUND;
+        }
+#endif
+        if (node == NULL) {
+            Node new = NewNode(fs, res.name, res.len,
+                               (op->type == FS_MKDIR) ? DIRECTORY : REGULAR_FILE);
+            SET_LINK(new, h_prev, res.parent);
+            Node before = NULL;
+            Node after = NULL;
+            link_entry(res.parent, new, &before, &after);
+        }
+        dir_unlock(fs, res.parent);
+        if (node == NULL) {
+            dcache_created_in(fs, res.parent, res.name, res.len);
+        }
+    }
+    return (node == NULL) ? FS_OK : FS_EXISTS;
+}
+
+// set the content of a regular file as an FS_PUT or FS_ADOPT of a batch
+// says, like put; FS_NOT_FOUND if the file has been removed meanwhile
+FsStatus batch_put(Fs fs, Node file, struct FsOp *op) {
+    if (!content_lock_live(fs, file)) {
+        return FS_NOT_FOUND;
+    }
+    if (op->type == FS_ADOPT && LOAD(fs->dedup)) {
+        content_replace(fs, file, ContentDedup(fs->store, op->content, op->len));
+        free(op->content);
+    } else if (op->type == FS_ADOPT) {
+        content_replace(fs, file, ContentAdopt(op->content, op->len));
+    } else {
+        Content c = file_content(fs, file);
+        size_t len = strlen(op->content);
+        ContentTruncate(c, len);
+        ContentWrite(c, 0, op->content, len);
+    }
+    content_unlock(fs, file);
+    return FS_OK;
+}
+
+// log an operation of a batch, at path made absolute
+void batch_log(Fs fs, struct FsOp *op, char *path) {
+    JournalOp jop = (op->type == FS_MKDIR) ? OP_MKDIR :
+                    (op->type == FS_MKFILE) ? OP_MKFILE : OP_PUT;
+    char *data = (op->type == FS_PUT || op->type == FS_ADOPT) ? op->content : NULL;
+    size_t len = (op->type == FS_ADOPT) ? op->len : (data != NULL) ? strlen(data) : 0;
+    journal_log(fs, jop, false, NULL, path, data, len, 0);
+}
+
+// rebuild the search tree of dir from its entry list, which is in name
+// order: each entry pops the entries of lower priority off the right
+// spine, which become its left subtree
+void index_rebuild(Node dir, Node **stack, size_t *cap) {
+    size_t depth = 0;
+    for (Node n = LINK(dir, l_next); n != NULL; n = LINK(n, next)) {
+        if (depth == *cap) {
+            *cap = (*cap == 0) ? 64 : *cap * 2;
+            *stack = realloc(*stack, *cap * sizeof(Node));
+        }
+        Node last = NULL;
+        while (depth > 0 && (*stack)[depth - 1]->prio < n->prio) {
+            last = (*stack)[--depth];
+        }
+        SET_LINK(n, left, last);
+        SET_LINK(n, right, NULL);
+        if (depth > 0) {
+            SET_LINK((*stack)[depth - 1], right, n);
+        }
+        (*stack)[depth++] = n;
+    }
+    SET_LINK(dir, index, (depth > 0) ? (*stack)[0] : NULL);
+}
+
+// add the complete node new to dir's search tree and entry list; prev
+// and next are set to its neighbours in the list
+void link_entry (Node dir, Node new, Node *prev, Node *next) {
+    index_insert(dir, new, prev, next);
+    // the closest names met on the way down are the new neighbours;
+    // new is complete before the list can reach it
+    SET_LINK(new, next, *next);
+    if (*prev != NULL) {
+        SET_LINK(*prev, next, new);
+    } else {
+        SET_LINK(dir, l_next, new);
+    }
+}
+
+// take old out of dir's search tree and entry list; the caller holds the
+// directory's lock
+void unlink_entry (Node dir, Node old) {
+    Node prev = index_remove(dir, old);
+    if (prev != NULL) {
+        SET_LINK(prev, next, LINK(old, next));
+    } else {
+        SET_LINK(dir, l_next, LINK(old, next));
+    }
+}
+
+// insert new into dir's search tree; prev and next are set to the
+// in-order neighbours of new. new goes where the first node on its
+// search path with a lower priority was, and that node's subtree is
+// split by name into new's two subtrees.
+void index_insert (Node dir, Node new, Node *prev, Node *next) {
+    char *name = NAME(new);
+    Node parent = NULL;
+    bool is_left = false;
+    Node node = LINK(dir, index);
+    while (node != NULL && node->prio >= new->prio) {
+        parent = node;
+        is_left = strcmp(name, NAME(node)) < 0;
+        if (is_left) {
+            *next = node;
+            node = LINK(node, left);
+        } else {
+            *prev = node;
+            node = LINK(node, right);
+        }
+    }
+    // the smaller names hang off the left of new, the larger ones off
+    // its right, each side ending where the last node was attached
+    Node small = new;
+    bool small_left = true;
+    Node large = new;
+    bool large_left = false;
+    while (node != NULL) {
+        if (strcmp(name, NAME(node)) < 0) {
+            *next = node;
+            set_child(dir, large, large_left, node);
+            large = node;
+            large_left = true;
+            node = LINK(node, left);
+        } else {
+            *prev = node;
+            set_child(dir, small, small_left, node);
+            small = node;
+            small_left = false;
+            node = LINK(node, right);
+        }
+    }
+    set_child(dir, small, small_left, NULL);
+    set_child(dir, large, large_left, NULL);
+    set_child(dir, parent, is_left, new);
+}
+
+// take old out of dir's search tree, merging its subtrees in its place,
+// and return the entry before it
+Node index_remove (Node dir, Node old) {
+    char *name = NAME(old);
+    Node parent = NULL;
+    bool is_left = false;
+    Node prev = NULL;
+    Node node = LINK(dir, index);
+    while (node != old) {
+        parent = node;
+        is_left = strcmp(name, NAME(node)) < 0;
+        if (!is_left) {
+            prev = node;
+        }
+        node = is_left ? LINK(node, left) : LINK(node, right);
+    }
+    Node small = LINK(old, left);
+    Node large = LINK(old, right);
+    if (small != NULL) {
+        prev = small;
+        while (LINK(prev, right) != NULL) {
+            prev = LINK(prev, right);
+        }
+    }
+    // the side whose top has the higher priority goes above the other
+    while (small != NULL && large != NULL) {
+        if (small->prio >= large->prio) {
+            set_child(dir, parent, is_left, small);
+            parent = small;
+            is_left = false;
+            small = LINK(small, right);
+        } else {
+            set_child(dir, parent, is_left, large);
+            parent = large;
+            is_left = true;
+            large = LINK(large, left);
+        }
+    }
+    set_child(dir, parent, is_left, (small != NULL) ? small : large);
+    return prev;
+}
+
+// make child the left or right child of parent in dir's search tree, or
+// the root of the tree if parent is NULL
+void set_child (Node dir, Node parent, bool is_left, Node child) {
+    if (parent == NULL) {
+        SET_LINK(dir, index, child);
+    } else if (is_left) {
+        SET_LINK(parent, left, child);
+    } else {
+        SET_LINK(parent, right, child);
+    }
+}
+
+// FNV-1a hash of a name, used as the treap priority
+unsigned name_hash (char *name) {
+    unsigned hash = 2166136261u;
+    for (unsigned char *c = (unsigned char *)name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#ifdef COMPACT_NODES
+// the node a link stored in n points to
+static inline Node link_at(Node n, Link distance) {
+    return (distance != 0) ? n + distance : NULL;
+}
+#endif
+
+// the calling thread's state for fs
+struct FsThread *fs_self(Fs fs) {
+#ifdef CONCURRENT
+    if (cached_thread.id == fs->id) {
+        return cached_thread.me;
+    }
+    pthread_t thread = pthread_self();
+    pthread_mutex_lock(&fs->threads_lock);
+    struct FsThread *me = fs->threads;
+    while (me != NULL && !pthread_equal(me->thread, thread)) {
+        me = me->next;
+    }
+    if (me == NULL) {
+        // first call from this thread
+        me = malloc(sizeof(struct FsThread));
+        thread_init(fs, me);
+        me->thread = thread;
+        me->epoch = 0;
+        me->retired = NULL;
+        me->nretired = 0;
+        me->retired_cap = 0;
+        me->next = fs->threads;
+        fs->threads = me;
+    }
+    pthread_mutex_unlock(&fs->threads_lock);
+    cached_thread.id = fs->id;
+    cached_thread.me = me;
+    return me;
+#else
+    return &fs->main;
+#endif
+}
+
+// start a thread off in the root directory
+void thread_init(Fs fs, struct FsThread *me) {
+    me->curr_dir = fs->root;
+    me->cwd_cap = 64;
+    me->cwd = malloc(me->cwd_cap);
+    strcpy(me->cwd, "/");
+    me->cwd_len = 1;
+    me->out = OutputNew(fs_write, fs);
+    OutputSetColored(me->out, fs->colored);
+    me->depth = 0;
+#ifdef STATS
+    memset(me->stats, 0, sizeof(me->stats));
+#endif
+}
+
+// where the calling thread prints
+Output fs_out(Fs fs) {
+    return fs_self(fs)->out;
+}
+
+// the writer of every thread's Output
+void fs_write(void *arg, const char *buf, size_t len) {
+    Fs fs = arg;
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->output_lock);
+#endif
+    fs->write(fs->write_arg, buf, len);
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->output_lock);
+#endif
+}
+
+void stdout_write(void *arg, const char *buf, size_t len) {
+    fwrite(buf, 1, len, stdout);
+}
+
+// mark the start of a public operation; with CONCURRENT, nothing the
+// thread reaches from here on is reused before the matching fs_exit
+void fs_enter(Fs fs) {
+#ifdef CONCURRENT
+    struct FsThread *me = fs_self(fs);
+    if (me->depth++ == 0) {
+        unsigned long epoch = __atomic_load_n(&fs->epoch, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&me->epoch, epoch, __ATOMIC_SEQ_CST);
+    }
+#else
+    fs->main.depth++;
+#endif
+}
+
+// mark the end of a public operation, which frees a few detached nodes,
+// compresses a few cold contents and spills what is over the memory
+// budget on its way out
+void fs_exit(Fs fs) {
+    struct FsThread *me = fs_self(fs);
+    if (me->depth == 1 && LOAD(fs->detached) != NULL) {
+        free_detached(fs, DETACHED_STEP, false);
+    }
+    if (me->depth == 1 && LOAD(fs->cold_ms) >= 0) {
+        compress_some(fs);
+    }
+    if (me->depth == 1 && fs->budget > 0 && LOAD(fs->resident) > fs->budget) {
+        evict_some(fs);
+    }
+    if (--me->depth > 0) {
+        return;
+    }
+#ifdef CONCURRENT
+    __atomic_store_n(&me->epoch, 0, __ATOMIC_RELEASE);
+    OutputFlush(me->out);
+    if (me->nretired >= 64) {
+        fs_reclaim(fs, me);
+    }
+#else
+    OutputFlush(me->out);
+#endif
+}
+
+#ifdef CONCURRENT
+// release obj once every thread inside the fs has moved past the
+// current epoch
+void fs_retire(Fs fs, void *obj, void (*release)(Fs fs, void *obj)) {
+    struct FsThread *me = fs_self(fs);
+    if (me->nretired == me->retired_cap) {
+        me->retired_cap = (me->retired_cap == 0) ? 64 : me->retired_cap * 2;
+        me->retired = realloc(me->retired, me->retired_cap * sizeof(struct Retired));
+    }
+    struct Retired *r = &me->retired[me->nretired++];
+    r->obj = obj;
+    r->release = release;
+    r->epoch = __atomic_load_n(&fs->epoch, __ATOMIC_SEQ_CST);
+}
+
+// advance the global epoch if every thread inside the fs has seen it,
+// then release what was retired two or more epochs ago: no reader that
+// could have reached it is still inside
+void fs_reclaim(Fs fs, struct FsThread *me) {
+    pthread_mutex_lock(&fs->threads_lock);
+    unsigned long epoch = __atomic_load_n(&fs->epoch, __ATOMIC_SEQ_CST);
+    bool advance = true;
+    for (struct FsThread *t = fs->threads; t != NULL; t = t->next) {
+        unsigned long seen = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+        if (seen != 0 && seen != epoch) {
+            advance = false;
+        }
+    }
+    if (advance) {
+        __atomic_compare_exchange_n(&fs->epoch, &epoch, epoch + 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&fs->threads_lock);
+    unsigned long now = __atomic_load_n(&fs->epoch, __ATOMIC_SEQ_CST);
+    size_t kept = 0;
+    for (size_t i = 0; i < me->nretired; i++) {
+        struct Retired r = me->retired[i];
+        if (r.epoch + 2 <= now) {
+            r.release(fs, r.obj);
+        } else {
+            me->retired[kept++] = r;
+        }
+    }
+    me->nretired = kept;
+}
+
+// the lock stripe a node maps to
+struct Stripe *stripe_of(Fs fs, Node node) {
+    uintptr_t key = (uintptr_t)node / sizeof(struct FsNode);
+    return &fs->stripes[(key * 2654435761u) % STRIPES];
+}
+#endif
+
+// take a directory for writing
+void dir_lock(Fs fs, Node dir) {
+#ifdef CONCURRENT
+    struct Stripe *stripe = stripe_of(fs, dir);
+    pthread_mutex_lock(&stripe->lock);
+    __atomic_add_fetch(&stripe->seq, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void dir_unlock(Fs fs, Node dir) {
+#ifdef CONCURRENT
+    struct Stripe *stripe = stripe_of(fs, dir);
+    __atomic_add_fetch(&stripe->seq, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&stripe->lock);
+#endif
+}
+
+// take a file's content for reading (shared) or writing
+void content_lock(Fs fs, Node file, bool write) {
+#ifdef CONCURRENT
+    pthread_rwlock_t *lock = &fs->content_locks[stripe_of(fs, file) - fs->stripes];
+    if (write) {
+        pthread_rwlock_wrlock(lock);
+    } else {
+        pthread_rwlock_rdlock(lock);
+    }
+#endif
+}
+
+void content_unlock(Fs fs, Node file) {
+#ifdef CONCURRENT
+    pthread_rwlock_unlock(&fs->content_locks[stripe_of(fs, file) - fs->stripes]);
+#endif
+}
+
+// take a file's content for writing, unless the file has been removed
+// since it was found: then it is left alone and false returned
+bool content_lock_live(Fs fs, Node file) {
+    content_lock(fs, file, true);
+    if (HAS_FLAG(file, DETACHED)) {
+        content_unlock(fs, file);
+        return false;
+    }
+    return true;
+}
+
+// take every file's content for reading, in stripe order
+void content_lock_all(Fs fs) {
+#ifdef CONCURRENT
+    for (int i = 0; i < STRIPES; i++) {
+        pthread_rwlock_rdlock(&fs->content_locks[i]);
+    }
+#endif
+}
+
+void content_unlock_all(Fs fs) {
+#ifdef CONCURRENT
+    for (int i = 0; i < STRIPES; i++) {
+        pthread_rwlock_unlock(&fs->content_locks[i]);
+    }
+#endif
+}
+
+// take the pending copies for changing or materializing
+void shadow_lock(Fs fs) {
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->shadow_lock);
+#endif
+}
+
+void shadow_unlock(Fs fs) {
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->shadow_lock);
+#endif
+}
+
+// take the current directories of all threads: none of them changes
+// while it is held, so a directory found not to be in use stays so
+void cwd_lock(Fs fs) {
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->threads_lock);
+#endif
+}
+
+void cwd_unlock(Fs fs) {
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->threads_lock);
+#endif
+}
+
+// take the allocators shared by all writers
+void alloc_lock(Fs fs) {
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->alloc_lock);
+#endif
+}
+
+void alloc_unlock(Fs fs) {
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&fs->alloc_lock);
+#endif
+}
+
+// update a thread's cached current path for a cd along path, which has
+// already been resolved successfully
+void cwd_follow(struct FsThread *me, char *path) {
+    if (path[0] == '/') {
+        me->cwd_len = 1;
+    }
+    char *p = path;
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        char *name = p;
+        while (*p != '\0' && *p != '/') {
+            p++;
+        }
+        size_t len = p - name;
+        if (len == 0 || (len == 1 && name[0] == '.')) {
+            // stay in the same directory
+        } else if (len == 2 && name[0] == '.' && name[1] == '.') {
+            // drop the last name, keeping the leading "/"
+            while (me->cwd_len > 1 && me->cwd[me->cwd_len - 1] != '/') {
+                me->cwd_len--;
+            }
+            if (me->cwd_len > 1) {
+                me->cwd_len--;
+            }
+        } else {
+            cwd_append(me, name, len);
+        }
+    }
+    me->cwd[me->cwd_len] = '\0';
+}
+
+// add "/name" to a thread's cached current path
+void cwd_append(struct FsThread *me, char *name, size_t len) {
+    if (me->cwd_len + len + 2 > me->cwd_cap) {
+        while (me->cwd_len + len + 2 > me->cwd_cap) {
+            me->cwd_cap *= 2;
+        }
+        me->cwd = realloc(me->cwd, me->cwd_cap);
+    }
+    if (me->cwd_len > 1) {
+        me->cwd[me->cwd_len++] = '/';
+    }
+    memcpy(me->cwd + me->cwd_len, name, len);
+    me->cwd_len += len;
+}
+
+// write the canonical path of node into buf in one walk up to the root,
+// filling buf from its end and moving the result to the front; returns
+// the length of the path or -1 if it needs more than size bytes
+int node_path(Node node, char *buf, size_t size) {
+    char *start = buf + size - 1;
+    *start = '\0';
+    for (Node curr = node; LINK(curr, h_prev) != NULL; curr = LINK(curr, h_prev)) {
+        size_t len = strlen(NAME(curr));
+        if ((size_t)(start - buf) < len + 1) {
+            return -1;
+        }
+        start -= len;
+        memcpy(start, NAME(curr), len);
+        *--start = '/';
+    }
+    if (*start == '\0') {
+        // the root
+        if (start == buf) {
+            return -1;
+        }
+        *--start = '/';
+    }
+    int len = buf + size - 1 - start;
+    memmove(buf, start, len + 1);
+    return len;
+}
+
+// print the entries below dir, indented by their depth
+void tree(Fs fs, Node dir) {
+    entries(fs, dir);
+    walk_tree(fs, dir, tree_entry, NULL, fs_out(fs));
+}
+
+// count node into the struct FsStats at arg
+bool stats_entry(Fs fs, Node node, int depth, void *arg) {
+    struct FsStats *stats = arg;
+    if (node->type == DIRECTORY) {
+        stats->directories++;
+        size_t n = fan_out(node);
+        if (n > stats->max_fanout) {
+            stats->max_fanout = n;
+        }
+    } else {
+        stats->files++;
+    }
+    stats->name_bytes += strlen(NAME(node));
+    if ((size_t)depth > stats->max_depth) {
+        stats->max_depth = depth;
+    }
+    return true;
+}
+
+// the entries of dir, 0 for a pending copy
+size_t fan_out(Node dir) {
+    size_t n = 0;
+    if (!HAS_FLAG(dir, SHADOW)) {
+        for (Node e = LINK(dir, l_next); e != NULL; e = LINK(e, next)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+bool tree_entry(Fs fs, Node node, int depth, void *arg) {
+    Output out = arg;
+    OutputPad(out, 4 * depth);
+    listFile(out, NAME(node), node->type);
+    OutputWrite(out, "\n", 1);
+    if (node->type == DIRECTORY) {
+        entries(fs, node);
+    }
+    return true;
+}
+
+#ifdef STATS
+uint64_t stat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#ifdef CONCURRENT
+#define STAT_ADD(x, v) __atomic_store_n(&(x), (x) + (v), __ATOMIC_RELAXED)
+#define STAT_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(x, v) ((x) += (v))
+#define STAT_LOAD(x) (x)
+#endif
+
+// count a call to op that started at start
+void stat_record(Fs fs, StatOp op, uint64_t start) {
+    uint64_t ns = stat_now() - start;
+    int bucket = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= STAT_BUCKETS) {
+        bucket = STAT_BUCKETS - 1;
+    }
+    struct OpStats *s = &fs_self(fs)->stats[op];
+    STAT_ADD(s->calls, 1);
+    STAT_ADD(s->ns, ns);
+    STAT_ADD(s->buckets[bucket], 1);
+}
+
+// add the calls counted by me to total
+void stat_add(struct OpStats total[], struct FsThread *me) {
+    for (int op = 0; op < STAT_OPS; op++) {
+        total[op].calls += STAT_LOAD(me->stats[op].calls);
+        total[op].ns += STAT_LOAD(me->stats[op].ns);
+        for (int b = 0; b < STAT_BUCKETS; b++) {
+            total[op].buckets[b] += STAT_LOAD(me->stats[op].buckets[b]);
+        }
+    }
+}
+
+// the calls of every thread, added up, with cumulative histograms in the
+// form Prometheus scrapes
+void stat_dump(Fs fs, Output out) {
+    struct OpStats total[STAT_OPS];
+    memset(total, 0, sizeof(total));
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->threads_lock);
+    for (struct FsThread *me = fs->threads; me != NULL; me = me->next) {
+        stat_add(total, me);
+    }
+    pthread_mutex_unlock(&fs->threads_lock);
+#else
+    stat_add(total, &fs->main);
+#endif
+    for (int op = 0; op < STAT_OPS; op++) {
+        struct OpStats *s = &total[op];
+        if (s->calls == 0) {
+            continue;
+        }
+        char *name = stat_names[op];
+        OutputPrintf(out, "fs_op_calls{op=\"%s\"} %lu\n", name, (unsigned long)s->calls);
+        OutputPrintf(out, "fs_op_ns_total{op=\"%s\"} %lu\n", name, (unsigned long)s->ns);
+        int last = STAT_BUCKETS - 1;
+        while (s->buckets[last] == 0) {
+            last--;
+        }
+        uint64_t seen = 0;
+        for (int b = 0; b <= last; b++) {
+            seen += s->buckets[b];
+            OutputPrintf(out, "fs_op_latency_ns_bucket{op=\"%s\",le=\"%lu\"} %lu\n",
+                         name, 1ul << b, (unsigned long)seen);
+        }
+        OutputPrintf(out, "fs_op_latency_ns_bucket{op=\"%s\",le=\"+Inf\"} %lu\n",
+                     name, (unsigned long)s->calls);
+    }
+}
+#endif
+
+// visit every node below dir, calling pre before walking a node's
+// entries and post after. The walk finds its way back up through h_prev,
+// so it takes no memory however wide or deep the tree is, and post may
+// free the node it is given. Pending copies are passed as the single
+// node they are; pre can make their entries with entries() to walk them.
+void walk_tree(Fs fs, Node dir, Visitor pre, Visitor post, void *arg) {
+    if (dir->type != DIRECTORY || HAS_FLAG(dir, SHADOW)) {
+        return;
+    }
+    Node node = LINK(dir, l_next);
+    int depth = 1;
+    while (node != NULL) {
+        bool walk = pre == NULL || pre(fs, node, depth, arg);
+        if (walk && node->type == DIRECTORY && !HAS_FLAG(node, SHADOW) &&
+            LINK(node, l_next) != NULL) {
+            node = LINK(node, l_next);
+            depth++;
+            continue;
+        }
+        // node is done, and so is every directory it was the last entry of
+        for (;;) {
+            Node next = LINK(node, next);
+            Node up = LINK(node, h_prev);
+            if (post != NULL) {
+                post(fs, node, depth, arg);
+            }
+            if (next != NULL) {
+                node = next;
+                break;
+            } else if (depth == 1) {
+                node = NULL;
+                break;
+            }
+            node = up;
+            depth--;
+        }
+    }
+}
+
+// search below dir, whose path is path ("" for the root). With threads,
+// the caller first searches breadth first, one level at a time, until
+// there are enough directories left for each thread to take several;
+// then the threads, the caller among them, take one at a time.
+long find(Node dir, char *path, struct FindState *s) {
+    int threads = s->query->threads;
+    s->split = threads > 1;
+    find_unit(s, dir, path, strlen(path), 0);
+    struct FindWalk w = {0};
+    size_t enough = (size_t)threads * FIND_UNITS;
+    while (s->next_unit < s->nunits && !s->stop &&
+           (!s->split || s->nunits - s->next_unit < enough)) {
+        struct FindUnit u = s->units[s->next_unit++];
+        find_append(&w, 0, s->paths + u.path, u.len);
+        find_walk(s, &w, u.dir, u.depth);
+    }
+    free(w.frames);
+    free(w.path);
+    if (s->next_unit < s->nunits && !s->stop) {
+        s->split = false;
+        s->shared = true;
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_t *workers = malloc((threads - 1) * sizeof(pthread_t));
+        for (int i = 0; i < threads - 1; i++) {
+            pthread_create(&workers[i], NULL, find_worker, s);
+        }
+        find_worker(s);
+        for (int i = 0; i < threads - 1; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(s->units);
+    free(s->paths);
+    return s->matches;
+}
+
+// search the units of the FindState at arg until none are left. The
+// thread that called FsFind is inside the fs for all of it, so nothing
+// the workers reach is freed before they are done.
+void *find_worker(void *arg) {
+    struct FindState *s = arg;
+    struct FindWalk w = {0};
+    for (;;) {
+        size_t i = __atomic_fetch_add(&s->next_unit, 1, __ATOMIC_RELAXED);
+        if (i >= s->nunits || __atomic_load_n(&s->stop, __ATOMIC_RELAXED)) {
+            break;
+        }
+        struct FindUnit *u = &s->units[i];
+        find_append(&w, 0, s->paths + u->path, u->len);
+        find_walk(s, &w, u->dir, u->depth);
+    }
+    free(w.frames);
+    free(w.path);
+    return NULL;
+}
+
+// search the entries below dir, which is depth levels below the start
+// and has its path in w. While splitting, directories are left as units
+// instead of being walked into.
+void find_walk(struct FindState *s, struct FindWalk *w, Node dir, int depth) {
+    struct FsFindQuery *q = s->query;
+    w->nframes = 0;
+    find_push(w, dir);
+    while (w->nframes > 0) {
+        struct FindFrame *f = &w->frames[w->nframes - 1];
+        Node e = f->next;
+        if (e == NULL || __atomic_load_n(&s->stop, __ATOMIC_RELAXED)) {
+            w->nframes--;
+            continue;
+        }
+        f->next = LINK(e, next);
+        size_t at = f->len;
+        int d = depth + (int)w->nframes;
+        bool is_dir = e->type == DIRECTORY;
+        bool descend = is_dir && (q->max_depth < 0 || d < q->max_depth);
+        char *name = NAME(e);
+        size_t len = strlen(name);
+        bool wanted = d >= q->min_depth && (q->max_depth < 0 || d <= q->max_depth) &&
+                      (q->type == FS_FIND_ANY || is_dir == (q->type == FS_FIND_DIRECTORIES)) &&
+                      PatternMatch(s->pattern, name, len);
+        if (!wanted && !descend) {
+            continue;
+        }
+        find_append(w, at, "/", 1);
+        find_append(w, at + 1, name, len);
+        if (wanted) {
+            find_report(s, e, w->path);
+        }
+        if (descend && s->split) {
+            find_unit(s, e, w->path, w->len, d);
+        } else if (descend) {
+            find_push(w, e);
+        }
+    }
+}
+
+// walk into dir, whose path is the one in w
+void find_push(struct FindWalk *w, Node dir) {
+    if (w->nframes == w->frames_cap) {
+        w->frames_cap = (w->frames_cap == 0) ? 64 : w->frames_cap * 2;
+        w->frames = realloc(w->frames, w->frames_cap * sizeof(struct FindFrame));
+    }
+    w->frames[w->nframes].next = find_entries(dir);
+    w->frames[w->nframes].len = w->len;
+    w->nframes++;
+}
+
+// put len bytes of text at offset at of the path in w, ending it there
+void find_append(struct FindWalk *w, size_t at, char *text, size_t len) {
+    if (at + len + 1 > w->cap) {
+        w->cap = (w->cap == 0) ? PATH_MAX + 1 : w->cap;
+        while (at + len + 1 > w->cap) {
+            w->cap *= 2;
+        }
+        w->path = realloc(w->path, w->cap);
+    }
+    memcpy(w->path + at, text, len);
+    w->len = at + len;
+    w->path[w->len] = '\0';
+}
+
+// leave dir to be searched later
+void find_unit(struct FindState *s, Node dir, char *path, size_t len, int depth) {
+    if (s->nunits == s->units_cap) {
+        s->units_cap = (s->units_cap == 0) ? 64 : s->units_cap * 2;
+        s->units = realloc(s->units, s->units_cap * sizeof(struct FindUnit));
+    }
+    if (s->paths_len + len >= s->paths_cap) {
+        s->paths_cap = (s->paths_cap == 0) ? 4096 : s->paths_cap;
+        while (s->paths_len + len > s->paths_cap) {
+            s->paths_cap *= 2;
+        }
+        s->paths = realloc(s->paths, s->paths_cap);
+    }
+    memcpy(s->paths + s->paths_len, path, len);
+    s->units[s->nunits++] = (struct FindUnit){dir, s->paths_len, len, depth};
+    s->paths_len += len;
+}
 
-// helper function declaration
-Node NewNode(char name[], FileType type);
-void NodeFree(Node node);
-Node lookInDir (Node node, char* name);
-Node create_here (Node node, Node prev, Node h_prev, char *name, FileType type);
-void print_current_dir(Node curr);
-void tree(Node n, int level);
+void find_report(struct FindState *s, Node node, char *path) {
+    if (s->shared) {
+        pthread_mutex_lock(&s->lock);
+    }
+    if (!__atomic_load_n(&s->stop, __ATOMIC_RELAXED)) {
+        s->matches++;
+        bool go = true;
+        if (s->take != NULL) {
+            go = s->take(s->arg, node, path);
+        } else if (s->found != NULL) {
+            go = s->found(s->arg, path, node->type == DIRECTORY);
+        }
+        if (!go) {
+            __atomic_store_n(&s->stop, true, __ATOMIC_RELAXED);
+        }
+    }
+    if (s->shared) {
+        pthread_mutex_unlock(&s->lock);
+    }
+}
 
+// the first entry dir shows, without making a pending copy's entries:
+// until it has them, they are those of the directory it copies
+Node find_entries(Node dir) {
+    Node src;
+    while (HAS_FLAG(dir, SHADOW) && (src = LINK(dir, index)) != NULL) {
+        dir = src;
+    }
+    return LINK(dir, l_next);
+}
 
-Fs FsNew(void) {
-    Fs fs = malloc(sizeof(struct FsRep));
-    fs->root = NewNode("simple_root", DIRECTORY);
-    fs->curr_dir = fs->root;
-    return fs;
+// search the files FsGrep found, each in one go. Threads take the
+// largest first, so a few big files don't finish last.
+long grep(struct GrepState *g, int threads) {
+    if (threads <= 1) {
+        for (size_t i = 0; i < g->nfiles && !g->stop; i++) {
+            grep_file(g, &g->files[i]);
+        }
+    } else {
+        qsort(g->files, g->nfiles, sizeof(struct GrepFile), grep_size_cmp);
+        g->shared = true;
+        pthread_mutex_init(&g->lock, NULL);
+        pthread_t *workers = malloc((threads - 1) * sizeof(pthread_t));
+        for (int i = 0; i < threads - 1; i++) {
+            pthread_create(&workers[i], NULL, grep_worker, g);
+        }
+        grep_worker(g);
+        for (int i = 0; i < threads - 1; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+        pthread_mutex_destroy(&g->lock);
+    }
+    free(g->files);
+    free(g->paths);
+    return g->matches;
 }
 
-void FsGetCwd(Fs fs, char cwd[PATH_MAX + 1]) {
-    strcpy(cwd, "");
-    Node curr = fs->curr_dir;
-    char path[PATH_MAX + 1];
-    while(curr != NULL) {
-        if(curr->h_prev != NULL) { 
-            // not the root dir
-            strcpy(path, cwd);
-            strcpy(cwd, "/");
-            strcat(cwd, curr->name);
-            strcat(cwd, path);
+// add a regular file to the ones the GrepState at arg searches, unless
+// it was never written
+bool grep_add(void *arg, Node file, char *path) {
+    struct GrepState *g = arg;
+    content_lock(g->fs, file, false);
+    Content c = node_content(g->fs, file);
+    size_t size = (c != NULL) ? ContentSize(c) : 0;
+    content_unlock(g->fs, file);
+    if (c == NULL) {
+        return true;
+    }
+    if (g->nfiles == g->files_cap) {
+        g->files_cap = (g->files_cap == 0) ? 64 : g->files_cap * 2;
+        g->files = realloc(g->files, g->files_cap * sizeof(struct GrepFile));
+    }
+    size_t len = strlen(path) + 1;
+    if (g->paths_len + len > g->paths_cap) {
+        g->paths_cap = (g->paths_cap == 0) ? 4096 : g->paths_cap;
+        while (g->paths_len + len > g->paths_cap) {
+            g->paths_cap *= 2;
         }
-        curr = curr->h_prev;
+        g->paths = realloc(g->paths, g->paths_cap);
     }
-    if (strcmp(cwd, "") == 0) {
-        strcpy(cwd, "/");
+    memcpy(g->paths + g->paths_len, path, len);
+    g->files[g->nfiles++] = (struct GrepFile){file, g->paths_len, size};
+    g->paths_len += len;
+    return true;
+}
+
+// the content is searched where it is, under the file's content lock
+void grep_file(struct GrepState *g, struct GrepFile *f) {
+    struct GrepCall call = {g, g->paths + f->path};
+    content_lock(g->fs, f->file, false);
+    Content c = node_content(g->fs, f->file);
+    if (c != NULL) {
+        ScanContent(g->scan, c, grep_line, &call);
     }
+    content_unlock(g->fs, f->file);
 }
 
-void FsFree(Fs fs) {
-    NodeFree(fs->root);
-    free(fs);
+bool grep_line(void *arg, size_t offset, size_t line) {
+    struct GrepCall *call = arg;
+    struct GrepState *g = call->g;
+    if (g->shared) {
+        pthread_mutex_lock(&g->lock);
+    }
+    bool go = !__atomic_load_n(&g->stop, __ATOMIC_RELAXED);
+    if (go) {
+        g->matches++;
+        if (g->found != NULL && !g->found(g->arg, call->path, offset, line)) {
+            __atomic_store_n(&g->stop, true, __ATOMIC_RELAXED);
+            go = false;
+        }
+    }
+    if (g->shared) {
+        pthread_mutex_unlock(&g->lock);
+    }
+    return go;
 }
 
-void FsMkdir(Fs fs, char *path) {
-    char *path_string = strdup(path);
-    Node curr = fs->curr_dir;
-    // seperate the path by delimiter "/"
-    // and loop each name 
-    char *curr_token = NULL;
-    char *next_token = NULL;
-    char *token = strtok(path_string, "/");
-    if (token != NULL) {
-        next_token = strdup(token);
-    }
-    while(next_token != NULL) {
-        if(curr_token != NULL) {
-            free(curr_token);
-        }
-        curr_token = next_token;
-        token = strtok(NULL, "/");
-        if (token != NULL) {
-            next_token = strdup(token);
-        } else {
-            next_token = NULL;
-        }
-        if (strcmp(curr_token,".")==0) {
-            // if the curr name is "." 
-            if (next_token == NULL) {
-                // if the next token is null
-                // exit(file exists)
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("mkdir: cannot create directory \'%s\': File exists\n", path);
-                return;
-            }
-        } else if (strcmp(curr_token,"..")==0) {
-            // if the curr name is ".."
-            if (next_token == NULL) {
-                // if the next token is null
-                // exit(file exists)
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("mkdir: cannot create directory \'%s\': File exists\n", path);
-                return;
-            } else if (curr->h_prev != NULL) {
-                // if the next token is not null and the h_prev is not null
-                // back to the h_prev
-                curr = curr->h_prev;
-            } else {
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("mkfile: cannot create directory \'%s\': No Such file or directory\n", path);
-                return;
-            }
-        } else {
-            // create find_node to find the node with curr_token
-            Node find_node = lookInDir(curr->l_next, curr_token);
-            if (find_node == NULL) { 
-                //dir not exist
-                if (next_token == NULL) { 
-                    //this is the one we are creating.
-                    curr->l_next = create_here(curr->l_next, NULL, curr, curr_token, DIRECTORY);
-                } else { 
-                    // this is a prefix folder but not exist
-                    free (curr_token);
-                    free (next_token);
-                    free (path_string);
-                    printf("mkdir: cannot create directory \'%s\': No Such file or directory\n", path);
-                    return;
-                }
-            } else {
-                // dir exists
-                if (next_token == NULL) {
-                    // next_token is null, find a duplicated name 
-                    // exit(file exists)
-                    free (curr_token);
-                    free (next_token);
-                    free (path_string);
-                    printf("mkdir: cannot create directory \'%s\': File exists\n", path);
-                    return;
-                } else if (find_node->type == REGULAR_FILE) {
-                    // find_node is a regular file 
-                    // exit(not a dir)
-                    free (curr_token);
-                    free (next_token);
-                    free (path_string);
-                    printf("mkdir: cannot create directory \'%s\': Not a directory\n", path);
-                    return;
-                } else {
-                    // enter the find_node
-                    curr = find_node;
-                }
-            }
+// search the files of the GrepState at arg until none are left; see
+// find_worker for why nothing needs to be entered
+void *grep_worker(void *arg) {
+    struct GrepState *g = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&g->next_file, 1, __ATOMIC_RELAXED);
+        if (i >= g->nfiles || __atomic_load_n(&g->stop, __ATOMIC_RELAXED)) {
+            break;
         }
+        grep_file(g, &g->files[i]);
     }
-    free (curr_token);
-    free (next_token);
-    free (path_string);
+    return NULL;
 }
 
-void FsMkfile(Fs fs, char *path) {
-    char *path_string = strdup(path);
-    Node curr = fs->curr_dir;
-    // 
-    char *curr_token = NULL;
-    char *next_token = NULL;
-    char *token = strtok(path_string, "/");
-    if (token != NULL) {
-        next_token = strdup(token);
-    }
-    while(next_token != NULL) {
-        if(curr_token != NULL) {
-            free(curr_token);
-        }
-        curr_token = next_token;
-        token = strtok(NULL, "/");
-        if (token != NULL) {
-            next_token = strdup(token);
-        } else {
-            next_token = NULL;
-        }
-        if (strcmp(curr_token, ".") == 0) {
-            // if the name is "."
-            if (next_token == NULL) {
-                // if the next name is null
-                // exit (file exists)
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("mkfile: cannot create directory \'%s\': File exists\n", path);
-                return;
-            }
-        } else if (strcmp(curr_token, "..") == 0) {
-            // if the name is ".."
-            if (next_token == NULL) {
-                // if the next name is null
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("mkfile: cannot create directory \'%s\': File exists\n", path);
-                return;
-            } else if (curr->h_prev != NULL) {
-                // if the h_prev is not null
-                // back to h_prev
-                curr = curr->h_prev;
-            } else {
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("mkfile: cannot create directory \'%s\': No Such file or directory\n", path);
-                return;
+// larger files first
+int grep_size_cmp(const void *a, const void *b) {
+    size_t x = ((const struct GrepFile *)a)->size;
+    size_t y = ((const struct GrepFile *)b)->size;
+    return (x < y) - (x > y);
+}
+
+// read directories of the ImportState until none are left, and with
+// apply make the batches they become as they come in, the caller of
+// FsImport being the one thread that changes fs
+void import_run(struct ImportState *s, bool apply) {
+    Reader r = ReaderNew(IMPORT_READS);
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        if (apply && s->ready != NULL) {
+            struct ImportBatch *b = s->ready;
+            s->ready = b->next;
+            if (s->ready == NULL) {
+                s->ready_end = &s->ready;
             }
-        } else {
-            // create find_node to find the node with curr name
-            Node find_node = lookInDir(curr->l_next, curr_token);
-            if (find_node == NULL) { 
-                //dir not exist
-                if (next_token == NULL) { 
-                    //this is the one we are creating.
-                    curr->l_next = create_here(curr->l_next, NULL, curr, curr_token, REGULAR_FILE);
-                }
-                else { 
-                    // this is a prefix folder but not exist
-                    free (curr_token);
-                    free (next_token);
-                    free (path_string);
-                    printf("mkfile: cannot create directory \'%s\': No Such file or directory\n", path);
-                    return;
-                }
-            } else {
-                // dir exists
-                if (next_token == NULL) {
-                    // next token is null
-                    // exit(file exists)
-                    free (curr_token);
-                    free (next_token);
-                    free (path_string);
-                    printf("mkfile: cannot create directory \'%s\': File exists\n", path);
-                    return;
-                } else if (find_node->type == REGULAR_FILE) {
-                    // find_node is a file
-                    // exit(not a dir)
-                    free (curr_token);
-                    free (next_token);
-                    free (path_string);
-                    printf("mkfile: cannot create directory \'%s\': Not a directory\n", path);
-                    return;
-                } else {
-                    // enter the find_node
-                    curr = find_node;
+            s->ahead -= b->bytes;
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->lock);
+            import_apply(s, b);
+            pthread_mutex_lock(&s->lock);
+        } else if (s->ndirs > 0 && (apply || s->ahead < IMPORT_AHEAD)) {
+            // the workers wait while the caller is behind, as what they
+            // read counts towards no budget until it is made
+            struct ImportDir d = s->dirs[--s->ndirs];
+            s->busy++;
+            pthread_mutex_unlock(&s->lock);
+            struct ImportDir *subs = NULL;
+            size_t nsubs = 0;
+            struct ImportBatch *b = import_read(r, &d, &subs, &nsubs);
+            free(d.host);
+            free(d.path);
+            pthread_mutex_lock(&s->lock);
+            *s->ready_end = b;
+            s->ready_end = &b->next;
+            s->ahead += b->bytes;
+            if (s->ndirs + nsubs > s->dirs_cap) {
+                while (s->ndirs + nsubs > s->dirs_cap) {
+                    s->dirs_cap *= 2;
                 }
+                s->dirs = realloc(s->dirs, s->dirs_cap * sizeof(struct ImportDir));
             }
-        }    
+            for (size_t i = 0; i < nsubs; i++) {
+                s->dirs[s->ndirs++] = subs[i];
+            }
+            s->busy--;
+            pthread_cond_broadcast(&s->cond);
+            free(subs);
+        } else if (s->ndirs == 0 && s->busy == 0 && (!apply || s->ready == NULL)) {
+            break;
+        } else {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
     }
-    free (curr_token);
-    free (next_token);
-    free (path_string);
+    pthread_mutex_unlock(&s->lock);
+    ReaderFree(r);
 }
 
-void FsCd(Fs fs, char *path) {
-    // if the path is NULL
-    // back to the root    
-    if (path == NULL) {
-        fs->curr_dir = fs->root;
-        return;
+void *import_worker(void *arg) {
+    import_run(arg, false);
+    return NULL;
+}
+
+// read a host directory into a batch making its directories and regular
+// files, the files read whole, a few dozen at once; anything else in it
+// is left out. Its subdirectories, to read next, go in subs.
+struct ImportBatch *import_read(Reader r, struct ImportDir *d, struct ImportDir **subs,
+                                size_t *nsubs) {
+    struct ImportBatch *b = calloc(1, sizeof(struct ImportBatch));
+    DIR *dir = opendir(d->host);
+    if (dir == NULL) {
+        import_fail(&b->failed, &b->failed_len, d->host, NULL);
+        return b;
     }
-    char *path_string = strdup(path);
-    Node curr = fs->curr_dir;
-    char *curr_token = NULL;
-    char *next_token = NULL;
-    char *token = strtok(path_string, "/");
-    if (token != NULL) {
-        next_token = strdup(token);
-    }
-    while(next_token != NULL) {
-        if(curr_token != NULL) {
-            free(curr_token);
-        }
-        curr_token = next_token;
-        token = strtok(NULL, "/");
-        if (token != NULL) {
-            next_token = strdup(token);
-        } else {
-            next_token = NULL;
-        }
-        
-        if (strcmp(curr_token, ".") == 0) {
-            // if the curr name is "."
-            curr = fs->curr_dir;
-        } else if (strcmp(curr_token, "..") == 0) {
-            // if the curr name is ..
-
-            if (curr->h_prev != NULL) {
-                // back to the h_prev if h_prev is not null
-                curr = curr->h_prev;
-            } else {
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("cd: \'%s\': No Such file or directory\n", path);
-                return;
+    int fds[IMPORT_READS];
+    char *bufs[IMPORT_READS];
+    size_t lens[IMPORT_READS];
+    char names[IMPORT_READS][NAME_MAX + 1];
+    int n = 0;
+    size_t subs_cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN && fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            size_t at = import_op(b, FS_MKDIR, d->path, name);
+            if (*nsubs == subs_cap) {
+                subs_cap = (subs_cap == 0) ? 16 : subs_cap * 2;
+                *subs = realloc(*subs, subs_cap * sizeof(struct ImportDir));
             }
-        } else {
-            Node find_node = lookInDir(curr->l_next, curr_token);
-            
-            if (find_node == NULL) {
-                // if we didn't find the name
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("cd: \'%s\': No Such file or directory\n", path);
-                return;
-            } else {
-                if (find_node->type == REGULAR_FILE) {
-                        // if the find node is the file
-                        // exit(not a dir) 
-                        free (curr_token);
-                        free (next_token);
-                        free (path_string);
-                        printf("cd: \'%s\': Not a directory\n", path);
-                        return;
-                } else {
-                    // enter the find_node
-                    curr = find_node;
+            char *host = malloc(strlen(d->host) + strlen(name) + 2);
+            sprintf(host, "%s/%s", d->host, name);
+            (*subs)[(*nsubs)++] = (struct ImportDir){host, strdup(b->paths + at)};
+        } else if (type == DT_REG) {
+            int fd = openat(dirfd(dir), name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                if (fd >= 0) {
+                    close(fd);
                 }
+                import_fail(&b->failed, &b->failed_len, d->host, name);
+                continue;
+            }
+            fds[n] = fd;
+            lens[n] = st.st_size;
+            bufs[n] = malloc((lens[n] > 0) ? lens[n] : 1);
+            strcpy(names[n], name);
+            if (++n == IMPORT_READS) {
+                import_files(b, r, n, fds, bufs, lens, names, d);
+                n = 0;
             }
         }
     }
-    free (curr_token);
-    free (next_token);
-    free (path_string);
-    // make the current directory the current node2
-    fs->curr_dir = curr;
+    import_files(b, r, n, fds, bufs, lens, names, d);
+    closedir(dir);
+    for (int i = 0; i < b->n; i++) {
+        b->ops[i].path = b->paths + b->path_at[i];
+    }
+    free(b->path_at);
+    b->path_at = NULL;
+    return b;
 }
 
-void FsLs(Fs fs, char *path) {
-    // if the path is NULL
-    if (path == NULL) {
-        // make the curr the lower of the curr_dir
-        Node curr = fs->curr_dir->l_next;
-        while(curr != NULL) {
-            // display the node on this level
-            printf("%s\n", curr->name);
-            curr = curr->next;
+// read n opened files of the directory d at once and add what they hold
+// to b, each as a file made and then given the buffer it was read into
+void import_files(struct ImportBatch *b, Reader r, int n, int fds[], char *bufs[],
+                  size_t lens[], char names[][NAME_MAX + 1], struct ImportDir *d) {
+    ssize_t got[IMPORT_READS];
+    ReaderRead(r, n, fds, bufs, lens, got);
+    for (int i = 0; i < n; i++) {
+        close(fds[i]);
+        if (got[i] < 0) {
+            free(bufs[i]);
+            import_fail(&b->failed, &b->failed_len, d->host, names[i]);
+            continue;
+        }
+        import_op(b, FS_MKFILE, d->path, names[i]);
+        if (got[i] == 0) {
+            // an empty file still empties one already there
+            free(bufs[i]);
+            import_op(b, FS_PUT, d->path, names[i]);
+            b->ops[b->n - 1].content = "";
+        } else {
+            import_op(b, FS_ADOPT, d->path, names[i]);
+            b->ops[b->n - 1].content = bufs[i];
+            b->ops[b->n - 1].len = got[i];
+            b->bytes += got[i];
         }
-        return;
     }
+}
 
-    Node curr = fs->curr_dir;
-    char *path_string = strdup(path);
-    char *curr_token = NULL;
-    char *next_token = NULL;
-    char *token = strtok(path_string, "/");
-    if (token != NULL) {
-        next_token = strdup(token);
+// add an operation on the entry name of the directory at path dir to b;
+// returns where its path is in b->paths
+size_t import_op(struct ImportBatch *b, FsOpType type, char *dir, char *name) {
+    if (b->n == b->cap) {
+        b->cap = (b->cap == 0) ? 64 : b->cap * 2;
+        b->ops = realloc(b->ops, b->cap * sizeof(struct FsOp));
+        b->path_at = realloc(b->path_at, b->cap * sizeof(size_t));
     }
-    while(next_token != NULL) {
-        if(curr_token != NULL) {
-            free(curr_token);
+    size_t len = strlen(dir) + strlen(name) + 2;
+    if (b->paths_len + len > b->paths_cap) {
+        b->paths_cap = (b->paths_cap == 0) ? 4096 : b->paths_cap;
+        while (b->paths_len + len > b->paths_cap) {
+            b->paths_cap *= 2;
         }
-        curr_token = next_token;
-        token = strtok(NULL, "/");
-        if (token != NULL) {
-            next_token = strdup(token);
+        b->paths = realloc(b->paths, b->paths_cap);
+    }
+    size_t at = b->paths_len;
+    sprintf(b->paths + at, "%s/%s", dir, name);
+    b->paths_len += len;
+    b->ops[b->n] = (struct FsOp){type, NULL, NULL, 0};
+    b->path_at[b->n++] = at;
+    return at;
+}
+
+// add the host path of name in the directory host, or of host itself if
+// name is NULL, to a list of failures
+void import_fail(char **failed, size_t *len, char *host, char *name) {
+    size_t need = strlen(host) + ((name != NULL) ? strlen(name) + 1 : 0) + 1;
+    *failed = realloc(*failed, *len + need);
+    if (name != NULL) {
+        sprintf(*failed + *len, "%s/%s", host, name);
+    } else {
+        strcpy(*failed + *len, host);
+    }
+    *len += need;
+}
+
+// make the entries of a batch, counting them, and print what failed
+void import_apply(struct ImportState *s, struct ImportBatch *b) {
+    Fs fs = s->fs;
+    FsStatus *status = malloc((b->n + 1) * sizeof(FsStatus));
+    FsBatch(fs, b->ops, b->n, status);
+    fs_enter(fs);
+    for (int i = 0; i < b->n; i++) {
+        FsOpType type = b->ops[i].type;
+        if (type == FS_MKFILE) {
+            // counted with the content that follows
+            continue;
+        } else if (status[i] == FS_OK || (type == FS_MKDIR && status[i] == FS_EXISTS)) {
+            s->imported++;
         } else {
-            next_token = NULL;
-        }
-        if (strcmp(curr_token, ".") == 0) {
-            // if the curr name is "."
-            // do nothing on the curr_dir
-            curr = fs->curr_dir;
-        } else if (strcmp(curr_token, "..") == 0) {
-            // if the curr name is ".."
-            if (curr->h_prev != NULL) {
-                // if the h_prev is not null
-                // back to h_prev
-                curr = curr->h_prev;
-            } else {
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("ls: \'%s\': No Such file or directory\n", path);
-                return;
-            }
+            OutputPrintf(fs_out(fs), "import: \'%s\': %s\n", b->ops[i].path, batch_error(status[i]));
+        }
+    }
+    for (size_t at = 0; at < b->failed_len; at += strlen(b->failed + at) + 1) {
+        OutputPrintf(fs_out(fs), "import: \'%s\': Cannot read\n", b->failed + at);
+    }
+    fs_exit(fs);
+    free(status);
+    free(b->failed);
+    free(b->paths);
+    free(b->ops);
+    free(b);
+}
+
+// the message printed for an operation of a batch that failed
+char *batch_error(FsStatus status) {
+    switch (status) {
+        case FS_NOT_FOUND:  return "No Such file or directory";
+        case FS_NOT_DIR:    return "Not a directory";
+        case FS_EXISTS:     return "File exists";
+        case FS_IS_DIR:     return "Is a directory";
+        default:            return "Success";
+    }
+}
+
+// make a directory FsExport found on the host, or add a regular file to
+// the ones to write
+bool export_add(void *arg, Node node, char *path) {
+    struct ExportState *e = arg;
+    char *rest = path + e->start_len;
+    if (node->type == DIRECTORY) {
+        char host[2 * PATH_MAX + 2];
+        snprintf(host, sizeof(host), "%s%s", e->host, rest);
+        struct stat st;
+        if (mkdir(host, 0755) == 0 ||
+            (errno == EEXIST && stat(host, &st) == 0 && S_ISDIR(st.st_mode))) {
+            e->exported++;
         } else {
-            // if we didn't find the name
-            Node find_node = lookInDir(curr->l_next, curr_token);
-            if (find_node == NULL) {
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("ls: \'%s\': No Such file or directory\n", path);
-                return;
-            } else {
-                if (find_node->type == REGULAR_FILE) {
-                        free (curr_token);
-                        free (next_token);
-                        free (path_string);
-                        printf("ls: \'%s\': Not a directory\n", path);
-                        return;
-                } else {
-                    // enter the find_node
-                    curr = find_node;
-                }
-            }
+            import_fail(&e->failed, &e->failed_len, host, NULL);
         }
+        return true;
     }
-    free (curr_token);
-    free (next_token);
-    free (path_string);
-    // if the next name is null now
-    // display the name under the curr_dir
-    // that is the lower level of the curr node
-    curr = curr->l_next;
-    while(curr != NULL) {
-        printf("%s\n", curr->name);
-        curr = curr->next;
+    content_lock(e->fs, node, false);
+    Content c = node_content(e->fs, node);
+    size_t size = (c != NULL) ? ContentSize(c) : 0;
+    content_unlock(e->fs, node);
+    if (e->nfiles == e->files_cap) {
+        e->files_cap = (e->files_cap == 0) ? 64 : e->files_cap * 2;
+        e->files = realloc(e->files, e->files_cap * sizeof(struct GrepFile));
+    }
+    size_t len = strlen(rest) + 1;
+    if (e->paths_len + len > e->paths_cap) {
+        e->paths_cap = (e->paths_cap == 0) ? 4096 : e->paths_cap;
+        while (e->paths_len + len > e->paths_cap) {
+            e->paths_cap *= 2;
+        }
+        e->paths = realloc(e->paths, e->paths_cap);
     }
+    memcpy(e->paths + e->paths_len, rest, len);
+    e->files[e->nfiles++] = (struct GrepFile){node, e->paths_len, size};
+    e->paths_len += len;
+    return true;
 }
 
-void FsPwd(Fs fs) {
-    print_current_dir(fs->curr_dir);
+// write a file's content to the host straight from where it is, several
+// spans at a time, under the file's content lock
+void export_file(struct ExportState *e, struct GrepFile *f) {
+    char host[2 * PATH_MAX + 2];
+    snprintf(host, sizeof(host), "%s%s", e->host, e->paths + f->path);
+    int fd = open(host, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0;
+    content_lock(e->fs, f->file, false);
+    Content c = node_content(e->fs, f->file);
+    size_t size = (c != NULL) ? ContentSize(c) : 0;
+    // a span of a compressed chunk only lasts until the next span
+    int max = (c != NULL && ContentCompressed(c)) ? 1 : EXPORT_IOV;
+    struct iovec iov[EXPORT_IOV];
+    size_t done = 0;
+    while (ok && done < size) {
+        int n = 0;
+        for (size_t at = done; n < max && at < size; n++) {
+            iov[n].iov_base = (void *)ContentSpan(c, at, &iov[n].iov_len);
+            at += iov[n].iov_len;
+        }
+        ssize_t k = pwritev(fd, iov, n, done);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = k > 0;
+        done += (k > 0) ? k : 0;
+    }
+    content_unlock(e->fs, f->file);
+    if (fd >= 0 && close(fd) != 0) {
+        ok = false;
+    }
+    if (ok) {
+        __atomic_fetch_add(&e->exported, 1, __ATOMIC_RELAXED);
+    } else {
+        pthread_mutex_lock(&e->lock);
+        import_fail(&e->failed, &e->failed_len, host, NULL);
+        pthread_mutex_unlock(&e->lock);
+    }
 }
 
-void FsTree(Fs fs, char *path) {
+// write the files of the ExportState at arg until none are left; see
+// find_worker for why nothing needs to be entered
+void *export_worker(void *arg) {
+    struct ExportState *e = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&e->next_file, 1, __ATOMIC_RELAXED);
+        if (i >= e->nfiles) {
+            break;
+        }
+        export_file(e, &e->files[i]);
+    }
+    return NULL;
+}
+
+// the dentry cache starts out empty; its slots are only touched as they
+// fill up
+void dcache_init(Fs fs) {
+    for (int i = 0; i < DCACHE_SHARDS; i++) {
+        struct DcacheShard *s = &fs->dcache[i];
+#ifdef CONCURRENT
+        pthread_mutex_init(&s->lock, NULL);
+#endif
+        s->slots = calloc(DCACHE_WAYS, sizeof(struct Dentry));
+        s->table = calloc(2 * DCACHE_WAYS, sizeof(uint32_t));
+        s->used = 0;
+        s->count = 0;
+        s->hand = 0;
+        s->hits = 0;
+        s->misses = 0;
+    }
+    fs->dc_gen = 0;
+    fs->dc_adds = 0;
+}
+
+void dcache_destroy(Fs fs) {
+    for (int i = 0; i < DCACHE_SHARDS; i++) {
+        struct DcacheShard *s = &fs->dcache[i];
+        for (int j = 0; j < s->used; j++) {
+            free(s->slots[j].key);
+        }
+        free(s->slots);
+        free(s->table);
+#ifdef CONCURRENT
+        pthread_mutex_destroy(&s->lock);
+#endif
+    }
+}
+
+// write the cache key of path into key: the path made absolute from the
+// current directory, with single slashes and no trailing one, and point
+// res->name at its last name. Returns the key's length, or -1 for a path
+// the cache doesn't take: one with "." or ".." in it, one naming the
+// root or the current directory, or one too long.
+int dcache_key(Fs fs, char *path, char *key, struct PathResult *res) {
     if (path == NULL) {
-        printf("/\n");
-        tree(fs->root->l_next, 1);
+        return -1;
+    }
+    int len = 0;
+    if (path[0] != '/') {
+        struct FsThread *me = fs_self(fs);
+        if (me->cwd_len > PATH_MAX) {
+            return -1;
+        }
+        // the root's path is all separator
+        len = (me->cwd_len > 1) ? me->cwd_len : 0;
+        memcpy(key, me->cwd, len);
+    }
+    res->name = NULL;
+    res->len = 0;
+    char *p = path;
+    for (;;) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        char *name = p;
+        while (*p != '\0' && *p != '/') {
+            p++;
+        }
+        int name_len = p - name;
+        if (name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.'))) {
+            return -1;
+        } else if (len + 1 + name_len > PATH_MAX) {
+            return -1;
+        }
+        key[len++] = '/';
+        memcpy(key + len, name, name_len);
+        len += name_len;
+        res->name = name;
+        res->len = name_len;
+    }
+    return (res->name != NULL) ? len : -1;
+}
+
+// hash of a cache key, taken eight bytes at a time as keys are long;
+// shards and table slots use different bits of it
+uint64_t path_hash(char *key, int len) {
+    uint64_t hash = len;
+    for (int i = 0; i < len; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, key + i, (len - i < 8) ? len - i : 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+struct DcacheShard *dcache_shard(Fs fs, uint64_t hash) {
+    return &fs->dcache[(hash >> 32) % DCACHE_SHARDS];
+}
+
+// the table slot of key in s, or the empty one where it would go; the
+// caller holds the shard's lock
+uint32_t *dcache_find(struct DcacheShard *s, char *key, int len, uint64_t hash) {
+    size_t mask = 2 * DCACHE_WAYS - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t *at = &s->table[i];
+        if (*at == 0) {
+            return at;
+        }
+        struct Dentry *d = &s->slots[*at - 1];
+        if (d->hash == hash && d->len == len && memcmp(d->key, key, len) == 0) {
+            return at;
+        }
+    }
+}
+
+// fill in res from the cache, if it has a current entry for key
+bool dcache_lookup(Fs fs, char *key, int len, uint64_t hash, struct PathResult *res) {
+    struct DcacheShard *s = dcache_shard(fs, hash);
+    dcache_lock(s);
+    uint32_t *at = dcache_find(s, key, len, hash);
+    struct Dentry *d = (*at != 0) ? &s->slots[*at - 1] : NULL;
+    bool hit = d != NULL && d->gen == LOAD(fs->dc_gen) &&
+               (d->err == PATH_OK || d->adds == LOAD(fs->dc_adds));
+    if (hit) {
+        d->referenced = true;
+        res->node = d->node;
+        res->parent = d->parent;
+        res->err = d->err;
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    dcache_unlock(s);
+    return hit;
+}
+
+// remember where the lookup of key led, unless something it depends on
+// changed since gen and adds were read
+void dcache_insert(Fs fs, char *key, int len, uint64_t hash, struct PathResult *res,
+                   unsigned long gen, unsigned long adds) {
+    struct DcacheShard *s = dcache_shard(fs, hash);
+    dcache_lock(s);
+    if (gen != LOAD(fs->dc_gen) || (res->node == NULL && adds != LOAD(fs->dc_adds))) {
+        // a create may have come and gone without seeing this entry
+        dcache_unlock(s);
         return;
     }
-    Node curr = fs->curr_dir;
-    char *path_string = strdup(path);
-    char *curr_token = NULL;
-    char *next_token = NULL;
-    char *token = strtok(path_string, "/");
-    if (token != NULL) {
-        next_token = strdup(token);
-    }
-    while(next_token != NULL) {
-        if(curr_token != NULL) {
-            free(curr_token);
-        }
-        curr_token = next_token;
-        token = strtok(NULL, "/");
-        if (token != NULL) {
-            next_token = strdup(token);
+    uint32_t *at = dcache_find(s, key, len, hash);
+    struct Dentry *d;
+    if (*at != 0) {
+        // a stale entry for the same path
+        d = &s->slots[*at - 1];
+    } else {
+        int slot;
+        if (s->used < DCACHE_WAYS) {
+            slot = s->used++;
         } else {
-            next_token = NULL;
-        }
-        if (strcmp(curr_token, ".") == 0) {
-            curr = fs->curr_dir;
-        } else if (strcmp(curr_token, "..") == 0) {
-            if (curr->h_prev != NULL) {
-                curr = curr->h_prev;
-            } else {
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("tree: \'%s\': No Such file or directory\n", path);
-                return;
+            // the clock hand passes over the entries used since it last
+            // came by, and takes the first free or unused one
+            while (s->slots[s->hand].key != NULL && s->slots[s->hand].referenced) {
+                s->slots[s->hand].referenced = false;
+                s->hand = (s->hand + 1) % DCACHE_WAYS;
             }
-        } else {
-            Node find_node = lookInDir(curr->l_next, curr_token);
-            // if we didn't find the name
-            if (find_node == NULL) {
-                // the next name is null
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("tree: \'%s\': No Such file or directory\n", path);
-                return;
-            } else {
-                if (find_node->type == REGULAR_FILE) {
-                        free (curr_token);
-                        free (next_token);
-                        free (path_string);
-                        printf("tree: \'%s\': Not a directory\n", path);
-                        return;
-                } else {
-                    curr = find_node;
-                }
+            slot = s->hand;
+            s->hand = (s->hand + 1) % DCACHE_WAYS;
+            struct Dentry *victim = &s->slots[slot];
+            if (victim->key != NULL) {
+                dcache_evict(s, dcache_find(s, victim->key, victim->len, victim->hash));
+                at = dcache_find(s, key, len, hash);
             }
         }
+        d = &s->slots[slot];
+        d->key = malloc(len);
+        memcpy(d->key, key, len);
+        d->len = len;
+        d->hash = hash;
+        *at = slot + 1;
+        s->count++;
     }
-    free (curr_token);
-    free (next_token);
-    free (path_string);
-    printf("%s\n", path);
-    tree(curr->l_next, 1);
+    d->node = res->node;
+    d->parent = res->parent;
+    d->err = res->err;
+    d->referenced = false;
+    d->gen = gen;
+    d->adds = adds;
+    dcache_unlock(s);
 }
 
-void FsPut(Fs fs, char *path, char *content) {
-    // TODO
-    Node curr = fs->curr_dir;
-    char *path_string = strdup(path);
-    char *curr_token = NULL;
-    char *next_token = NULL;
-    char *token = strtok(path_string, "/");
-    if (token != NULL) {
-        next_token = strdup(token);
-    }
-    while(next_token != NULL) {
-        if(curr_token != NULL) {
-            free(curr_token);
-        }
-        curr_token = next_token;
-        token = strtok(NULL, "/");
-        if (token != NULL) {
-            next_token = strdup(token);
-        } else {
-            next_token = NULL;
+// drop the entry in table slot at, moving later entries of its probe
+// run back into the hole; the caller holds the shard's lock
+void dcache_evict(struct DcacheShard *s, uint32_t *at) {
+    struct Dentry *d = &s->slots[*at - 1];
+    free(d->key);
+    d->key = NULL;
+    s->count--;
+    size_t mask = 2 * DCACHE_WAYS - 1;
+    size_t hole = at - s->table;
+    for (size_t i = (hole + 1) & mask; s->table[i] != 0; i = (i + 1) & mask) {
+        size_t home = s->slots[s->table[i] - 1].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            s->table[hole] = s->table[i];
+            hole = i;
         }
+    }
+    s->table[hole] = 0;
+}
 
-        // if the curr name is "."
-        if (strcmp(curr_token, ".") == 0) {
-            curr = fs->curr_dir;
-        } else if (strcmp(curr_token, "..") == 0) {
-            // if the curr name is ".."
+// a name was just added at key (of length len, or -1 if the path is too
+// long to be a key): the entry saying it doesn't exist goes, and so do
+// those of paths that failed on the way
+void dcache_created(Fs fs, char *key, int len) {
+#ifdef CONCURRENT
+    __atomic_add_fetch(&fs->dc_adds, 1, __ATOMIC_SEQ_CST);
+#else
+    fs->dc_adds++;
+#endif
+    if (len < 0) {
+        return;
+    }
+    uint64_t hash = path_hash(key, len);
+    struct DcacheShard *s = dcache_shard(fs, hash);
+    dcache_lock(s);
+    uint32_t *at = dcache_find(s, key, len, hash);
+    if (*at != 0) {
+        dcache_evict(s, at);
+    }
+    dcache_unlock(s);
+}
 
-            if (curr->h_prev != NULL) {
-                // if the h_prev is not null
-                // back to the upper dir
-                curr = curr->h_prev;
-            } else {
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("put: \'%s\': No Such file or directory\n", path);
-                return;
-            }
-        } else {
-            Node find_node = lookInDir(curr->l_next, curr_token);
-            // didn't find the node
-            if (find_node == NULL) {
-                
-                free (curr_token);
-                free (next_token);
-                free (path_string);
-                printf("mkfile: cannot create directory \'%s\': No Such file or directory\n", path);
-                return;
-                
-            } else {
-                // find the node 
-                if (find_node->type != REGULAR_FILE) {
-                        if(next_token == NULL) {
-                            free (curr_token);
-                            free (next_token);
-                            free (path_string);
-                            printf("tree: \'%s\': Is a directory\n", path);
-                            return;
-                        } else {
-                            curr = find_node;
-                        }
-                } else {
-                    FILE *file = fopen(curr_token, "r+");
-                    char *path_string = strdup(path);
-                    char *curr_token = NULL;
-                    char *next_token = NULL;
-                    char *token = strtok(path_string, "/");
-                    if (token != NULL) {
-                        next_token = strdup(token);
-                    }
-                    while(next_token != NULL) {
-                        if(curr_token != NULL) {
-                            free(curr_token);
-                        }
-                        curr_token = next_token;
-                        token = strtok(NULL, "");
-                        if (token != NULL) {
-                            next_token = strdup(token);
-                        } else {
-                            next_token = NULL;
-                        }
-                        int curr_tok;
-                        curr_tok = atoi(curr_token);
-		                putchar(curr_tok);
-                    }
-                    fclose(file);
-                }    
-            }
-        }    
+// dcache_created for the entry named by the first len characters of
+// name that was just added to dir
+void dcache_created_in(Fs fs, Node dir, char *name, int len) {
+    char key[PATH_MAX + 1];
+    int dir_len = node_path(dir, key, sizeof(key));
+    if (dir_len == 1) {
+        // the root
+        dir_len = 0;
+    }
+    if (dir_len < 0 || dir_len + 1 + len > PATH_MAX) {
+        dcache_created(fs, NULL, -1);
+        return;
+    }
+    key[dir_len] = '/';
+    memcpy(key + dir_len + 1, name, len);
+    dcache_created(fs, key, dir_len + 1 + len);
+}
 
-    }    
+// make every entry of the dentry cache stale; called once names have
+// gone away or moved, or cp added a tree of them
+void dcache_invalidate(Fs fs) {
+#ifdef CONCURRENT
+    __atomic_add_fetch(&fs->dc_gen, 1, __ATOMIC_SEQ_CST);
+#else
+    fs->dc_gen++;
+#endif
 }
 
-void FsCat(Fs fs, char *path) {
-    // TODO
+void dcache_lock(struct DcacheShard *s) {
+#ifdef CONCURRENT
+    pthread_mutex_lock(&s->lock);
+#endif
 }
 
-void FsDldir(Fs fs, char *path) {
-    // TODO
+void dcache_unlock(struct DcacheShard *s) {
+#ifdef CONCURRENT
+    pthread_mutex_unlock(&s->lock);
+#endif
 }
 
-void FsDl(Fs fs, bool recursive, char *path) {
-    // TODO
+// the node after n in a pre-order walk of the tree below top, NULL at
+// the end; pending copies are walked as the single node they are
+Node preorder_next(Node top, Node n) {
+    if (n->type == DIRECTORY && !HAS_FLAG(n, SHADOW) && LINK(n, l_next) != NULL) {
+        return LINK(n, l_next);
+    }
+    while (n != top) {
+        if (LINK(n, next) != NULL) {
+            return LINK(n, next);
+        }
+        n = LINK(n, h_prev);
+    }
+    return NULL;
 }
 
-void FsCp(Fs fs, bool recursive, char *src[], char *dest) {
-    // TODO
+// write the image of fs, which is quiesced, one section at a time
+bool image_write(Fs fs, FILE *out) {
+    // 1 + the place of every node and content in the image, 0 if unused
+    uint32_t *number = calloc(SlabCount(fs->nodes) + 1, sizeof(uint32_t));
+    uint32_t *content_number = calloc(SlabCount(fs->contents) + 1, sizeof(uint32_t));
+    struct ContentSlot **slots = malloc((SlabCount(fs->contents) + 1) * sizeof(*slots));
+    struct ImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.node_size = sizeof(struct FsNode);
+    h.link_size = sizeof(Link);
+    for (Node n = fs->root; n != NULL; n = preorder_next(fs->root, n)) {
+        number[SlabIndex(fs->nodes, n)] = ++h.nodes;
+#ifdef COMPACT_NODES
+        if (n->flags & LONG_NAME) {
+            h.names_size += strlen(NAME(n)) + 1;
+            h.long_names++;
+        }
+#else
+        h.names_size += strlen(NAME(n)) + 1;
+#endif
+        if (n->type == REGULAR_FILE && n->content != 0 &&
+            content_number[n->content - 1] == 0) {
+            slots[h.contents] = SlabAt(fs->contents, n->content - 1);
+            content_number[n->content - 1] = ++h.contents;
+            h.data_size += ContentSize(node_content(fs, n));
+        }
+        if (HAS_FLAG(n, SHADOW)) {
+            h.shadows++;
+        }
+    }
+    h.nodes_off = IMAGE_ALIGN;
+    h.names_off = h.nodes_off + (h.nodes * sizeof(struct FsNode) + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    h.long_names_off = (h.names_off + h.names_size + 7) / 8 * 8;
+    h.contents_off = (h.long_names_off + h.long_names * sizeof(uint32_t) + 7) / 8 * 8;
+    h.data_off = h.contents_off + h.contents * sizeof(struct ImageContent);
+    h.shadows_off = (h.data_off + h.data_size + 7) / 8 * 8;
+    h.journal_seq = fs->seq;
+    h.size = h.shadows_off + h.shadows * sizeof(uint32_t);
+    fwrite(&h, sizeof(h), 1, out);
+
+    image_pad(out, h.nodes_off);
+    uint64_t name_off = 0;
+    for (Node n = fs->root; n != NULL; n = preorder_next(fs->root, n)) {
+        struct FsNode copy = *n;
+        copy.h_prev = image_link(fs, number, n, LINK(n, h_prev));
+        copy.next = image_link(fs, number, n, LINK(n, next));
+        copy.left = image_link(fs, number, n, LINK(n, left));
+        copy.right = image_link(fs, number, n, LINK(n, right));
+        if (n->type == DIRECTORY) {
+            // a pending copy's list of other copies is rebuilt by FsLoad
+            copy.l_next = HAS_FLAG(n, SHADOW) ? 0 : image_link(fs, number, n, LINK(n, l_next));
+            copy.index = image_link(fs, number, n, LINK(n, index));
+        } else if (n->content != 0) {
+            copy.content = content_number[n->content - 1];
+        }
+#ifdef COMPACT_NODES
+        if (n->flags & LONG_NAME) {
+            copy.long_name = (char *)(uintptr_t)name_off;
+            name_off += strlen(NAME(n)) + 1;
+        }
+#else
+        copy.name = (char *)(uintptr_t)name_off;
+        name_off += strlen(NAME(n)) + 1;
+#endif
+        fwrite(&copy, sizeof(copy), 1, out);
+    }
+
+    image_pad(out, h.names_off);
+    for (Node n = fs->root; n != NULL; n = preorder_next(fs->root, n)) {
+#ifdef COMPACT_NODES
+        if (!(n->flags & LONG_NAME)) {
+            continue;
+        }
+#endif
+        fwrite(NAME(n), strlen(NAME(n)) + 1, 1, out);
+    }
+    image_pad(out, h.long_names_off);
+#ifdef COMPACT_NODES
+    for (Node n = fs->root; n != NULL; n = preorder_next(fs->root, n)) {
+        if (n->flags & LONG_NAME) {
+            fwrite(&number[SlabIndex(fs->nodes, n)], sizeof(uint32_t), 1, out);
+        }
+    }
+#endif
+
+    image_pad(out, h.contents_off);
+    uint64_t data_off = 0;
+    for (uint64_t i = 0; i < h.contents; i++) {
+        struct ImageContent entry = {data_off, 0, slots[i]->refs, 0};
+        entry.size = ContentSize(LOAD(slots[i]->content) != NULL ? slots[i]->content
+                                                                 : image_content(fs, slots[i]));
+        fwrite(&entry, sizeof(entry), 1, out);
+        data_off += entry.size;
+    }
+    char *buf = malloc(CHUNK_SIZE);
+    for (uint64_t i = 0; i < h.contents; i++) {
+        Content c = slots[i]->content;
+        size_t n;
+        for (size_t off = 0; (n = ContentRead(c, off, buf, CHUNK_SIZE)) > 0; off += n) {
+            fwrite(buf, 1, n, out);
+        }
+    }
+    free(buf);
+
+    image_pad(out, h.shadows_off);
+    for (Node n = fs->root; n != NULL; n = preorder_next(fs->root, n)) {
+        if (HAS_FLAG(n, SHADOW)) {
+            fwrite(&number[SlabIndex(fs->nodes, n)], sizeof(uint32_t), 1, out);
+        }
+    }
+    free(number);
+    free(content_number);
+    free(slots);
+    return fflush(out) == 0 && !ferror(out) && fsync(fileno(out)) == 0;
 }
 
-void FsMv(Fs fs, char *src[], char *dest) {
-    // TODO
+// check that an image of size bytes was written by this build and that
+// its sections and tables stay inside it; the nodes are checked by
+// image_nodes, once they are mapped
+bool image_valid(struct ImageHeader *h, size_t size) {
+    if (size < sizeof(*h) || memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != IMAGE_VERSION || h->node_size != sizeof(struct FsNode) ||
+        h->link_size != sizeof(Link) || h->size != size || h->nodes == 0 ||
+        h->nodes > UINT32_MAX || h->nodes_off % IMAGE_ALIGN != 0) {
+        return false;
+    }
+    if (!image_section(h->nodes_off, h->nodes, sizeof(struct FsNode), h->names_off) ||
+        !image_section(h->names_off, h->names_size, 1, h->long_names_off) ||
+        !image_section(h->long_names_off, h->long_names, sizeof(uint32_t), h->contents_off) ||
+        !image_section(h->contents_off, h->contents, sizeof(struct ImageContent), h->data_off) ||
+        !image_section(h->data_off, h->data_size, 1, h->shadows_off) ||
+        !image_section(h->shadows_off, h->shadows, sizeof(uint32_t), size) ||
+        h->contents > UINT32_MAX ||
+        (h->names_size > 0 && ((char *)h)[h->names_off + h->names_size - 1] != '\0')) {
+        return false;
+    }
+    uint32_t *long_names = (uint32_t *)((char *)h + h->long_names_off);
+    for (uint64_t i = 0; i < h->long_names; i++) {
+        if (long_names[i] == 0 || long_names[i] > h->nodes) {
+            return false;
+        }
+    }
+    struct ImageContent *contents = (struct ImageContent *)((char *)h + h->contents_off);
+    for (uint64_t i = 0; i < h->contents; i++) {
+        if (!image_section(contents[i].offset, contents[i].size, 1, h->data_size) ||
+            contents[i].refs == 0) {
+            return false;
+        }
+    }
+    uint32_t *shadows = (uint32_t *)((char *)h + h->shadows_off);
+    for (uint64_t i = 0; i < h->shadows; i++) {
+        if (shadows[i] == 0 || shadows[i] > h->nodes) {
+            return false;
+        }
+    }
+    return true;
 }
 
-//        helper functions         //
+// whether count items of item bytes from off end by end, without
+// overflowing
+bool image_section(uint64_t off, uint64_t count, uint64_t item, uint64_t end) {
+    return off <= end && count <= (end - off) / item;
+}
 
-// create a new node
-Node NewNode(char name[], FileType type) {
-    Node node = malloc(sizeof(struct FsNode));
-    node->name = strdup(name);
-    node->h_prev = NULL;
-    node->l_next = NULL;
-    node->prev = NULL;
-    node->next = NULL;
-    node->type = type;
-    return node;
+// turn the distances and name offsets of the nodes just mapped into
+// pointers, checking that every link lands on a node, every name is in
+// the names section, every type is known and every content id is in the
+// table; false at the first that isn't
+bool image_nodes(Fs fs, struct ImageHeader *h) {
+    char *names = fs->image + h->names_off;
+    for (uint64_t i = 0; i < h->nodes; i++) {
+        Node node = SlabAt(fs->nodes, i);
+        if ((node->type != DIRECTORY && node->type != REGULAR_FILE) ||
+            (i == 0 && node->type != DIRECTORY) ||
+            (node->type == REGULAR_FILE && node->content > h->contents)) {
+            return false;
+        }
+        Link *links[] = {&node->h_prev, &node->next, &node->left, &node->right,
+                         &node->l_next, &node->index};
+        int nlinks = (node->type == DIRECTORY) ? 6 : 4;
+        for (int j = 0; j < nlinks; j++) {
+            if (!image_target(i, (intptr_t)*links[j], h->nodes)) {
+                return false;
+            }
+#ifndef COMPACT_NODES
+            intptr_t distance = (intptr_t)*links[j];
+            *links[j] = (distance != 0) ? node + distance : NULL;
+#endif
+        }
+#ifdef COMPACT_NODES
+        // links stay distances, only long names need their address
+        if (!(node->flags & LONG_NAME)) {
+            if (memchr(node->short_name, '\0', SHORT_NAME) == NULL) {
+                return false;
+            }
+            continue;
+        }
+        if ((uintptr_t)node->long_name >= h->names_size) {
+            return false;
+        }
+        node->long_name = names + (uintptr_t)node->long_name;
+#else
+        if ((uintptr_t)node->name >= h->names_size) {
+            return false;
+        }
+        node->name = names + (uintptr_t)node->name;
+#endif
+    }
+    // pending copies are directories, found through their index link
+    uint32_t *shadows = (uint32_t *)(fs->image + h->shadows_off);
+    for (uint64_t i = 0; i < h->shadows; i++) {
+        Node copy = SlabAt(fs->nodes, shadows[i] - 1);
+        if (copy->type != DIRECTORY || LINK(copy, index) == NULL ||
+            LINK(copy, index)->type != DIRECTORY) {
+            return false;
+        }
+    }
+    return true;
 }
 
-// free node
-void NodeFree(Node node) {
-    if (node != NULL) {
-        NodeFree(node->next);
-        NodeFree(node->l_next);
-        free(node->name);
-        free(node);
-    }  
+// whether the link distance from node i is 0 or lands on one of the
+// nodes
+bool image_target(uint64_t i, int64_t distance, uint64_t nodes) {
+    return distance >= -(int64_t)i && distance < (int64_t)(nodes - i);
 }
 
-// look into the directory and check each node
-Node lookInDir (Node node, char* name) {
-    if (node == NULL) { 
-        // not exist
-        return NULL;
-    } else if (strcmp(node->name, name) == 0) { 
-        // find it
-        return node;
-    } else { 
-        // check next
-        return lookInDir(node->next, name);
+// the link from n to target as it is stored in an image
+Link image_link(Fs fs, uint32_t *number, Node n, Node target) {
+    if (target == NULL) {
+        return 0;
     }
+    int64_t distance = (int64_t)number[SlabIndex(fs->nodes, target)] -
+                       (int64_t)number[SlabIndex(fs->nodes, n)];
+    return (Link)(intptr_t)distance;
 }
 
-// initiate the node
-Node create_here (Node node, Node prev, Node h_prev, char *name, FileType type) {
-    if (node == NULL) {
-        // create new node and initiate it
-        Node new = NewNode(name, type);
-        new->prev = prev;
-        new->h_prev = h_prev;
-        printf("created %s under %s ", name, new->h_prev->name);
-        if (prev!= NULL) {            
-            printf("after %s\n", new->prev->name);
-        } else {
-            printf("\n");
-        }
-        return new;
-    } else if (strcmp(name, node->name) > 0) { 
-        // order in canonical order
-        // find until the next node satisfied the condition
-        node->next = create_here (node->next, node, h_prev, name, type);
-        return node;
-    } else {
-        // the node is not null and the name is in canonical order
-        // create a new node and initiate it 
-        Node new = NewNode(name, type);
-        new->prev = prev;
-        new->h_prev = h_prev;
-        new->next = node;
-        printf("created %s under %s ", name, new->h_prev->name);
-        if (prev!= NULL) {            
-            printf("after %s before %s\n", new->prev->name, new->next->name);
+// write zero bytes up to offset
+void image_pad(FILE *out, uint64_t offset) {
+    long pos = ftell(out);
+    while (pos >= 0 && (uint64_t)pos < offset) {
+        fputc('\0', out);
+        pos++;
+    }
+}
+
+// log a change to fs before it is made: the paths in src (NULL-terminated,
+// or NULL), then path, with relative paths made absolute from the calling
+// thread's current directory, and the len bytes of data. With CONCURRENT
+// no other change starts until journal_end, so the journal holds changes
+// in the order they took effect.
+void journal_begin(Fs fs, JournalOp op, bool flag, char *src[], char *path,
+                   char *data, size_t len, size_t offset) {
+    if (fs->journal == NULL) {
+        return;
+    }
+    journal_hold(fs);
+    journal_log(fs, op, flag, src, path, data, len, offset);
+}
+
+// journal_begin for a change that is logged later, with journal_log, if
+// it goes ahead at all: whether it does may depend on what isn't logged
+void journal_hold(Fs fs) {
+#ifdef CONCURRENT
+    if (fs->journal != NULL) {
+        pthread_mutex_lock(&fs->journal_lock);
+    }
+#endif
+}
+
+// append a change to the journal; the caller orders changes, see
+// journal_begin. Data too long for one record goes in several: a put or
+// an append continued by writes or appends of the rest.
+void journal_log(Fs fs, JournalOp op, bool flag, char *src[], char *path,
+                 char *data, size_t len, size_t offset) {
+    struct FsThread *me = fs_self(fs);
+    int npaths = 1;
+    while (src != NULL && src[npaths - 1] != NULL) {
+        npaths++;
+    }
+    char **paths = malloc(npaths * sizeof(char *));
+    size_t paths_len = 0;
+    for (int i = 0; i < npaths; i++) {
+        char *p = (i < npaths - 1) ? src[i] : path;
+        if (p[0] == '/') {
+            paths[i] = p;
         } else {
-            printf("before %s\n",new->next->name);
-        }    
-        return new;
+            paths[i] = malloc(me->cwd_len + strlen(p) + 2);
+            sprintf(paths[i], "%s/%s", (me->cwd_len > 1) ? me->cwd : "", p);
+        }
+        paths_len += strlen(paths[i]) + 1;
+    }
+    // a record whose paths alone are too long is refused whatever its data
+    size_t room = (paths_len < JOURNAL_MAX_RECORD) ? JOURNAL_MAX_RECORD - paths_len : 1;
+    size_t done = 0;
+    bool logged;
+    do {
+        size_t n = (len - done < room) ? len - done : room;
+        JournalOp part = (done == 0) ? op : (op == OP_APPEND) ? OP_APPEND : OP_PWRITE;
+        char *chunk = (data != NULL) ? data + done : NULL;
+        struct JournalRecord r = {++fs->seq, part, flag, offset + done, npaths, paths, chunk, n};
+        logged = JournalAppend(fs->journal, &r);
+        done += n;
+    } while (logged && done < len);
+    if (!logged) {
+        OutputPrintf(fs_out(fs), "journal: '%s': change too large to log\n", path);
+    }
+    for (int i = 0; i < npaths; i++) {
+        if (paths[i] != ((i < npaths - 1) ? src[i] : path)) {
+            free(paths[i]);
+        }
+    }
+    free(paths);
+}
+
+void journal_end(Fs fs) {
+#ifdef CONCURRENT
+    if (fs->journal != NULL) {
+        pthread_mutex_unlock(&fs->journal_lock);
+    }
+#endif
+}
+
+// make a logged change again
+void journal_apply(Fs fs, struct JournalRecord *r) {
+    char *path = r->paths[r->npaths - 1];
+    char *data = (r->data != NULL) ? r->data : "";
+    // the sources of cp and mv, as a NULL-terminated list
+    char **src = malloc(r->npaths * sizeof(char *));
+    memcpy(src, r->paths, (r->npaths - 1) * sizeof(char *));
+    src[r->npaths - 1] = NULL;
+    switch (r->op) {
+        case OP_MKDIR:      FsMkdir(fs, path); break;
+        case OP_MKFILE:     FsMkfile(fs, path); break;
+        case OP_PUT:
+            // a copy of the bytes, which may hold NULs, for the file to keep
+            FsAdopt(fs, path, memcpy(malloc(r->data_len + 1), data, r->data_len), r->data_len);
+            break;
+        case OP_APPEND:     FsAppend(fs, path, data); break;
+        case OP_PWRITE:     FsPwrite(fs, path, data, r->data_len, r->offset); break;
+        case OP_DLDIR:      FsDldir(fs, path); break;
+        case OP_DL:         FsDl(fs, r->flag, path); break;
+        case OP_CP:         FsCp(fs, r->flag, src, path); break;
+        case OP_MV:         FsMv(fs, src, path); break;
     }
+    free(src);
 }
 
-// prints the canonical path of the current working directory
-void print_current_dir(Node curr) {
-    char pwd[PATH_MAX];
-    strcpy(pwd, "");
-    char path[PATH_MAX + 1];
-    while(curr != NULL) {
-        // if the curr is not the root
-        if(curr->h_prev != NULL) { 
-            // attach the h_prev to the pwd
-            strcpy(path, pwd);
-            strcpy(pwd, "/");
-            strcat(pwd, curr->name);
-            strcat(pwd, path);
+// make a rename into the directory holding path durable
+void sync_dir(char *path) {
+    char dir[PATH_MAX + 1];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        // keep the "/" of a file in the root
+        if (slash == dir) {
+            slash++;
         }
-        curr = curr->h_prev;
+        *slash = '\0';
     }
-    if (strcmp(pwd, "") == 0) {
-        strcpy(pwd, "/");
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
     }
-    printf("%s\n", pwd);
 }
 
-void tree(Node n, int level) {
-    if (n == NULL) {
-        return;
+// keep every writer out until fs_resume; with CONCURRENT that is every
+// lock a change takes, in the order writers take them
+void fs_quiesce(Fs fs) {
+#ifdef CONCURRENT
+    pthread_mutex_lock(&fs->shadow_lock);
+    for (int i = 0; i < STRIPES; i++) {
+        pthread_mutex_lock(&fs->stripes[i].lock);
     }
-    for (int i = 0; i < level; i++) {
-        printf("    ");
+    for (int i = 0; i < STRIPES; i++) {
+        pthread_rwlock_rdlock(&fs->content_locks[i]);
     }
-    printf("%s\n",n->name);
-    tree(n->l_next, level + 1);
-    tree(n->next, level);
-    return;
+#endif
 }
 
+void fs_resume(Fs fs) {
+#ifdef CONCURRENT
+    for (int i = STRIPES - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&fs->content_locks[i]);
+        pthread_mutex_unlock(&fs->stripes[i].lock);
+    }
+    pthread_mutex_unlock(&fs->shadow_lock);
+#endif
+}
@@ -3,16 +3,126 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define PATH_MAX 4096
 
 typedef struct FsRep *Fs;
 
+typedef struct FsViewRep *FsView;
+
+// how an operation of FsBatch went
+typedef enum {
+    FS_OK,
+    FS_NOT_FOUND,   // the parent, or the file to put, doesn't exist
+    FS_NOT_DIR,     // a name on the way is a regular file
+    FS_EXISTS,      // mkdir or mkfile of a name already taken
+    FS_IS_DIR,      // put to a directory
+} FsStatus;
+
+typedef enum {
+    FS_MKDIR,
+    FS_MKFILE,
+    FS_PUT,
+    FS_ADOPT,       // FsAdopt: content is taken over, whatever the status
+} FsOpType;
+
+struct FsOp {
+    FsOpType type;
+    char *path;
+    char *content;  // for FS_PUT and FS_ADOPT
+    size_t len;     // for FS_ADOPT
+};
+
 Fs FsNew(void);
 
 void FsGetCwd(Fs fs, char cwd[PATH_MAX + 1]);
 
+// writes the canonical absolute path of path into resolved;
+// returns false if path doesn't exist
+bool FsRealpath(Fs fs, char *path, char resolved[PATH_MAX + 1]);
+
+// how the cache of path lookups has done since fs was made; lookups of
+// paths with "." or ".." in them don't use it
+struct FsCacheStats {
+    unsigned long hits;     // answered from the cache
+    unsigned long misses;   // that walked the tree
+    size_t entries;         // paths it holds, found or known to be missing
+};
+
+void FsGetCacheStats(Fs fs, struct FsCacheStats *stats);
+
+// what fs holds, counted when asked. A directory copied by FsCp counts
+// as one empty directory until it or the directory it copies changes.
+struct FsStats {
+    size_t directories;         // including the root
+    size_t files;
+    size_t name_bytes;          // of every name but the root's
+    size_t contents;            // distinct file contents, shared ones once
+    size_t content_bytes;       // of those contents
+    size_t compressed;          // of those contents, the ones compressed
+    size_t compressed_bytes;    // the memory those take
+    size_t spilled;             // of those contents, the ones in the spill file
+    size_t spilled_bytes;       // of those
+    size_t resident_bytes;      // taken by contents, see FsSetBudget
+    size_t max_fanout;          // most entries in one directory
+    size_t max_depth;           // of the deepest entry, 1 in the root
+    size_t node_bytes;          // taken by the node allocator
+    size_t name_arena_bytes;    // taken by names too long for their node
+    size_t content_table_bytes; // taken by the table of contents
+    size_t blocks;              // held for contents put with dedup on
+    size_t block_bytes;         // the memory those take
+    size_t block_referenced;    // the bytes of contents made of them
+};
+
+void FsGetStats(Fs fs, struct FsStats *stats);
+
+// prints a "name value" line for each count of FsGetStats and
+// FsGetCacheStats. A build with STATS also counts and times the calls to
+// every operation that works on fs, and adds their call counts, total time
+// and cumulative latency histograms in powers of two nanoseconds, as
+//     fs_op_calls{op="mkdir"} 10
+//     fs_op_ns_total{op="mkdir"} 10240
+//     fs_op_latency_ns_bucket{op="mkdir",le="1024"} 9
+// Without STATS nothing is counted.
+void FsDumpStats(Fs fs);
+
 void FsFree(Fs fs);
 
+// receives the next len bytes of what a file system prints; len is never 0
+typedef void (*FsWriter)(void *arg, const char *buf, size_t len);
+
+// sends everything fs prints, listings, file contents and error messages
+// alike, to write(arg, ...) in blocks of up to 64 KiB instead of to stdout;
+// a NULL write goes back to stdout. ls and tree color names by type if
+// colored is true, which it is by default in a build with COLORED.
+// What an operation prints has been written by the time it returns.
+// Call it before other threads use fs.
+void FsSetOutput(Fs fs, FsWriter write, void *arg, bool colored);
+
+// writes the whole file system to an image at path, replacing it only
+// once the image is complete; returns false if it can't be written
+bool FsSave(Fs fs, char *path);
+
+// a file system that uses the image at path, saved by the same build,
+// where it is mapped; NULL if path can't be read or isn't such an image,
+// which is reported on stdout since there is no fs to print through yet
+Fs FsLoad(char *path);
+
+// replays the journal at path (created if missing) onto fs, skipping the
+// changes the image fs was loaded from already has, then logs every change
+// made by FsMkdir, FsMkfile, FsPut, FsAppend, FsPwrite, FsDldir, FsDl,
+// FsCp and FsMv there before making it. Logged changes are made durable
+// before they return if sync_ms is 0, every sync_ms milliseconds if it is
+// positive and whenever the system writes them back if it is negative.
+// Call it before other threads use fs; returns false if path can't be used.
+bool FsJournal(Fs fs, char *path, int sync_ms);
+
+// saves fs to the image at path like FsSave, then empties its journal
+bool FsCheckpoint(Fs fs, char *path);
+
 void FsMkdir(Fs fs, char *path);
 
 void FsMkfile(Fs fs, char *path);
@@ -27,14 +137,160 @@ void FsTree(Fs fs, char *path);
 
 void FsPut(Fs fs, char *path, char *content);
 
+// like FsPut of the len bytes in buf, which may hold NUL bytes, but the
+// file takes buf over instead of copying it; buf comes from malloc and is
+// freed by fs, now if path isn't a regular file or FsSetDedup is on.
+// Returns whether path is a regular file.
+bool FsAdopt(Fs fs, char *path, char *buf, size_t len);
+
+void FsAppend(Fs fs, char *path, char *content);
+
+// reads up to size bytes of the file at offset into buf, like pread(2);
+// returns the number of bytes read or -1 if path isn't a regular file
+ssize_t FsPread(Fs fs, char *path, char *buf, size_t size, size_t offset);
+
+// writes size bytes from buf at offset, extending the file with zero bytes
+// if offset is past its end; returns size or -1 if path isn't a regular file
+ssize_t FsPwrite(Fs fs, char *path, char *buf, size_t size, size_t offset);
+
 void FsCat(Fs fs, char *path);
 
+// a view of the file's content as it is now, NULL if path isn't a regular
+// file. Later changes to the file leave the view as it was, and while it
+// is open its content is neither compressed nor spilled; a content that
+// is compressed already is decompressed once for it. Close every view
+// before FsFree.
+FsView FsOpenView(Fs fs, char *path);
+
+size_t FsViewSize(FsView v);
+
+// fills up to max entries of iov with where the bytes of the view from
+// offset on are, up to len of them, without copying them; returns the
+// entries filled, 0 past the end. They stay valid until the view closes.
+int FsViewRead(FsView v, size_t offset, size_t len, struct iovec iov[], int max);
+
+void FsCloseView(FsView v);
+
+// applies n operations grouped by parent directory, without printing:
+// parents come before their subdirectories, the operations on one name
+// keep their order, and paths with "." or ".." in them come last.
+// status[i] tells how ops[i] went.
+void FsBatch(Fs fs, struct FsOp ops[], int n, FsStatus status[]);
+
 void FsDldir(Fs fs, char *path);
 
+// a directory removed with recursive is only unlinked; what was in it is
+// freed a little at a time by the operations that follow, by FsReclaim,
+// or all at once by FsSave, FsGetStats and FsFree
 void FsDl(Fs fs, bool recursive, char *path);
 
+// frees up to max nodes left by recursive FsDl; returns whether any are
+// still left. For a caller that is idle, or a thread of its own with
+// CONCURRENT, to finish the work sooner.
+bool FsReclaim(Fs fs, size_t max);
+
+// keeps the memory file contents take, leaving out the blocks of
+// FsSetDedup and contents still in a loaded image, within bytes: when an
+// operation leaves it over, the contents used least recently are written
+// out to a spill file at spill_path and read back through a mapping of
+// it, page by page as they are read. The first change to a spilled
+// content brings it back. Directories, names and the rest of the tree
+// always stay in memory. 0 bytes turns it off, as it is by default.
+// Returns false if the spill file can't be made. Call it before other
+// threads use fs.
+bool FsSetBudget(Fs fs, size_t bytes, char *spill_path);
+
+// while on, FsPut cuts what it stores into blocks on boundaries found
+// from the bytes themselves and keeps each distinct block once, shared by
+// every content holding it, so identical files and files with shifted
+// copies of the same data take the memory of one. A content is only kept
+// in blocks until it is next changed otherwise. It is off by default.
+void FsSetDedup(Fs fs, bool on);
+
+// once cold_ms is 0 or more, the operations that follow compress a few of
+// the contents no file has been read or written through for cold_ms on
+// their way out, as they free detached nodes. A compressed content is
+// decompressed a chunk at a time as it is read, with the last few
+// chunks read in part kept, and for good when it is changed. It is off,
+// as cold_ms < 0 sets it, by default.
+void FsSetCompression(Fs fs, int cold_ms);
+
+// compresses every content that is cold now, or every one while
+// compression is off, returning how many; for a caller that is idle, or
+// a thread of its own with CONCURRENT
+size_t FsCompress(Fs fs);
+
 void FsCp(Fs fs, bool recursive, char *src[], char *dest);
 
 void FsMv(Fs fs, char *src[], char *dest);
 
+// which entries FsFind reports
+typedef enum {
+    FS_FIND_ANY,
+    FS_FIND_DIRECTORIES,
+    FS_FIND_FILES,
+} FsFindType;
+
+struct FsFindQuery {
+    char *pattern;      // matched against each name, NULL for every name
+    bool regex;         // a POSIX extended regex instead of a glob
+    FsFindType type;
+    int min_depth;      // the entries of the start directory are at depth 1
+    int max_depth;      // -1 for no limit
+    int threads;        // searching at once; 0 or 1 searches in the caller
+};
+
+// receives the canonical path of a match; returns false to stop the search.
+// A NULL one only has the matches counted.
+typedef bool (*FsFindFn)(void *arg, const char *path, bool is_dir);
+
+// calls found for every entry below path that passes query, in sorted
+// depth-first order when searching in the caller and in no set order
+// otherwise, one call at a time. Returns the number of calls, or -1 if
+// path isn't a directory or the pattern doesn't compile, which is printed.
+// Nothing may change fs while it runs unless it was built with CONCURRENT.
+long FsFind(Fs fs, char *path, struct FsFindQuery *query, FsFindFn found, void *arg);
+
+struct FsGrepQuery {
+    char *pattern;
+    bool regex;         // a POSIX extended regex instead of a literal
+    int threads;        // searching at once; 0 or 1 searches in the caller
+};
+
+// receives a line with a match: the canonical path of its file, the offset
+// in the file of the line's first match and the line's number, counting
+// from 1; returns false to stop the search. A NULL one only has the lines
+// counted.
+typedef bool (*FsGrepFn)(void *arg, const char *path, size_t offset, size_t line);
+
+// calls found for every line with a match in path, if it is a regular
+// file, or in the regular files below it, one call at a time. The files are
+// searched in place, in FsFind's order when searching in the caller and
+// largest first, spread over the threads, otherwise; each file's lines
+// come in order. Returns the number of calls, or -1 if path doesn't exist
+// or the pattern doesn't compile, which is printed. found must not change
+// fs, and nothing else may unless it was built with CONCURRENT.
+long FsGrep(Fs fs, char *path, struct FsGrepQuery *query, FsGrepFn found, void *arg);
+
+// copies the tree below the host directory host_path into the directory
+// path: host directories and regular files become directories and files
+// of the same names, merged with what is there already, and nothing else
+// is copied. threads, the caller among them, walk the host tree and read
+// its files whole, many at a time through io_uring where the kernel has
+// it; the caller makes each host directory's entries with one FsBatch,
+// handing it the buffers read as FS_ADOPT. Returns the directories and
+// files copied, or -1 if either directory doesn't exist; that and what
+// couldn't be copied are printed. Only the caller uses fs.
+long FsImport(Fs fs, char *host_path, char *path, int threads);
+
+// the reverse of FsImport: copies the tree below the directory path into
+// the host directory host_path, made if it doesn't exist, overwriting
+// files of the same names. The caller makes the directories; threads,
+// the caller among them, take the files in the order FsFind finds them
+// and write each straight from its content. Returns the directories and
+// files copied, or -1 if either directory can't be used; that and what
+// couldn't be written are printed. Nothing may change fs while it runs
+// unless it was built with CONCURRENT.
+long FsExport(Fs fs, char *path, char *host_path, int threads);
+
 #endif
\ No newline at end of file
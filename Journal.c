@@ -0,0 +1,317 @@
+// Implementation of the Journal ADT
+// The file starts with JOURNAL_MAGIC and then holds one record after the
+// other: a struct RecordHeader, the record's paths, each terminated by a
+// NUL, and its data. The CRC in the header covers the rest of the record,
+// so a write torn by a crash is noticed when the journal is read.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Journal.h"
+
+// the second layout, with 64-bit record sizes; a journal of the first
+// isn't opened, rather than being misread
+#define JOURNAL_MAGIC "MIMFSJN2"
+
+// bytes of appended records kept back before they are written
+#define JOURNAL_BUFFER (64 * 1024)
+
+struct RecordHeader {
+    uint32_t crc;           // CRC-32 of everything after this field
+    uint16_t npaths;
+    uint8_t op;
+    uint8_t flag;
+    uint64_t size;          // bytes after the header
+    uint64_t seq;
+    uint64_t offset;
+    uint64_t data_len;
+};
+
+struct JournalRep {
+    int fd;
+    int sync_ms;
+    off_t end;              // end of the last good record read
+    char *record;           // the record last read, see JournalRead
+    size_t record_cap;
+    char **paths;
+    int paths_cap;
+    pthread_mutex_t lock;   // guards what follows
+    char *buf;              // appended records not written yet
+    size_t len;
+    size_t cap;
+    bool dirty;             // written but not synced
+    bool stop;
+    pthread_cond_t wake;
+    pthread_t flusher;      // runs while sync_ms > 0
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// helper function declaration
+static void *flusher(void *arg);
+static void journal_write(Journal j);
+static void write_all(int fd, char *buf, size_t len);
+static void crc_init(void);
+static uint32_t crc32(const char *buf, size_t len);
+
+Journal JournalOpen(char *path, int sync_ms) {
+    pthread_once(&crc_once, crc_init);
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char magic[sizeof(JOURNAL_MAGIC) - 1];
+    if (st.st_size == 0) {
+        // a new journal
+        write_all(fd, JOURNAL_MAGIC, sizeof(magic));
+        fsync(fd);
+    } else if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+               memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    Journal j = malloc(sizeof(struct JournalRep));
+    j->fd = fd;
+    j->sync_ms = sync_ms;
+    j->end = sizeof(magic);
+    j->record = NULL;
+    j->record_cap = 0;
+    j->paths = NULL;
+    j->paths_cap = 0;
+    pthread_mutex_init(&j->lock, NULL);
+    j->buf = malloc(JOURNAL_BUFFER);
+    j->len = 0;
+    j->cap = JOURNAL_BUFFER;
+    j->dirty = false;
+    j->stop = false;
+    pthread_cond_init(&j->wake, NULL);
+    if (sync_ms > 0) {
+        pthread_create(&j->flusher, NULL, flusher, j);
+    }
+    return j;
+}
+
+bool JournalRead(Journal j, struct JournalRecord *r) {
+    struct RecordHeader h;
+    bool good = pread(j->fd, &h, sizeof(h), j->end) == sizeof(h) && h.size <= JOURNAL_MAX_RECORD &&
+                h.data_len <= h.size;
+    if (good && h.size + 1 > j->record_cap) {
+        j->record_cap = h.size + 1;
+        j->record = realloc(j->record, j->record_cap);
+    }
+    good = good && pread(j->fd, j->record, h.size, j->end + sizeof(h)) == h.size;
+    if (good) {
+        uint32_t crc = crc32((char *)&h + sizeof(h.crc), sizeof(h) - sizeof(h.crc));
+        crc ^= crc32(j->record, h.size);
+        good = crc == h.crc;
+    }
+    if (good && h.npaths > j->paths_cap) {
+        j->paths_cap = h.npaths;
+        j->paths = realloc(j->paths, j->paths_cap * sizeof(char *));
+    }
+    char *p = j->record;
+    char *data = good ? j->record + h.size - h.data_len : NULL;
+    for (int i = 0; good && i < h.npaths; i++) {
+        char *nul = memchr(p, '\0', data - p);
+        good = nul != NULL;
+        j->paths[i] = p;
+        p = (nul != NULL) ? nul + 1 : p;
+    }
+    if (!good) {
+        // cut off a torn record and whatever follows it
+        if (ftruncate(j->fd, j->end) == 0) {
+            fsync(j->fd);
+        }
+        return false;
+    }
+    // the data is terminated too, for callers that expect a string
+    j->record[h.size] = '\0';
+    j->end += sizeof(h) + h.size;
+    r->seq = h.seq;
+    r->op = h.op;
+    r->flag = h.flag;
+    r->offset = h.offset;
+    r->npaths = h.npaths;
+    r->paths = j->paths;
+    r->data = (h.data_len > 0) ? data : NULL;
+    r->data_len = h.data_len;
+    return true;
+}
+
+bool JournalAppend(Journal j, struct JournalRecord *r) {
+    struct RecordHeader h;
+    memset(&h, 0, sizeof(h));
+    // sizes are checked one at a time, so that adding them can't wrap
+    bool fits = r->npaths <= UINT16_MAX && r->data_len <= JOURNAL_MAX_RECORD;
+    h.size = r->data_len;
+    for (int i = 0; fits && i < r->npaths; i++) {
+        size_t len = strlen(r->paths[i]) + 1;
+        fits = len <= JOURNAL_MAX_RECORD - h.size;
+        h.size += len;
+    }
+    if (!fits) {
+        return false;
+    }
+    h.seq = r->seq;
+    h.offset = r->offset;
+    h.data_len = r->data_len;
+    h.op = r->op;
+    h.flag = r->flag;
+    h.npaths = r->npaths;
+    pthread_mutex_lock(&j->lock);
+    if (j->len + sizeof(h) + h.size > j->cap) {
+        journal_write(j);
+        if (sizeof(h) + h.size > j->cap) {
+            j->cap = sizeof(h) + h.size;
+            j->buf = realloc(j->buf, j->cap);
+        }
+    }
+    // encode the record in place, then fill in its CRC
+    char *start = j->buf + j->len;
+    char *p = start + sizeof(h);
+    for (int i = 0; i < r->npaths; i++) {
+        size_t len = strlen(r->paths[i]) + 1;
+        memcpy(p, r->paths[i], len);
+        p += len;
+    }
+    if (r->data_len > 0) {
+        memcpy(p, r->data, r->data_len);
+    }
+    h.crc = crc32((char *)&h + sizeof(h.crc), sizeof(h) - sizeof(h.crc)) ^
+            crc32(start + sizeof(h), h.size);
+    memcpy(start, &h, sizeof(h));
+    j->len += sizeof(h) + h.size;
+    if (j->sync_ms == 0) {
+        journal_write(j);
+        fdatasync(j->fd);
+        j->dirty = false;
+    } else if (j->len >= JOURNAL_BUFFER) {
+        journal_write(j);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return true;
+}
+
+void JournalSync(Journal j) {
+    pthread_mutex_lock(&j->lock);
+    journal_write(j);
+    bool dirty = j->dirty;
+    j->dirty = false;
+    pthread_mutex_unlock(&j->lock);
+    if (dirty) {
+        fdatasync(j->fd);
+    }
+}
+
+void JournalTruncate(Journal j) {
+    pthread_mutex_lock(&j->lock);
+    j->len = 0;
+    j->dirty = false;
+    j->end = sizeof(JOURNAL_MAGIC) - 1;
+    if (ftruncate(j->fd, j->end) != 0) {
+        perror("journal");
+        exit(1);
+    }
+    fsync(j->fd);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void JournalClose(Journal j) {
+    if (j->sync_ms > 0) {
+        pthread_mutex_lock(&j->lock);
+        j->stop = true;
+        pthread_cond_signal(&j->wake);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->flusher, NULL);
+    }
+    if (j->sync_ms >= 0) {
+        JournalSync(j);
+    } else {
+        pthread_mutex_lock(&j->lock);
+        journal_write(j);
+        pthread_mutex_unlock(&j->lock);
+    }
+    close(j->fd);
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->wake);
+    free(j->record);
+    free(j->paths);
+    free(j->buf);
+    free(j);
+}
+
+//        helper functions         //
+
+// group commit: every sync_ms milliseconds, write what was appended and
+// sync it with one fdatasync, outside the lock so appends go on meanwhile
+static void *flusher(void *arg) {
+    Journal j = arg;
+    pthread_mutex_lock(&j->lock);
+    while (!j->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (long)(j->sync_ms % 1000) * 1000000;
+        until.tv_sec += j->sync_ms / 1000 + until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&j->wake, &j->lock, &until);
+        journal_write(j);
+        if (j->dirty) {
+            j->dirty = false;
+            pthread_mutex_unlock(&j->lock);
+            fdatasync(j->fd);
+            pthread_mutex_lock(&j->lock);
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+// hand the buffered records to the file; the caller holds the lock
+static void journal_write(Journal j) {
+    if (j->len > 0) {
+        write_all(j->fd, j->buf, j->len);
+        j->len = 0;
+        j->dirty = true;
+    }
+}
+
+static void write_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            perror("journal");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const char *buf, size_t len) {
+    uint32_t c = 0xffffffffu;
+    for (size_t i = 0; i < len; i++) {
+        c = crc_table[(c ^ (unsigned char)buf[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffffu;
+}
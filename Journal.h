@@ -0,0 +1,54 @@
+// Interface to the Journal ADT, an append-only file of records that is
+// read back in order after a crash
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct JournalRep *Journal;
+
+// the most bytes of paths and data one record holds: JournalAppend
+// refuses a longer record, and JournalRead takes one for damage
+#define JOURNAL_MAX_RECORD ((uint64_t)1 << 30)
+
+// one logged change; what the fields mean is up to the caller
+struct JournalRecord {
+    uint64_t seq;           // increasing from one record to the next
+    uint8_t op;
+    bool flag;
+    uint64_t offset;
+    int npaths;
+    char **paths;           // npaths NUL-terminated strings
+    char *data;             // data_len bytes, NULL if there are none
+    size_t data_len;
+};
+
+// opens the journal at path, creating it if needed, positioned at its
+// first record. Appended records are made durable before JournalAppend
+// returns if sync_ms is 0, by a background thread every sync_ms
+// milliseconds if it is positive, and never if it is negative.
+// Returns NULL if path can't be opened or isn't a journal.
+Journal JournalOpen(char *path, int sync_ms);
+
+// reads the next record into r, whose strings stay valid until the next
+// call; returns false at the end of the journal, where a record cut short
+// or damaged by a crash is dropped together with everything after it
+bool JournalRead(Journal j, struct JournalRecord *r);
+
+// adds r at the end of the journal; returns false, adding nothing, if r
+// holds more than JOURNAL_MAX_RECORD bytes or more than UINT16_MAX paths
+bool JournalAppend(Journal j, struct JournalRecord *r);
+
+// makes every record appended so far durable
+void JournalSync(Journal j);
+
+// drops every record, durably
+void JournalTruncate(Journal j);
+
+// syncs as the policy says and closes the journal
+void JournalClose(Journal j);
+
+#endif
@@ -0,0 +1,194 @@
+// Implementation of the Lz codec
+// A block is a run of sequences: a token byte holding a literal count and
+// a match length in four bits each, more bytes for either when it doesn't
+// fit (each 255 adds on, the first smaller one ends it), the literals,
+// then the match as a two-byte distance back into what is already
+// decompressed. The last sequence is only literals. Matches are found
+// through a table of where each hash of four bytes was last seen.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Lz.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5     // a block always ends with this many literals
+#define MATCH_START 12      // no match starts in this many last bytes
+#define HASH_BITS 12
+
+// helper function declaration
+static uint32_t read32(const char *p);
+static uint32_t hash4(uint32_t v);
+static size_t match_length(const char *a, const char *b, const char *end);
+static size_t put_length(char *dst, size_t len);
+static size_t emit(char *dst, size_t cap, const char *lit, size_t nlit, size_t offset,
+                   size_t mlen);
+
+size_t LzCompress(const char *src, size_t n, char *dst, size_t cap) {
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t ip = 1;
+    size_t anchor = 0;
+    size_t op = 0;
+    while (n >= MATCH_START && ip + MATCH_START <= n) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = hash4(seq);
+        size_t ref = table[h];
+        table[h] = ip;
+        if (ref >= ip || ip - ref > 0xffff || read32(src + ref) != seq) {
+            // the longer nothing matches, the bigger the steps
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+        }
+        size_t len = MIN_MATCH + match_length(src + ip + MIN_MATCH, src + ref + MIN_MATCH,
+                                              src + n - LAST_LITERALS);
+        size_t k = emit(dst + op, cap - op, src + anchor, ip - anchor, ip - ref, len);
+        if (k == 0) {
+            return 0;
+        }
+        op += k;
+        ip += len;
+        anchor = ip;
+        if (ip >= 2 && ip + 2 <= n) {
+            table[hash4(read32(src + ip - 2))] = ip - 2;
+        }
+    }
+    size_t k = emit(dst + op, cap - op, src + anchor, n - anchor, 0, 0);
+    return (k == 0) ? 0 : op + k;
+}
+
+size_t LzDecompress(const char *src, size_t n, char *dst, size_t cap) {
+    const unsigned char *in = (const unsigned char *)src;
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < n) {
+        unsigned token = in[ip++];
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            unsigned b;
+            do {
+                if (ip >= n) {
+                    return 0;
+                }
+                b = in[ip++];
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > n - ip || nlit > cap - op) {
+            return 0;
+        }
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) {
+            break;
+        } else if (n - ip < 2) {
+            return 0;
+        }
+        size_t offset = in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned b;
+            do {
+                if (ip >= n) {
+                    return 0;
+                }
+                b = in[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > cap - op) {
+            return 0;
+        }
+        char *to = dst + op;
+        const char *from = to - offset;
+        if (offset >= mlen) {
+            memcpy(to, from, mlen);
+        } else {
+            // the match overlaps what it makes: a repeating pattern
+            for (size_t i = 0; i < mlen; i++) {
+                to[i] = from[i];
+            }
+        }
+        op += mlen;
+    }
+    return op;
+}
+
+//        helper functions         //
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// how many bytes from a on match those from b, stopping at end
+static size_t match_length(const char *a, const char *b, const char *end) {
+    const char *start = a;
+    while (a + 8 <= end) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y) {
+            return a - start + __builtin_ctzll(x ^ y) / 8;
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < end && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+// the bytes after the token for a length of len that didn't fit in it
+static size_t put_length(char *dst, size_t len) {
+    size_t k = 0;
+    while (len >= 255) {
+        dst[k++] = (char)255;
+        len -= 255;
+    }
+    dst[k++] = (char)len;
+    return k;
+}
+
+// write one sequence, the last one if mlen is 0; returns its size, or 0
+// if it needs more than cap bytes
+static size_t emit(char *dst, size_t cap, const char *lit, size_t nlit, size_t offset,
+                   size_t mlen) {
+    size_t need = 1 + nlit + nlit / 255 + 1 + ((mlen > 0) ? 2 + (mlen - MIN_MATCH) / 255 + 1 : 0);
+    if (need > cap) {
+        return 0;
+    }
+    size_t k = 1;
+    unsigned token = (nlit < 15) ? nlit << 4 : 15 << 4;
+    if (nlit >= 15) {
+        k += put_length(dst + k, nlit - 15);
+    }
+    memcpy(dst + k, lit, nlit);
+    k += nlit;
+    if (mlen > 0) {
+        size_t m = mlen - MIN_MATCH;
+        token |= (m < 15) ? m : 15;
+        dst[k++] = (char)(offset & 0xff);
+        dst[k++] = (char)(offset >> 8);
+        if (m >= 15) {
+            k += put_length(dst + k, m - 15);
+        }
+    }
+    dst[0] = (char)token;
+    return k;
+}
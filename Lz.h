@@ -0,0 +1,22 @@
+// Interface to the Lz codec, an LZ77 compressor in the style of LZ4 for
+// blocks of up to 64 KiB: fast to decompress, and fast enough to compress
+// that contents can be compressed while operations wait
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// the largest block it takes
+#define LZ_BLOCK (64 * 1024)
+
+// compresses the n bytes at src into dst, which has room for cap bytes;
+// returns the compressed size, or 0 if that would be more than cap
+size_t LzCompress(const char *src, size_t n, char *dst, size_t cap);
+
+// decompresses the n bytes at src into dst, which has room for cap bytes;
+// returns the decompressed size, or 0 if src isn't what LzCompress makes
+// or doesn't fit
+size_t LzDecompress(const char *src, size_t n, char *dst, size_t cap);
+
+#endif
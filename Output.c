@@ -0,0 +1,106 @@
+// Implementation of the Output ADT
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Output.h"
+
+struct OutputRep {
+    OutputWriter write;
+    void *arg;
+    bool colored;
+    size_t len;                 // bytes collected in buf
+    char buf[OUTPUT_BUFFER];
+};
+
+Output OutputNew(OutputWriter write, void *arg) {
+    Output o = malloc(sizeof(struct OutputRep));
+    o->write = write;
+    o->arg = arg;
+    o->colored = false;
+    o->len = 0;
+    return o;
+}
+
+void OutputFree(Output o) {
+    OutputFlush(o);
+    free(o);
+}
+
+void OutputSetColored(Output o, bool colored) {
+    o->colored = colored;
+}
+
+bool OutputColored(Output o) {
+    return o->colored;
+}
+
+void OutputWrite(Output o, const char *buf, size_t len) {
+    if (len <= OUTPUT_BUFFER - o->len) {
+        memcpy(o->buf + o->len, buf, len);
+        o->len += len;
+        return;
+    }
+    OutputFlush(o);
+    if (len < OUTPUT_BUFFER) {
+        memcpy(o->buf, buf, len);
+        o->len = len;
+    } else {
+        o->write(o->arg, buf, len);
+    }
+}
+
+void OutputString(Output o, const char *str) {
+    OutputWrite(o, str, strlen(str));
+}
+
+void OutputPad(Output o, size_t n) {
+    while (n > 0) {
+        if (o->len == OUTPUT_BUFFER) {
+            OutputFlush(o);
+        }
+        size_t k = OUTPUT_BUFFER - o->len;
+        if (k > n) {
+            k = n;
+        }
+        memset(o->buf + o->len, ' ', k);
+        o->len += k;
+        n -= k;
+    }
+}
+
+void OutputPrintf(Output o, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t room = OUTPUT_BUFFER - o->len;
+    int n = vsnprintf(o->buf + o->len, room, format, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n < room) {
+        o->len += n;
+        return;
+    }
+    // didn't fit: format it again where it does
+    OutputFlush(o);
+    va_start(args, format);
+    if ((size_t)n < OUTPUT_BUFFER) {
+        o->len = vsnprintf(o->buf, OUTPUT_BUFFER, format, args);
+    } else {
+        char *text = malloc(n + 1);
+        vsnprintf(text, n + 1, format, args);
+        o->write(o->arg, text, n);
+        free(text);
+    }
+    va_end(args);
+}
+
+void OutputFlush(Output o) {
+    if (o->len > 0) {
+        o->write(o->arg, o->buf, o->len);
+        o->len = 0;
+    }
+}
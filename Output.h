@@ -0,0 +1,43 @@
+// Interface to the Output ADT, which collects printed text in a large
+// buffer and hands it on to a writer in blocks
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// bytes collected before they are handed on
+#define OUTPUT_BUFFER (64 * 1024)
+
+typedef struct OutputRep *Output;
+
+// receives the next len bytes of output; len is never 0
+typedef void (*OutputWriter)(void *arg, const char *buf, size_t len);
+
+Output OutputNew(OutputWriter write, void *arg);
+
+// hands on what is left, then frees o
+void OutputFree(Output o);
+
+// whether listFile colors names by file type
+void OutputSetColored(Output o, bool colored);
+
+bool OutputColored(Output o);
+
+// writes that don't fit in the buffer go to the writer as they are,
+// after what was collected before them
+void OutputWrite(Output o, const char *buf, size_t len);
+
+void OutputString(Output o, const char *str);
+
+// n spaces
+void OutputPad(Output o, size_t n);
+
+void OutputPrintf(Output o, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// hands everything collected so far to the writer
+void OutputFlush(Output o);
+
+#endif
@@ -0,0 +1,210 @@
+// Implementation of the Pattern ADT
+// Most globs people search with are a literal with a '*' at one end or
+// both, and those are matched by comparing bytes. Any other pattern first
+// has the longest literal that every match must contain looked for with
+// strstr, which libc vectorizes, and only names that have it go on to
+// fnmatch or regexec.
+
+#include <fnmatch.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Pattern.h"
+
+typedef enum {
+    MATCH_EXACT,
+    MATCH_PREFIX,   // literal*
+    MATCH_SUFFIX,   // *literal
+    MATCH_INFIX,    // *literal*, or * with an empty literal
+    MATCH_GLOB,
+    MATCH_REGEX,
+} MatchKind;
+
+struct PatternRep {
+    MatchKind kind;
+    char *glob;
+    regex_t re;
+    // all of the pattern for the first four kinds, a part every match
+    // contains for the others (maybe empty)
+    char *literal;
+    size_t literal_len;
+};
+
+// helper function declaration
+static bool glob_special(char c);
+static size_t skip_bracket(const char *pattern, size_t i);
+static char *glob_literal(const char *pattern);
+static char *regex_literal(const char *pattern);
+static void keep_longest(char **best, size_t *best_len, const char *run, size_t len);
+
+Pattern PatternNew(const char *pattern, bool regex) {
+    Pattern p = malloc(sizeof(struct PatternRep));
+    p->glob = NULL;
+    if (regex) {
+        if (regcomp(&p->re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+            free(p);
+            return NULL;
+        }
+        p->kind = MATCH_REGEX;
+        p->literal = regex_literal(pattern);
+    } else {
+        size_t len = strlen(pattern);
+        size_t start = (len > 0 && pattern[0] == '*') ? 1 : 0;
+        size_t end = (len > start && pattern[len - 1] == '*') ? len - 1 : len;
+        bool plain = true;
+        for (size_t i = start; i < end; i++) {
+            plain = plain && !glob_special(pattern[i]);
+        }
+        if (plain) {
+            p->kind = (start == 0) ? ((end == len) ? MATCH_EXACT : MATCH_PREFIX)
+                                   : ((end == len) ? MATCH_SUFFIX : MATCH_INFIX);
+            p->literal = strndup(pattern + start, end - start);
+        } else {
+            p->kind = MATCH_GLOB;
+            p->glob = strdup(pattern);
+            p->literal = glob_literal(pattern);
+        }
+    }
+    p->literal_len = strlen(p->literal);
+    return p;
+}
+
+void PatternFree(Pattern p) {
+    if (p->kind == MATCH_REGEX) {
+        regfree(&p->re);
+    }
+    free(p->glob);
+    free(p->literal);
+    free(p);
+}
+
+bool PatternMatch(Pattern p, const char *name, size_t len) {
+    size_t n = p->literal_len;
+    switch (p->kind) {
+        case MATCH_EXACT:
+            return len == n && memcmp(name, p->literal, n) == 0;
+        case MATCH_PREFIX:
+            return len >= n && memcmp(name, p->literal, n) == 0;
+        case MATCH_SUFFIX:
+            return len >= n && memcmp(name + len - n, p->literal, n) == 0;
+        case MATCH_INFIX:
+            return len >= n && strstr(name, p->literal) != NULL;
+        case MATCH_GLOB:
+            return len >= n && strstr(name, p->literal) != NULL &&
+                   fnmatch(p->glob, name, 0) == 0;
+        case MATCH_REGEX:
+            return len >= n && strstr(name, p->literal) != NULL &&
+                   regexec(&p->re, name, 0, NULL, 0) == 0;
+    }
+    return false;
+}
+
+char *PatternLiteral(const char *pattern, bool regex) {
+    return regex ? regex_literal(pattern) : glob_literal(pattern);
+}
+
+//        helper functions         //
+
+static bool glob_special(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+// the index of the ']' closing the bracket expression opened at i, or of
+// the terminating NUL if there is none
+static size_t skip_bracket(const char *pattern, size_t i) {
+    i++;
+    if (pattern[i] == '!' || pattern[i] == '^') {
+        i++;
+    }
+    if (pattern[i] == ']') {
+        i++;
+    }
+    while (pattern[i] != '\0' && pattern[i] != ']') {
+        i++;
+    }
+    return i;
+}
+
+// the longest run of characters the glob matches only as themselves
+static char *glob_literal(const char *pattern) {
+    char *best = NULL;
+    size_t best_len = 0;
+    size_t run = 0;
+    size_t i = 0;
+    for (; pattern[i] != '\0'; i++) {
+        if (!glob_special(pattern[i])) {
+            continue;
+        }
+        keep_longest(&best, &best_len, pattern + run, i - run);
+        if (pattern[i] == '[') {
+            i = skip_bracket(pattern, i);
+        } else if (pattern[i] == '\\' && pattern[i + 1] != '\0') {
+            i++;
+        }
+        if (pattern[i] == '\0') {
+            break;
+        }
+        run = i + 1;
+    }
+    if (pattern[i] == '\0' && run <= i) {
+        keep_longest(&best, &best_len, pattern + run, i - run);
+    }
+    return (best != NULL) ? best : strdup("");
+}
+
+// the longest run of characters every match of the regular expression
+// contains: outside groups, brackets and escapes, without a character
+// that a following ?, * or {} makes optional. Alternation could make any
+// of them optional, so then there is none.
+static char *regex_literal(const char *pattern) {
+    if (strchr(pattern, '|') != NULL) {
+        return strdup("");
+    }
+    char *best = NULL;
+    size_t best_len = 0;
+    size_t run = 0;
+    int depth = 0;
+    size_t i = 0;
+    for (; pattern[i] != '\0'; i++) {
+        char c = pattern[i];
+        bool literal = depth == 0 && strchr("\\[]().^$*+?{}", c) == NULL;
+        if (literal) {
+            continue;
+        }
+        size_t end = i;
+        if ((c == '*' || c == '?' || c == '{') && end > run) {
+            end--;
+        }
+        keep_longest(&best, &best_len, pattern + run, end - run);
+        if (c == '(') {
+            depth++;
+        } else if (c == ')' && depth > 0) {
+            depth--;
+        } else if (c == '[') {
+            i = skip_bracket(pattern, i);
+        } else if (c == '{') {
+            while (pattern[i] != '\0' && pattern[i] != '}') {
+                i++;
+            }
+        } else if (c == '\\' && pattern[i + 1] != '\0') {
+            i++;
+        }
+        if (pattern[i] == '\0') {
+            break;
+        }
+        run = i + 1;
+    }
+    if (pattern[i] == '\0' && depth == 0 && run <= i) {
+        keep_longest(&best, &best_len, pattern + run, i - run);
+    }
+    return (best != NULL) ? best : strdup("");
+}
+
+static void keep_longest(char **best, size_t *best_len, const char *run, size_t len) {
+    if (*best == NULL || len > *best_len) {
+        free(*best);
+        *best = strndup(run, len);
+        *best_len = len;
+    }
+}
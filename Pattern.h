@@ -0,0 +1,27 @@
+// Interface to the Pattern ADT, a shell glob or POSIX extended regular
+// expression compiled once for matching many names
+
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct PatternRep *Pattern;
+
+// a glob as fnmatch(3) takes it, or a regular expression if regex is true,
+// which matches anywhere in the name unless anchored; NULL if it doesn't
+// compile
+Pattern PatternNew(const char *pattern, bool regex);
+
+void PatternFree(Pattern p);
+
+// whether the len-character name matches; name is NUL-terminated too.
+// Safe to call from several threads at once.
+bool PatternMatch(Pattern p, const char *name, size_t len);
+
+// the longest run of characters every match of the pattern contains,
+// which may be empty; the caller frees it
+char *PatternLiteral(const char *pattern, bool regex);
+
+#endif
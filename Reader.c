@@ -0,0 +1,231 @@
+// Implementation of the Reader ADT
+// The rings of an io_uring are mapped and driven with the raw system
+// calls, so nothing outside the kernel headers is needed. Reads are
+// queued while the submission ring has room, submitted together with one
+// call that also waits for the first to finish, and a read the kernel
+// cuts short is queued again for the rest. A kernel without io_uring, or
+// without its plain read operation, gets a loop of pread calls instead.
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Reader.h"
+
+#define MAX_READ (1u << 30)     // bytes one read asks for at most
+
+struct ReaderRep {
+    int fd;                     // the io_uring's, -1 if there is none
+    unsigned entries;
+    // the submission ring, which only this side moves the tail of
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    // the completion ring, which only this side moves the head of
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_size;
+    void *cq_map;               // sq_map if the kernel maps both at once
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+// helper function declaration
+static bool uring_setup(Reader r, unsigned depth);
+static void uring_read(Reader r, int n, int fds[], char *bufs[], size_t lens[], ssize_t got[]);
+static ssize_t read_all(int fd, char *buf, size_t len, size_t done);
+
+Reader ReaderNew(unsigned depth) {
+    Reader r = calloc(1, sizeof(struct ReaderRep));
+    r->fd = -1;
+    if (!uring_setup(r, (depth > 0) ? depth : 1)) {
+        r->fd = -1;
+    }
+    return r;
+}
+
+bool ReaderUring(Reader r) {
+    return r->fd >= 0;
+}
+
+void ReaderRead(Reader r, int n, int fds[], char *bufs[], size_t lens[], ssize_t got[]) {
+    if (r->fd >= 0) {
+        uring_read(r, n, fds, bufs, lens, got);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        got[i] = read_all(fds[i], bufs[i], lens[i], 0);
+    }
+}
+
+void ReaderFree(Reader r) {
+    if (r->fd >= 0) {
+        munmap(r->sqes, r->sqes_size);
+        if (r->cq_map != r->sq_map) {
+            munmap(r->cq_map, r->cq_size);
+        }
+        munmap(r->sq_map, r->sq_size);
+        close(r->fd);
+    }
+    free(r);
+}
+
+//        helper functions         //
+
+// make an io_uring of depth entries and map its rings; false if the
+// kernel has none or won't make one
+static bool uring_setup(Reader r, unsigned depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0) {
+        return false;
+    }
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && r->cq_size > r->sq_size) {
+        r->sq_size = r->cq_size;
+    }
+    r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    r->cq_map = r->sq_map;
+    if (!single) {
+        r->cq_map = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) {
+            munmap(r->sq_map, r->sq_size);
+            close(fd);
+            return false;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (!single) {
+            munmap(r->cq_map, r->cq_size);
+        }
+        munmap(r->sq_map, r->sq_size);
+        close(fd);
+        return false;
+    }
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    r->fd = fd;
+    return true;
+}
+
+// ReaderRead through the ring. The completion ring is twice the size of
+// the submission ring, so with at most entries reads under way it never
+// overflows.
+static void uring_read(Reader r, int n, int fds[], char *bufs[], size_t lens[], ssize_t got[]) {
+    size_t *done = calloc(n + 1, sizeof(size_t));
+    int *again = malloc(r->entries * sizeof(int));     // cut short, to go on with
+    int nagain = 0;
+    int next = 0;
+    unsigned flight = 0;        // queued, submitted or not, and not completed
+    unsigned unsubmitted = 0;
+    while (next < n || nagain > 0 || flight > 0) {
+        unsigned tail = *r->sq_tail;
+        while (flight < r->entries && (nagain > 0 || next < n)) {
+            int i = (nagain > 0) ? again[--nagain] : next++;
+            if (lens[i] == done[i]) {
+                got[i] = done[i];
+                continue;
+            }
+            size_t len = lens[i] - done[i];
+            unsigned slot = tail & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fds[i];
+            sqe->addr = (uintptr_t)(bufs[i] + done[i]);
+            sqe->len = (len < MAX_READ) ? len : MAX_READ;
+            sqe->off = done[i];
+            sqe->user_data = i;
+            r->sq_array[slot] = slot;
+            tail++;
+            flight++;
+            unsubmitted++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        if (flight == 0) {
+            break;
+        }
+        int k = syscall(__NR_io_uring_enter, r->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (k >= 0) {
+            unsubmitted -= k;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            break;
+        }
+        unsigned head = *r->cq_head;
+        unsigned end = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != end; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int i = cqe->user_data;
+            int res = cqe->res;
+            flight--;
+            if (res > 0) {
+                done[i] += res;
+                again[nagain++] = i;
+            } else if (res == 0) {
+                got[i] = done[i];
+            } else if (res == -EINTR || res == -EAGAIN) {
+                again[nagain++] = i;
+            } else if (res == -EINVAL || res == -EOPNOTSUPP) {
+                // a kernel without IORING_OP_READ
+                got[i] = read_all(fds[i], bufs[i], lens[i], done[i]);
+            } else {
+                got[i] = -1;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    // only if the ring failed: the reads not done count as failed
+    for (int i = next; i < n; i++) {
+        got[i] = -1;
+    }
+    while (nagain > 0) {
+        got[again[--nagain]] = -1;
+    }
+    free(again);
+    free(done);
+}
+
+// the rest of a read from done on, with pread
+static ssize_t read_all(int fd, char *buf, size_t len, size_t done) {
+    while (done < len) {
+        ssize_t k = pread(fd, buf + done, len - done, done);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        } else if (k < 0) {
+            return -1;
+        } else if (k == 0) {
+            break;
+        }
+        done += k;
+    }
+    return done;
+}
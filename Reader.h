@@ -0,0 +1,27 @@
+// Interface to the Reader ADT, which reads whole host files many at a
+// time: through io_uring where the kernel has it, so the reads of a batch
+// are all under way at once, and with pread otherwise
+
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct ReaderRep *Reader;
+
+// a reader with up to depth reads under way at once. One thread uses a
+// reader at a time.
+Reader ReaderNew(unsigned depth);
+
+// whether the reader has an io_uring
+bool ReaderUring(Reader r);
+
+// reads each of the n files fds[i] from its start into bufs[i], up to
+// lens[i] bytes, in one large read unless the kernel splits it. got[i] is
+// how many were read, fewer only at the end of the file, or -1 on error.
+void ReaderRead(Reader r, int n, int fds[], char *bufs[], size_t lens[], ssize_t got[]);
+
+void ReaderFree(Reader r);
+
+#endif
@@ -0,0 +1,248 @@
+// Implementation of the Scan ADT
+// The literal every match contains is looked for a chunk at a time,
+// sixteen places per step: its first and last bytes are compared at all
+// of them at once, and the rest only where both agree. A regular
+// expression then only runs on the lines where the literal is. Newlines
+// are counted sixteen bytes per step as well, and only as far as the
+// last line with a match. The lines regexec runs on are copied to end
+// them with a '\0', and where REG_STARTEND is known, one in the line
+// doesn't end it early.
+
+#include <regex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Pattern.h"
+#include "Scan.h"
+
+#ifdef REG_STARTEND
+#define LINE_FLAGS REG_STARTEND
+#else
+#define LINE_FLAGS 0
+#endif
+
+struct ScanRep {
+    bool regex;
+    regex_t re;
+    char *literal;      // the pattern, or a part every match of it contains
+    size_t literal_len;
+};
+
+// how far ScanContent has got in a content
+struct ScanCursor {
+    Content c;
+    size_t size;
+    size_t counted;     // the newlines before this offset are counted
+    size_t lines;       // there are this many
+    size_t line_start;  // just after the last of them, 0 if none
+    char *buf;          // bytes across a chunk boundary, or a line for regexec
+    size_t cap;
+};
+
+// helper function declaration
+static size_t next_literal(Scan s, struct ScanCursor *cur, size_t from);
+static const char *find_literal(Scan s, const char *text, size_t n);
+static void count_to(struct ScanCursor *cur, size_t to);
+static size_t count_newlines(const char *text, size_t n);
+static size_t line_end(struct ScanCursor *cur, size_t at);
+static const char *bytes_at(struct ScanCursor *cur, size_t offset, size_t len, bool copy);
+
+Scan ScanNew(const char *pattern, bool regex) {
+    Scan s = malloc(sizeof(struct ScanRep));
+    s->regex = regex;
+    if (regex) {
+        if (regcomp(&s->re, pattern, REG_EXTENDED) != 0) {
+            free(s);
+            return NULL;
+        }
+        s->literal = PatternLiteral(pattern, true);
+    } else {
+        s->literal = strdup(pattern);
+    }
+    s->literal_len = strlen(s->literal);
+    return s;
+}
+
+void ScanFree(Scan s) {
+    if (s->regex) {
+        regfree(&s->re);
+    }
+    free(s->literal);
+    free(s);
+}
+
+bool ScanContent(Scan s, Content c, ScanFn found, void *arg) {
+    struct ScanCursor cur = {.c = c, .size = ContentSize(c)};
+    bool finished = true;
+    size_t pos = 0;     // the start of the first line not looked at
+    while (pos < cur.size) {
+        size_t at = (s->literal_len > 0) ? next_literal(s, &cur, pos) : pos;
+        if (at == SIZE_MAX) {
+            break;
+        }
+        count_to(&cur, at);
+        size_t start = cur.line_start;
+        size_t end = line_end(&cur, at);
+        size_t match = at;
+        if (s->regex) {
+            regmatch_t m = {.rm_so = 0, .rm_eo = end - start};
+            const char *text = bytes_at(&cur, start, end - start, true);
+            match = (regexec(&s->re, text, 1, &m, LINE_FLAGS) == 0) ? start + m.rm_so : SIZE_MAX;
+        }
+        if (match != SIZE_MAX && !found(arg, match, cur.lines + 1)) {
+            finished = false;
+            break;
+        }
+        pos = end + 1;
+    }
+    free(cur.buf);
+    return finished;
+}
+
+//        helper functions         //
+
+// the offset of the first occurrence of the literal at or after from,
+// SIZE_MAX if there is none
+static size_t next_literal(Scan s, struct ScanCursor *cur, size_t from) {
+    size_t m = s->literal_len;
+    size_t off = from;
+    while (off < cur->size) {
+        size_t n;
+        const char *text = ContentSpan(cur->c, off, &n);
+        const char *hit = find_literal(s, text, n);
+        if (hit != NULL) {
+            return off + (hit - text);
+        }
+        size_t end = off + n;
+        if (m > 1 && end < cur->size) {
+            // one starting in the last m - 1 bytes runs into the next chunk
+            size_t back = (n < m - 1) ? n : m - 1;
+            size_t len = back + m - 1;
+            if (len > cur->size - (end - back)) {
+                len = cur->size - (end - back);
+            }
+            const char *window = bytes_at(cur, end - back, len, false);
+            hit = find_literal(s, window, len);
+            if (hit != NULL) {
+                return end - back + (hit - window);
+            }
+        }
+        off = end;
+    }
+    return SIZE_MAX;
+}
+
+// the first occurrence of the literal in the n bytes at text, or NULL
+static const char *find_literal(Scan s, const char *text, size_t n) {
+    const char *lit = s->literal;
+    size_t m = s->literal_len;
+    if (m == 1) {
+        return memchr(text, lit[0], n);
+    } else if (n < m) {
+        return NULL;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(lit[0]);
+    __m128i last = _mm_set1_epi8(lit[m - 1]);
+    for (; i + 16 + m - 1 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(text + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(text + at + 1, lit + 1, m - 2) == 0) {
+                return text + at;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    // the last few places, or all of them without SSE2
+    while (i + m <= n) {
+        const char *p = memchr(text + i, lit[0], n - m + 1 - i);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (p[m - 1] == lit[m - 1] && memcmp(p + 1, lit + 1, m - 2) == 0) {
+            return p;
+        }
+        i = p - text + 1;
+    }
+    return NULL;
+}
+
+// count the newlines before offset to
+static void count_to(struct ScanCursor *cur, size_t to) {
+    while (cur->counted < to) {
+        size_t n;
+        const char *text = ContentSpan(cur->c, cur->counted, &n);
+        if (n > to - cur->counted) {
+            n = to - cur->counted;
+        }
+        size_t k = count_newlines(text, n);
+        if (k > 0) {
+            size_t last = n - 1;
+            while (text[last] != '\n') {
+                last--;
+            }
+            cur->lines += k;
+            cur->line_start = cur->counted + last + 1;
+        }
+        cur->counted += n;
+    }
+}
+
+static size_t count_newlines(const char *text, size_t n) {
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(text + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, newline)));
+    }
+#endif
+    for (; i < n; i++) {
+        count += text[i] == '\n';
+    }
+    return count;
+}
+
+// the offset of the newline that ends the line holding at, or the size
+static size_t line_end(struct ScanCursor *cur, size_t at) {
+    size_t off = at;
+    while (off < cur->size) {
+        size_t n;
+        const char *text = ContentSpan(cur->c, off, &n);
+        const char *newline = memchr(text, '\n', n);
+        if (newline != NULL) {
+            return off + (newline - text);
+        }
+        off += n;
+    }
+    return cur->size;
+}
+
+// the len bytes at offset in one piece: where they are if one chunk holds
+// them, unless they have to be copied, and copied into cur's buffer with
+// a '\0' after them otherwise
+static const char *bytes_at(struct ScanCursor *cur, size_t offset, size_t len, bool copy) {
+    size_t n;
+    const char *text = ContentSpan(cur->c, offset, &n);
+    if (n >= len && !copy) {
+        return text;
+    }
+    if (len + 1 > cur->cap) {
+        cur->cap = len + 1;
+        cur->buf = realloc(cur->buf, cur->cap);
+    }
+    ContentRead(cur->c, offset, cur->buf, len);
+    cur->buf[len] = '\0';
+    return cur->buf;
+}
@@ -0,0 +1,29 @@
+// Interface to the Scan ADT, a literal or POSIX extended regular
+// expression compiled once for finding the lines of contents it matches
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Content.h"
+
+typedef struct ScanRep *Scan;
+
+// receives a line with a match: the offset of its first match and the
+// line's number, counting from 1; returns false to stop the scan
+typedef bool (*ScanFn)(void *arg, size_t offset, size_t line);
+
+// NULL if the regular expression doesn't compile. An empty literal
+// matches every line at its start.
+Scan ScanNew(const char *pattern, bool regex);
+
+void ScanFree(Scan s);
+
+// calls found for each line of c with a match, in order, reading the
+// chunks where they are; returns whether found let it finish. Safe to
+// call from several threads at once.
+bool ScanContent(Scan s, Content c, ScanFn found, void *arg);
+
+#endif
@@ -0,0 +1,154 @@
+// Implementation of the Spill ADT
+// The whole file is mapped once, read-only and far larger than it will
+// grow, so places in it never move; it is only ever written with pwrite.
+// Space is handed out in extents of a power of two pages. A released
+// extent goes on the free list of its size and is reused before the file
+// grows, so the file is at most twice what it holds.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Spill.h"
+
+#define SPILL_MAX (1ull << 40)  // address space the mapping takes
+#define PAGE 4096
+#define CLASSES 28              // extents of 1 page to 512 GiB
+
+struct SpillRep {
+    pthread_mutex_t lock;
+    int fd;
+    char *map;
+    size_t end;                 // the file's size
+    uint8_t *classes;           // of each extent handed out, by first page
+    size_t classes_cap;
+    size_t *free[CLASSES];      // offsets of released extents of each size
+    size_t nfree[CLASSES];
+    size_t free_cap[CLASSES];
+};
+
+// helper function declaration
+static int size_class(size_t size);
+static size_t spill_alloc(Spill s, int class);
+static bool spill_copy(Spill s, Content c, size_t off);
+
+Spill SpillNew(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    unlink(path);
+    char *map = mmap(NULL, SPILL_MAX, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    Spill s = calloc(1, sizeof(struct SpillRep));
+    pthread_mutex_init(&s->lock, NULL);
+    s->fd = fd;
+    s->map = map;
+    return s;
+}
+
+const char *SpillWrite(Spill s, Content c) {
+    size_t size = ContentSize(c);
+    int class = size_class(size);
+    if (class < 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&s->lock);
+    size_t off = spill_alloc(s, class);
+    pthread_mutex_unlock(&s->lock);
+    if (off == SIZE_MAX) {
+        return NULL;
+    }
+    if (!spill_copy(s, c, off)) {
+        SpillRelease(s, s->map + off);
+        return NULL;
+    }
+    return s->map + off;
+}
+
+void SpillRelease(Spill s, const char *data) {
+    size_t off = data - s->map;
+    pthread_mutex_lock(&s->lock);
+    int class = s->classes[off / PAGE];
+    if (s->nfree[class] == s->free_cap[class]) {
+        s->free_cap[class] = (s->free_cap[class] == 0) ? 16 : s->free_cap[class] * 2;
+        s->free[class] = realloc(s->free[class], s->free_cap[class] * sizeof(size_t));
+    }
+    s->free[class][s->nfree[class]++] = off;
+    pthread_mutex_unlock(&s->lock);
+    // the pages cached for it are of no more use
+    posix_fadvise(s->fd, off, (size_t)PAGE << class, POSIX_FADV_DONTNEED);
+}
+
+size_t SpillBytes(Spill s) {
+    pthread_mutex_lock(&s->lock);
+    size_t end = s->end;
+    pthread_mutex_unlock(&s->lock);
+    return end;
+}
+
+void SpillFree(Spill s) {
+    munmap(s->map, SPILL_MAX);
+    close(s->fd);
+    for (int i = 0; i < CLASSES; i++) {
+        free(s->free[i]);
+    }
+    free(s->classes);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+//        helper functions         //
+
+// the class of the smallest extent that holds size bytes, -1 if none does
+static int size_class(size_t size) {
+    size_t pages = (size + PAGE - 1) / PAGE;
+    int class = 0;
+    while (((size_t)1 << class) < pages) {
+        class++;
+    }
+    return (class < CLASSES) ? class : -1;
+}
+
+// the offset of a free extent of the class, SIZE_MAX if the file is full
+static size_t spill_alloc(Spill s, int class) {
+    if (s->nfree[class] > 0) {
+        return s->free[class][--s->nfree[class]];
+    }
+    size_t len = (size_t)PAGE << class;
+    if (s->end + len > SPILL_MAX) {
+        return SIZE_MAX;
+    }
+    size_t off = s->end;
+    s->end += len;
+    size_t pages = s->end / PAGE;
+    if (pages > s->classes_cap) {
+        s->classes_cap = (pages > 2 * s->classes_cap) ? pages : 2 * s->classes_cap;
+        s->classes = realloc(s->classes, s->classes_cap);
+    }
+    s->classes[off / PAGE] = class;
+    return off;
+}
+
+// write the bytes of c at off, a chunk at a time from where they are
+static bool spill_copy(Spill s, Content c, size_t off) {
+    size_t size = ContentSize(c);
+    size_t done = 0;
+    while (done < size) {
+        size_t n;
+        const char *data = ContentSpan(c, done, &n);
+        ssize_t k = pwrite(s->fd, data, n, off + done);
+        if (k <= 0) {
+            return false;
+        }
+        done += k;
+    }
+    return true;
+}
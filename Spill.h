@@ -0,0 +1,32 @@
+// Interface to the Spill ADT, a local file that contents are moved out to
+// and read back from through one shared mapping of it, so the kernel
+// brings their pages in as they are read and can drop them again
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Content.h"
+
+typedef struct SpillRep *Spill;
+
+// a spill file at path, created or emptied. It is unlinked at once, so it
+// goes away with the process. NULL if it can't be made.
+Spill SpillNew(const char *path);
+
+// writes the bytes of c to the file and returns where they are mapped,
+// NULL if the file can't take them. Several threads may use a spill at
+// once.
+const char *SpillWrite(Spill s, Content c);
+
+// gives back the space of bytes returned by SpillWrite
+void SpillRelease(Spill s, const char *data);
+
+// the file's size, with the space given back in it
+size_t SpillBytes(Spill s);
+
+void SpillFree(Spill s);
+
+#endif
@@ -0,0 +1,205 @@
+// Implementation of the Store ADT
+// Blocks are found through a chained hash table on a 64-bit hash of their
+// bytes, and the bytes are compared as well, so two blocks with the same
+// hash are never taken for each other. Data is cut where a gear hash of
+// the bytes before a position has its top bits clear: more of them have
+// to be clear before the average block size is reached and fewer after
+// it, which keeps most blocks near that size.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Store.h"
+
+#define MIN_BLOCK (2 * 1024)
+#define AVG_BLOCK (8 * 1024)
+#define MAX_BLOCK (64 * 1024)
+#define HARD_BITS 15        // clear top bits for a cut before AVG_BLOCK
+#define EASY_BITS 11        // and from there on
+
+struct BlockRep {
+    struct BlockRep *next;  // in its bucket
+    uint64_t hash;
+    size_t refs;
+    size_t len;
+    char data[];
+};
+
+struct StoreRep {
+    pthread_mutex_t lock;
+    Block *buckets;
+    size_t nbuckets;        // a power of two
+    struct StoreStats stats;
+};
+
+// the gear hash adds one of these for every byte
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// helper function declaration
+static void gear_init(void);
+static uint64_t mix(uint64_t x);
+static uint64_t block_hash(const char *data, size_t len);
+static void store_grow(Store s);
+
+Store StoreNew(void) {
+    pthread_once(&gear_once, gear_init);
+    Store s = malloc(sizeof(struct StoreRep));
+    pthread_mutex_init(&s->lock, NULL);
+    s->nbuckets = 1024;
+    s->buckets = calloc(s->nbuckets, sizeof(Block));
+    memset(&s->stats, 0, sizeof(s->stats));
+    return s;
+}
+
+size_t StoreCut(const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    if (len <= MIN_BLOCK) {
+        return len;
+    }
+    size_t end = (len < MAX_BLOCK) ? len : MAX_BLOCK;
+    size_t avg = (end < AVG_BLOCK) ? end : AVG_BLOCK;
+    uint64_t fp = 0;
+    size_t i = MIN_BLOCK - 64;  // only the last 64 bytes count
+    for (; i < MIN_BLOCK; i++) {
+        fp = (fp << 1) + gear[p[i]];
+    }
+    for (; i < avg; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if (fp >> (64 - HARD_BITS) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        fp = (fp << 1) + gear[p[i]];
+        if (fp >> (64 - EASY_BITS) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+Block StorePut(Store s, const char *data, size_t len) {
+    uint64_t hash = block_hash(data, len);
+    pthread_mutex_lock(&s->lock);
+    Block *bucket = &s->buckets[hash & (s->nbuckets - 1)];
+    Block b = *bucket;
+    while (b != NULL && (b->hash != hash || b->len != len || memcmp(b->data, data, len) != 0)) {
+        b = b->next;
+    }
+    if (b == NULL) {
+        b = malloc(sizeof(struct BlockRep) + len);
+        b->hash = hash;
+        b->refs = 0;
+        b->len = len;
+        memcpy(b->data, data, len);
+        b->next = *bucket;
+        *bucket = b;
+        s->stats.blocks++;
+        s->stats.bytes += len;
+        if (s->stats.blocks > s->nbuckets) {
+            store_grow(s);
+        }
+    }
+    b->refs++;
+    s->stats.referenced += len;
+    pthread_mutex_unlock(&s->lock);
+    return b;
+}
+
+void StoreRelease(Store s, Block b) {
+    pthread_mutex_lock(&s->lock);
+    s->stats.referenced -= b->len;
+    if (--b->refs > 0) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    Block *link = &s->buckets[b->hash & (s->nbuckets - 1)];
+    while (*link != b) {
+        link = &(*link)->next;
+    }
+    *link = b->next;
+    s->stats.blocks--;
+    s->stats.bytes -= b->len;
+    pthread_mutex_unlock(&s->lock);
+    free(b);
+}
+
+const char *BlockData(Block b) {
+    return b->data;
+}
+
+size_t BlockSize(Block b) {
+    return b->len;
+}
+
+void StoreGetStats(Store s, struct StoreStats *stats) {
+    pthread_mutex_lock(&s->lock);
+    *stats = s->stats;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void StoreFree(Store s) {
+    for (size_t i = 0; i < s->nbuckets; i++) {
+        Block b = s->buckets[i];
+        while (b != NULL) {
+            Block next = b->next;
+            free(b);
+            b = next;
+        }
+    }
+    free(s->buckets);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+//        helper functions         //
+
+static void gear_init(void) {
+    for (int i = 0; i < 256; i++) {
+        gear[i] = mix(i + 1);
+    }
+}
+
+// splitmix64's finalizer
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// eight bytes at a time; a collision only costs a comparison
+static uint64_t block_hash(const char *data, size_t len) {
+    uint64_t h = len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15;
+        h ^= h >> 29;
+    }
+    uint64_t w = 0;
+    memcpy(&w, data + i, len - i);
+    return mix(h ^ w);
+}
+
+// double the buckets, keeping the chains in no particular order
+static void store_grow(Store s) {
+    size_t n = s->nbuckets * 2;
+    Block *buckets = calloc(n, sizeof(Block));
+    for (size_t i = 0; i < s->nbuckets; i++) {
+        Block b = s->buckets[i];
+        while (b != NULL) {
+            Block next = b->next;
+            b->next = buckets[b->hash & (n - 1)];
+            buckets[b->hash & (n - 1)] = b;
+            b = next;
+        }
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->nbuckets = n;
+}
@@ -0,0 +1,45 @@
+// Interface to the Store ADT, a set of blocks of bytes addressed by what
+// they hold: storing bytes the store already has only counts one more
+// reference to the block that holds them
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+
+typedef struct StoreRep *Store;
+
+typedef struct BlockRep *Block;
+
+struct StoreStats {
+    size_t blocks;
+    size_t bytes;       // held by those blocks
+    size_t referenced;  // of every reference to them, so bytes / referenced
+                        // is what deduplication left of the data
+};
+
+Store StoreNew(void);
+
+// where the first block the len bytes at data are cut into ends, between
+// 2 and 64 KiB (8 KiB on average) unless len is smaller. A cut depends on
+// the 64 bytes before it and its distance from the start, so data shifted
+// by an insertion is cut as it was again within a block or two.
+size_t StoreCut(const char *data, size_t len);
+
+// the block holding the len bytes at data, made if the store has none,
+// with one more reference to it. Several threads may use a store at once.
+Block StorePut(Store s, const char *data, size_t len);
+
+// drops a reference to b, freeing b with the last one
+void StoreRelease(Store s, Block b);
+
+const char *BlockData(Block b);
+
+size_t BlockSize(Block b);
+
+void StoreGetStats(Store s, struct StoreStats *stats);
+
+// frees the store and every block still in it
+void StoreFree(Store s);
+
+#endif
@@ -0,0 +1,62 @@
+// Implementation of the timing helpers
+// A latency goes into one of 16 buckets between consecutive powers of
+// two, so the histogram is a fixed array however long a run is, and a
+// percentile read off it is within 1/16 of the true one.
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "Timing.h"
+
+uint64_t TimingNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void TimingRecord(struct Timing *tm, uint64_t ns) {
+    tm->count++;
+    tm->total += ns;
+    if (ns > tm->max) {
+        tm->max = ns;
+    }
+    int bucket;
+    if (ns < TIMING_SUB_BUCKETS) {
+        bucket = ns;
+    } else {
+        int e = 63 - __builtin_clzll(ns);
+        bucket = (e - 3) * TIMING_SUB_BUCKETS + ((ns >> (e - 4)) & (TIMING_SUB_BUCKETS - 1));
+    }
+    tm->buckets[bucket]++;
+}
+
+uint64_t TimingPercentile(struct Timing *tm, double p) {
+    uint64_t want = (uint64_t)(p * tm->count);
+    uint64_t seen = 0;
+    for (int b = 0; b < TIMING_BUCKETS; b++) {
+        seen += tm->buckets[b];
+        if (seen > want) {
+            if (b < TIMING_SUB_BUCKETS) {
+                return b;
+            }
+            int e = b / TIMING_SUB_BUCKETS + 3;
+            return (uint64_t)(TIMING_SUB_BUCKETS + b % TIMING_SUB_BUCKETS) << (e - 4);
+        }
+    }
+    return 0;
+}
+
+void TimingReport(struct Timing *tm, uint64_t wall) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double secs = wall * 1e-9;
+    printf("%s\t%lu\t%.0f\t%lu\t%lu\t%lu\t%lu\t%ld\n", tm->op, (unsigned long)tm->count,
+           (secs > 0) ? tm->count / secs : 0.0,
+           (unsigned long)((tm->count > 0) ? tm->total / tm->count : 0),
+           (unsigned long)TimingPercentile(tm, 0.50), (unsigned long)TimingPercentile(tm, 0.99),
+           (unsigned long)tm->max, usage.ru_maxrss);
+}
+
+void TimingDiscard(void *arg, const char *buf, size_t len) {
+}
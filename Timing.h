@@ -0,0 +1,43 @@
+// Interface to the timing helpers the benchmark drivers share: a latency
+// histogram of the calls to one operation, the clock that feeds it and
+// the tab-separated line it is reported as
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// latencies are counted in buckets of 1/16 of a power of two
+#define TIMING_SUB_BUCKETS 16
+#define TIMING_BUCKETS (64 * TIMING_SUB_BUCKETS)
+
+// the columns of a TimingReport line, for a header
+#define TIMING_COLUMNS "op\tcount\tops_per_sec\tmean_ns\tp50_ns\tp99_ns\tmax_ns\tpeak_rss_kb"
+
+struct Timing {
+    char *op;
+    uint64_t count;
+    uint64_t total;         // nanoseconds
+    uint64_t max;
+    uint64_t buckets[TIMING_BUCKETS];
+};
+
+// nanoseconds on the monotonic clock
+uint64_t TimingNow(void);
+
+// counts a call that took ns nanoseconds
+void TimingRecord(struct Timing *tm, uint64_t ns);
+
+// the lowest latency of the bucket holding the p-th fraction of the calls
+uint64_t TimingPercentile(struct Timing *tm, double p);
+
+// prints tm to stdout as one line of TIMING_COLUMNS: ops/sec over wall
+// nanoseconds, and the peak RSS of the process in KiB
+void TimingReport(struct Timing *tm, uint64_t wall);
+
+// a writer for FsSetOutput that throws away what a timed file system
+// prints
+void TimingDiscard(void *arg, const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,308 @@
+// Benchmark driver for the File System ADT: builds a synthetic tree of a
+// given shape and size, then times mkdir, mkfile, cd, ls, tree, put, cat,
+// cp and dl on it. Every shape runs in a process of its own, so its
+// peak RSS is its own.
+//
+//     ./bench [-s wide|deep|balanced|all] [-n nodes] [-o ops] [-r seed]
+//
+// The shapes, with "nodes" entries under /bench:
+//     wide      all of them in /bench, one in ten a directory
+//     deep      chains of DEEP_CHAIN directories, each ending in a file
+//     balanced  every directory holding BALANCED_FANOUT entries, files
+//               at the bottom
+// cd, ls, put, cat, cp and dl are timed on "ops" entries picked by
+// the seed (default 1), so runs with the same arguments do the same work.
+//
+// One tab-separated line per operation goes to stdout, after a header:
+// ops/sec over the time spent in the operation, its mean, 50th and 99th
+// percentile (to within 1/16) and largest latency in nanoseconds, and the
+// peak RSS of the process once it is done, in KiB.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Fs.h"
+#include "Timing.h"
+
+#define DEEP_CHAIN 256
+#define BALANCED_FANOUT 16
+
+typedef enum {
+    WIDE,
+    DEEP,
+    BALANCED,
+} Shape;
+
+static char *shape_names[] = {"wide", "deep", "balanced"};
+
+// the synthetic tree: node 0 is /bench, every other node comes after
+// its parent
+struct Tree {
+    Shape shape;
+    uint32_t n;
+    uint32_t *parent;
+    bool *is_dir;
+    // path of the node built last, reused by its siblings and children
+    uint32_t last;
+    char path[PATH_MAX + 1];
+    size_t len;
+    size_t parent_len;      // where last's own name starts in path
+};
+
+// helper function declaration
+static void run_shape(Shape shape, uint32_t n, uint32_t ops, uint32_t seed);
+static void make_tree(struct Tree *t, Shape shape, uint32_t n);
+static char *path_of(struct Tree *t, uint32_t i);
+static size_t append_name(char *buf, size_t len, uint32_t i);
+static bool next_sample(struct Tree *t, bool dir, uint32_t seed, uint64_t *k, uint32_t *i);
+static void report(struct Tree *t, struct Timing *tm);
+
+int main(int argc, char *argv[]) {
+    int first = WIDE;
+    int last = BALANCED;
+    uint32_t n = 100000;
+    uint32_t ops = 100000;
+    uint32_t seed = 1;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-s") == 0) {
+            for (int s = WIDE; s <= BALANCED; s++) {
+                if (strcmp(argv[i + 1], shape_names[s]) == 0) {
+                    first = last = s;
+                }
+            }
+        } else if (strcmp(argv[i], "-n") == 0) {
+            n = strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "-o") == 0) {
+            ops = strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            seed = strtoul(argv[i + 1], NULL, 10);
+        }
+    }
+    if (n < 2) {
+        n = 2;
+    }
+    printf("shape\tnodes\t" TIMING_COLUMNS "\n");
+    fflush(stdout);
+    for (int s = first; s <= last; s++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_shape(s, n, ops, seed);
+            fflush(stdout);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "bench: %s failed\n", shape_names[s]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void run_shape(Shape shape, uint32_t n, uint32_t ops, uint32_t seed) {
+    struct Tree t;
+    make_tree(&t, shape, n);
+    Fs fs = FsNew();
+    FsSetOutput(fs, TimingDiscard, NULL, false);
+    struct Timing *tm = malloc(sizeof(struct Timing));
+    uint64_t start;
+
+    // mkdir and mkfile build the tree between them
+    struct Timing *files = malloc(sizeof(struct Timing));
+    *tm = (struct Timing){.op = "mkdir"};
+    *files = (struct Timing){.op = "mkfile"};
+    for (uint32_t i = 0; i < n; i++) {
+        char *path = path_of(&t, i);
+        start = TimingNow();
+        if (t.is_dir[i]) {
+            FsMkdir(fs, path);
+            TimingRecord(tm, TimingNow() - start);
+        } else {
+            FsMkfile(fs, path);
+            TimingRecord(files, TimingNow() - start);
+        }
+    }
+    report(&t, tm);
+    report(&t, files);
+    free(files);
+
+    uint64_t k;
+    uint32_t i;
+    *tm = (struct Timing){.op = "cd"};
+    for (k = 0; tm->count < ops && next_sample(&t, true, seed, &k, &i);) {
+        char *path = path_of(&t, i);
+        start = TimingNow();
+        FsCd(fs, path);
+        TimingRecord(tm, TimingNow() - start);
+        FsCd(fs, NULL);
+    }
+    report(&t, tm);
+
+    *tm = (struct Timing){.op = "ls"};
+    for (k = 0; tm->count < ops && next_sample(&t, true, seed, &k, &i);) {
+        char *path = path_of(&t, i);
+        start = TimingNow();
+        FsLs(fs, path);
+        TimingRecord(tm, TimingNow() - start);
+    }
+    report(&t, tm);
+
+    *tm = (struct Timing){.op = "put"};
+    for (k = 0; tm->count < ops && next_sample(&t, false, seed, &k, &i);) {
+        char *path = path_of(&t, i);
+        start = TimingNow();
+        FsPut(fs, path, "benchmark content\n");
+        TimingRecord(tm, TimingNow() - start);
+    }
+    report(&t, tm);
+
+    *tm = (struct Timing){.op = "cat"};
+    for (k = 0; tm->count < ops && next_sample(&t, false, seed, &k, &i);) {
+        char *path = path_of(&t, i);
+        start = TimingNow();
+        FsCat(fs, path);
+        TimingRecord(tm, TimingNow() - start);
+    }
+    report(&t, tm);
+
+    *tm = (struct Timing){.op = "tree"};
+    start = TimingNow();
+    FsTree(fs, "/bench");
+    TimingRecord(tm, TimingNow() - start);
+    report(&t, tm);
+
+    // cp a file next to each sampled one and dl it back out; mv isn't
+    // timed, as FsMv doesn't move anything yet
+    char *src[] = {NULL, NULL};
+    char dest[PATH_MAX + 2];
+    *tm = (struct Timing){.op = "cp"};
+    for (k = 0; tm->count < ops && next_sample(&t, false, seed, &k, &i);) {
+        src[0] = path_of(&t, i);
+        snprintf(dest, sizeof(dest), "%sc", src[0]);
+        start = TimingNow();
+        FsCp(fs, false, src, dest);
+        TimingRecord(tm, TimingNow() - start);
+    }
+    report(&t, tm);
+    uint64_t sampled = k;
+
+    *tm = (struct Timing){.op = "dl"};
+    for (k = 0; k < sampled && next_sample(&t, false, seed, &k, &i);) {
+        snprintf(dest, sizeof(dest), "%sc", path_of(&t, i));
+        start = TimingNow();
+        FsDl(fs, false, dest);
+        TimingRecord(tm, TimingNow() - start);
+    }
+    report(&t, tm);
+
+    src[0] = "/bench";
+    *tm = (struct Timing){.op = "cp-r"};
+    start = TimingNow();
+    FsCp(fs, true, src, "/copy");
+    TimingRecord(tm, TimingNow() - start);
+    report(&t, tm);
+
+    *tm = (struct Timing){.op = "dl-r"};
+    start = TimingNow();
+    FsDl(fs, true, "/bench");
+    FsDl(fs, true, "/copy");
+    TimingRecord(tm, TimingNow() - start);
+    report(&t, tm);
+
+    FsFree(fs);
+    free(tm);
+    free(t.parent);
+    free(t.is_dir);
+}
+
+static void make_tree(struct Tree *t, Shape shape, uint32_t n) {
+    t->shape = shape;
+    t->n = n;
+    t->parent = malloc(n * sizeof(uint32_t));
+    t->is_dir = malloc(n * sizeof(bool));
+    t->parent[0] = 0;
+    t->is_dir[0] = true;
+    for (uint32_t i = 1; i < n; i++) {
+        switch (shape) {
+            case WIDE:
+                t->parent[i] = 0;
+                t->is_dir[i] = (i % 10 == 0);
+                break;
+            case DEEP: {
+                uint32_t depth = (i - 1) % DEEP_CHAIN;
+                t->parent[i] = (depth == 0) ? 0 : i - 1;
+                t->is_dir[i] = depth + 1 < DEEP_CHAIN && i + 1 < n;
+                break;
+            }
+            case BALANCED:
+                t->parent[i] = (i - 1) / BALANCED_FANOUT;
+                t->is_dir[i] = (uint64_t)i * BALANCED_FANOUT + 1 < n;
+                break;
+        }
+    }
+    t->last = 0;
+    t->len = strlen("/bench");
+    t->parent_len = 0;
+    strcpy(t->path, "/bench");
+}
+
+// the absolute path of node i, valid until the next call
+static char *path_of(struct Tree *t, uint32_t i) {
+    uint32_t p = t->parent[i];
+    if (i == 0) {
+        t->len = strlen("/bench");
+        t->parent_len = 0;
+        strcpy(t->path, "/bench");
+    } else if (p == t->last) {
+        t->parent_len = t->len;
+        t->len = append_name(t->path, t->len, i);
+    } else if (t->last != 0 && p == t->parent[t->last]) {
+        t->len = append_name(t->path, t->parent_len, i);
+    } else {
+        // from the top: the names on the way, deepest first, then reversed
+        uint32_t chain[DEEP_CHAIN + 1];
+        int depth = 0;
+        for (uint32_t a = p; a != 0; a = t->parent[a]) {
+            chain[depth++] = a;
+        }
+        t->len = strlen("/bench");
+        while (depth > 0) {
+            t->len = append_name(t->path, t->len, chain[--depth]);
+        }
+        t->parent_len = t->len;
+        t->len = append_name(t->path, t->len, i);
+    }
+    t->last = i;
+    return t->path;
+}
+
+static size_t append_name(char *buf, size_t len, uint32_t i) {
+    return len + sprintf(buf + len, "/n%u", i);
+}
+
+// the next directory or file, from the k-th on, in an order fixed by
+// seed that visits every node once; false once they are all visited
+static bool next_sample(struct Tree *t, bool dir, uint32_t seed, uint64_t *k, uint32_t *i) {
+    while (*k < t->n) {
+        // 2654435761 is prime, so this is a permutation for any n below it
+        uint32_t candidate = (seed + *k * 2654435761u) % t->n;
+        (*k)++;
+        if (candidate != 0 && t->is_dir[candidate] == dir) {
+            *i = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// one line for tm, after the shape and size it ran on
+static void report(struct Tree *t, struct Timing *tm) {
+    printf("%s\t%u\t", shape_names[t->shape], t->n);
+    TimingReport(tm, tm->total);
+}
@@ -0,0 +1,93 @@
+// Scaling benchmark for a file system built with -DCONCURRENT: every
+// thread runs a 95/5 mix of reads (lookups, ls, cat) and writes (mkfile,
+// put) against a shared tree, and the total throughput is reported for
+// 1, 2, 4, 8 and 16 threads
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Fs.h"
+
+#define DIRS 64
+#define FILES 256
+#define OPS 200000
+
+static Fs fs;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    unsigned seed = id + 1;
+    char path[64];
+    char buf[64];
+    for (int i = 0; i < OPS; i++) {
+        int dir = rand_r(&seed) % DIRS;
+        int file = rand_r(&seed) % FILES;
+        int op = rand_r(&seed) % 100;
+        if (op < 5) {
+            // write: a new file in a directory of its own, or a put
+            if (op < 2) {
+                sprintf(path, "/w%ld/f%d", id, i);
+                FsMkfile(fs, path);
+            } else {
+                sprintf(path, "/d%d/f%d", dir, file);
+                FsPut(fs, path, "new content\n");
+            }
+        } else if (op < 85) {
+            sprintf(path, "/d%d/f%d", dir, file);
+            FsPread(fs, path, buf, sizeof(buf), 0);
+        } else if (op < 95) {
+            sprintf(path, "/d%d/f%d", dir, file);
+            FsCat(fs, path);
+        } else {
+            sprintf(path, "/d%d", dir);
+            FsLs(fs, path);
+        }
+    }
+    return NULL;
+}
+
+int main(void) {
+    // results go to stderr, the listings and file contents to /dev/null
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        return 1;
+    }
+    char path[64];
+    for (int threads = 1; threads <= 16; threads *= 2) {
+        fs = FsNew();
+        for (int d = 0; d < DIRS; d++) {
+            sprintf(path, "/d%d", d);
+            FsMkdir(fs, path);
+            for (int f = 0; f < FILES; f++) {
+                sprintf(path, "/d%d/f%d", d, f);
+                FsMkfile(fs, path);
+                FsPut(fs, path, "some content\n");
+            }
+        }
+        for (long t = 0; t < threads; t++) {
+            sprintf(path, "/w%ld", t);
+            FsMkdir(fs, path);
+        }
+        pthread_t tids[16];
+        double start = now();
+        for (long t = 0; t < threads; t++) {
+            pthread_create(&tids[t], NULL, worker, (void *)t);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        double secs = now() - start;
+        fprintf(stderr, "threads %2d: %10.0f ops/s\n", threads, threads * (double)OPS / secs);
+        FsFree(fs);
+    }
+    return 0;
+}
@@ -7,17 +7,18 @@
 #define BLUE "\033[94m"
 #define RESET_COLOR "\033[0m"
 
-void listFile(char *name, FileType type) {
-#ifdef COLORED
+void listFile(Output out, char *name, FileType type) {
+    if (!OutputColored(out)) {
+        OutputString(out, name);
+        return;
+    }
     char *color = RESET_COLOR;
     switch (type) {
         case REGULAR_FILE:  color = RESET_COLOR; break;
         case DIRECTORY:     color = BLUE;        break;
         default:            color = RESET_COLOR; break;
     }
-    printf("%s%s%s", color, name, RESET_COLOR);
-#else
-    printf("%s", name);
-#endif
+    OutputString(out, color);
+    OutputString(out, name);
+    OutputString(out, RESET_COLOR);
 }
-
@@ -0,0 +1,435 @@
+// Command driver for the File System ADT: runs commands typed one at a
+// time, or replays a script of them, such as a captured trace, at full
+// speed.
+//
+//     ./mimFs                          commands from stdin, as typed
+//     ./mimFs script                   the commands in script
+//     ./mimFs -t [-n rounds] script    a timed replay of script
+//
+// One command to a line, its arguments separated by blanks:
+//     mkdir path        mkfile path       cd [path]       ls [path]
+//     pwd               tree [path]       cat path        dldir path
+//     put path content  append path content
+//     cp [-r] src... dest                 mv src... dest  dl [-r] path
+// An argument in double quotes may hold blanks and the escapes \n, \t,
+// \r, \\ and \". The content of put and append is the rest of the line,
+// as it is unless it is quoted. Blank lines and lines starting with '#'
+// are skipped, and so is a line that isn't a command, with a warning.
+// So is mv, until FsMv moves anything, so a replay doesn't time a call
+// that does nothing.
+//
+// A script is mapped and cut into commands all at once before any runs:
+// its arguments stay where they are in the mapping, terminated in place,
+// so there is no allocation per line. A timed replay runs the script
+// "rounds" times (default 1), each on a new file system, with what the
+// commands print thrown away. One tab-separated line per command then
+// goes to stdout, after a header: how many ran, ops/sec over the time
+// spent in them, their mean, 50th and 99th percentile (to within 1/16)
+// and largest latency in nanoseconds, and the peak RSS of the process in
+// KiB. The last line, "all", is every command together, its ops/sec
+// over the whole replay.
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Fs.h"
+#include "Timing.h"
+
+#ifdef COLORED
+#define COLORS true
+#else
+#define COLORS false
+#endif
+
+typedef enum {
+    MKDIR,
+    MKFILE,
+    CD,
+    LS,
+    PWD,
+    TREE,
+    PUT,
+    APPEND,
+    CAT,
+    CP,
+    MV,
+    DL,
+    DLDIR,
+    COMMANDS,
+} Op;
+
+static char *op_names[] = {
+    "mkdir", "mkfile", "cd", "ls", "pwd", "tree", "put",
+    "append", "cat", "cp", "mv", "dl", "dldir",
+};
+
+// a parsed command: its arguments are args[arg] to args[arg + argc - 1]
+// of its script. Those of cp and mv are the sources, NULL and the
+// destination.
+struct Command {
+    uint8_t op;
+    bool recursive;
+    uint16_t argc;
+    uint32_t line;
+    size_t arg;
+};
+
+struct Script {
+    struct Command *cmds;
+    size_t n;
+    size_t cap;
+    char **args;
+    size_t nargs;
+    size_t args_cap;
+    size_t lines;
+    size_t skipped;
+};
+
+// helper function declaration
+static int interact(void);
+static int replay(char *path, bool timed, int rounds);
+static char *map_script(char *path, size_t *size);
+static void parse(struct Script *s, char *text, size_t size);
+static bool parse_line(struct Script *s, char *line);
+static char *next_arg(char **at, bool rest);
+static void add_arg(struct Script *s, char *arg);
+static void run(Fs fs, struct Script *s, struct Command *c);
+
+int main(int argc, char *argv[]) {
+    bool timed = false;
+    int rounds = 1;
+    char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0) {
+            timed = true;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) {
+        if (timed) {
+            fprintf(stderr, "usage: %s [-t [-n rounds] script]\n", argv[0]);
+            return 1;
+        }
+        return interact();
+    }
+    return replay(path, timed, (rounds > 0) ? rounds : 1);
+}
+
+// runs each line of stdin as it comes, with a prompt if stdin is a terminal
+static int interact(void) {
+    Fs fs = FsNew();
+    struct Script s = {0};
+    bool prompt = isatty(STDIN_FILENO);
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    for (;;) {
+        if (prompt) {
+            char cwd[PATH_MAX + 1];
+            FsGetCwd(fs, cwd);
+            printf("mimFs:%s$ ", cwd);
+            fflush(stdout);
+        }
+        if ((len = getline(&line, &cap, stdin)) < 0) {
+            break;
+        }
+        // the script holds just this line, and its arguments point into it
+        s.n = s.nargs = 0;
+        parse(&s, line, len);
+        if (s.n > 0) {
+            run(fs, &s, &s.cmds[0]);
+        }
+    }
+    if (prompt) {
+        printf("\n");
+    }
+    free(line);
+    free(s.cmds);
+    free(s.args);
+    FsFree(fs);
+    return 0;
+}
+
+static int replay(char *path, bool timed, int rounds) {
+    size_t size;
+    char *text = map_script(path, &size);
+    if (text == NULL) {
+        fprintf(stderr, "mimFs: '%s': Cannot read\n", path);
+        return 1;
+    }
+    struct Script s = {0};
+    uint64_t start = TimingNow();
+    parse(&s, text, size);
+    uint64_t parsed = TimingNow() - start;
+    if (timed) {
+        fprintf(stderr, "mimFs: %zu commands in %zu lines, %zu skipped, parsed in %.3f ms (%.0f MB/s)\n",
+                s.n, s.lines, s.skipped, parsed * 1e-6,
+                (parsed > 0) ? size * 1e3 / parsed : 0.0);
+    }
+
+    struct Timing *tm = calloc(COMMANDS + 1, sizeof(struct Timing));
+    for (int op = 0; op < COMMANDS; op++) {
+        tm[op].op = op_names[op];
+    }
+    tm[COMMANDS].op = "all";
+    uint64_t wall = 0;
+    for (int r = 0; r < rounds; r++) {
+        Fs fs = FsNew();
+        if (!timed) {
+            for (size_t i = 0; i < s.n; i++) {
+                run(fs, &s, &s.cmds[i]);
+            }
+            FsFree(fs);
+            break;
+        }
+        FsSetOutput(fs, TimingDiscard, NULL, COLORS);
+        uint64_t begin = TimingNow();
+        uint64_t prev = begin;
+        for (size_t i = 0; i < s.n; i++) {
+            struct Command *c = &s.cmds[i];
+            run(fs, &s, c);
+            // one clock reading ends a command and starts the next
+            uint64_t t = TimingNow();
+            TimingRecord(&tm[c->op], t - prev);
+            TimingRecord(&tm[COMMANDS], t - prev);
+            prev = t;
+        }
+        wall += prev - begin;
+        FsFree(fs);
+    }
+
+    if (timed) {
+        printf(TIMING_COLUMNS "\n");
+        for (int op = 0; op < COMMANDS; op++) {
+            if (tm[op].count > 0) {
+                TimingReport(&tm[op], tm[op].total);
+            }
+        }
+        TimingReport(&tm[COMMANDS], wall);
+    }
+    free(tm);
+    free(s.cmds);
+    free(s.args);
+    munmap(text, size + 1);
+    return 0;
+}
+
+// the file at path mapped privately, so the parser can write to it, with
+// a zero byte after its end; NULL if it can't be read
+static char *map_script(char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    // zeroed pages for the file and one more byte, the file over them
+    char *text = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (text != MAP_FAILED && st.st_size > 0 &&
+        mmap(text, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE,
+             fd, 0) == MAP_FAILED) {
+        munmap(text, st.st_size + 1);
+        text = MAP_FAILED;
+    }
+    close(fd);
+    if (text == MAP_FAILED) {
+        return NULL;
+    }
+    *size = st.st_size;
+    return text;
+}
+
+// cut the size bytes of text, followed by a zero byte, into the commands
+// of s, line by line
+static void parse(struct Script *s, char *text, size_t size) {
+    char *end = text + size;
+    for (char *line = text; line < end;) {
+        char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        *eol = '\0';
+        s->lines++;
+        if (!parse_line(s, line)) {
+            s->skipped++;
+        }
+        line = eol + 1;
+    }
+}
+
+// add the command on line to s, if there is one; false if the line isn't
+// a command
+static bool parse_line(struct Script *s, char *line) {
+    char *p = line;
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    if (*p == '\0' || *p == '#') {
+        return true;
+    }
+    char *name = next_arg(&p, false);
+    if (name == NULL) {
+        fprintf(stderr, "mimFs: line %zu: Unterminated quote\n", s->lines);
+        return false;
+    }
+    int op = 0;
+    while (op < COMMANDS && (name[0] != op_names[op][0] || strcmp(name, op_names[op]) != 0)) {
+        op++;
+    }
+    if (op == COMMANDS) {
+        fprintf(stderr, "mimFs: line %zu: '%s': Unknown command\n", s->lines, name);
+        return false;
+    }
+    if (op == MV) {
+        fprintf(stderr, "mimFs: line %zu: mv: Not implemented\n", s->lines);
+        return false;
+    }
+    struct Command c = {.op = op, .line = s->lines, .arg = s->nargs};
+    size_t argc = 0;
+    char *arg;
+    while ((arg = next_arg(&p, (op == PUT || op == APPEND) && argc == 1)) != NULL) {
+        if (argc == 0 && !c.recursive && (op == CP || op == DL) && strcmp(arg, "-r") == 0) {
+            c.recursive = true;
+            continue;
+        }
+        add_arg(s, arg);
+        argc++;
+    }
+    bool valid;
+    switch (op) {
+        case CD: case LS: case TREE:
+            valid = argc <= 1;
+            break;
+        case PWD:
+            valid = argc == 0;
+            break;
+        case PUT: case APPEND:
+            if (argc == 1) {
+                add_arg(s, "");
+                argc++;
+            }
+            valid = argc == 2;
+            break;
+        case CP: case MV:
+            valid = argc >= 2 && argc < UINT16_MAX;
+            if (valid) {
+                // the sources end with NULL, ahead of the destination
+                add_arg(s, s->args[s->nargs - 1]);
+                s->args[s->nargs - 2] = NULL;
+                argc++;
+            }
+            break;
+        default:
+            valid = argc == 1;
+            break;
+    }
+    if (p == NULL || !valid) {
+        fprintf(stderr, "mimFs: line %zu: %s: %s\n", s->lines, name,
+                (p == NULL) ? "Unterminated quote" : "Wrong number of arguments");
+        s->nargs = c.arg;
+        return false;
+    }
+    c.argc = argc;
+    if (s->n == s->cap) {
+        s->cap = (s->cap == 0) ? 1024 : s->cap * 2;
+        s->cmds = realloc(s->cmds, s->cap * sizeof(struct Command));
+    }
+    s->cmds[s->n++] = c;
+    return true;
+}
+
+// the next argument from *at on, terminated in place, or with rest the
+// rest of the line; NULL at the end of the line. *at becomes NULL if a
+// quote isn't closed.
+static char *next_arg(char **at, bool rest) {
+    char *p = *at;
+    if (p == NULL) {
+        return NULL;
+    }
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    if (*p == '\0') {
+        *at = p;
+        return NULL;
+    }
+    char *arg = p;
+    if (*p == '"') {
+        // unescaped over itself, which only ever shortens it
+        char *out = p;
+        for (p++; *p != '"'; p++) {
+            if (*p == '\0') {
+                *at = NULL;
+                return NULL;
+            } else if (*p == '\\' && p[1] != '\0') {
+                p++;
+                switch (*p) {
+                    case 'n': *out++ = '\n'; break;
+                    case 't': *out++ = '\t'; break;
+                    case 'r': *out++ = '\r'; break;
+                    case '\\': case '"': *out++ = *p; break;
+                    default: *out++ = '\\'; *out++ = *p; break;
+                }
+            } else {
+                *out++ = *p;
+            }
+        }
+        *out = '\0';
+        p++;
+    } else if (rest) {
+        p += strlen(p);
+        while (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r') {
+            p--;
+        }
+    } else {
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r') {
+            p++;
+        }
+    }
+    if (*p != '\0') {
+        *p++ = '\0';
+    }
+    *at = p;
+    return arg;
+}
+
+static void add_arg(struct Script *s, char *arg) {
+    if (s->nargs == s->args_cap) {
+        s->args_cap = (s->args_cap == 0) ? 4096 : s->args_cap * 2;
+        s->args = realloc(s->args, s->args_cap * sizeof(char *));
+    }
+    s->args[s->nargs++] = arg;
+}
+
+static void run(Fs fs, struct Script *s, struct Command *c) {
+    char **a = s->args + c->arg;
+    char *path = (c->argc > 0) ? a[0] : NULL;
+    switch (c->op) {
+        case MKDIR:     FsMkdir(fs, path); break;
+        case MKFILE:    FsMkfile(fs, path); break;
+        case CD:        FsCd(fs, path); break;
+        case LS:        FsLs(fs, (path != NULL) ? path : "."); break;
+        case PWD:       FsPwd(fs); break;
+        case TREE:      FsTree(fs, path); break;
+        case PUT:       FsPut(fs, path, a[1]); break;
+        case APPEND:    FsAppend(fs, path, a[1]); break;
+        case CAT:       FsCat(fs, path); break;
+        case CP:        FsCp(fs, c->recursive, a, a[c->argc - 1]); break;
+        case MV:        FsMv(fs, a, a[c->argc - 1]); break;
+        case DL:        FsDl(fs, c->recursive, path); break;
+        case DLDIR:     FsDldir(fs, path); break;
+    }
+}
@@ -2,18 +2,407 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "Fs.h"
 
+struct Captured {
+	char text[1 << 16];
+	size_t len;
+};
+
+static void capture(void *arg, const char *buf, size_t len) {
+	struct Captured *c = arg;
+	assert(c->len + len < sizeof(c->text));
+	memcpy(c->text + c->len, buf, len);
+	c->len += len;
+	c->text[c->len] = '\0';
+}
+
+static bool collect(void *arg, const char *path, bool is_dir) {
+	capture(arg, path, strlen(path));
+	capture(arg, "\n", 1);
+	return true;
+}
+
+static bool collect_line(void *arg, const char *path, size_t offset, size_t line) {
+	char text[256];
+	int n = snprintf(text, sizeof(text), "%s:%zu:%zu\n", path, offset, line);
+	capture(arg, text, n);
+	return true;
+}
+
+#ifdef CONCURRENT
+static void discard(void *arg, const char *buf, size_t len) {
+}
+
+// goes in and out of /race/in while the main thread removes /race
+static void *cd_loop(void *arg) {
+	Fs fs = arg;
+	char cwd[PATH_MAX + 1];
+	for (int i = 0; i < 200000; i++) {
+		FsCd(fs, "/race/in");
+		FsGetCwd(fs, cwd);
+		if (strcmp(cwd, "/race/in") == 0) {
+			// no dl -r can take it away from under the thread now
+			FsMkfile(fs, "f");
+			assert(FsRealpath(fs, "/race/in/f", cwd));
+			FsCd(fs, NULL);
+		}
+	}
+	return NULL;
+}
+#endif
+
 int main(void) {
 	Fs fs = FsNew();
 	FsMkfile(fs, "hello.txt");
 	FsPut(fs, "hello.txt", "hello\n");
 	FsPut(fs, "./hello.txt", "world\n"); // overwrites existing content
+	FsCat(fs, "hello.txt");
+
+	FsAppend(fs, "hello.txt", "again\n");
+	char buf[16] = {0};
+	assert(FsPread(fs, "hello.txt", buf, sizeof(buf) - 1, 0) == 12);
+	assert(strcmp(buf, "world\nagain\n") == 0);
+	assert(FsPwrite(fs, "hello.txt", "W", 1, 0) == 1);
+	assert(FsPwrite(fs, "hello.txt", "!", 1, 14) == 1); // leaves a zero-filled hole
+	assert(FsPread(fs, "hello.txt", buf, sizeof(buf), 11) == 4);
+	assert(memcmp(buf, "\n\0\0!", 4) == 0);
+	assert(FsPread(fs, "/", buf, sizeof(buf), 0) == -1);
+	FsCat(fs, "hello.txt");
+
+	char cwd[PATH_MAX + 1];
+	FsMkdir(fs, "a");
+	FsMkdir(fs, "a/b");
+	FsCd(fs, "a/./b");
+	FsGetCwd(fs, cwd);
+	assert(strcmp(cwd, "/a/b") == 0);
+	FsCd(fs, "..");
+	FsGetCwd(fs, cwd);
+	assert(strcmp(cwd, "/a") == 0);
+	assert(FsRealpath(fs, "../hello.txt", cwd));
+	assert(strcmp(cwd, "/hello.txt") == 0);
+
+	FsCd(fs, NULL);
+	FsMkfile(fs, "a/b/f");
+	FsPut(fs, "a/b/f", "old\n");
+	char *src[] = {"a", NULL};
+	FsCp(fs, true, src, "c"); // c shares a's entries until either changes
+	FsPut(fs, "a/b/f", "new\n");
+	FsMkdir(fs, "c/d");
+	assert(FsPread(fs, "c/b/f", buf, sizeof(buf), 0) == 4);
+	assert(memcmp(buf, "old\n", 4) == 0);
+	assert(!FsRealpath(fs, "a/d", cwd));
+	FsTree(fs, "c");
+	struct Captured out = {.len = 0};
+	FsSetOutput(fs, capture, &out, false);
+	FsMkdir(fs, "/..");
+	FsMkfile(fs, "../..");
+	assert(strcmp(out.text, "mkdir: cannot create directory '/..': File exists\n"
+	                        "mkfile: cannot create directory '../..': No Such file or directory\n") == 0);
+	out.len = 0;
+	FsTree(fs, "c");
+	FsCat(fs, "c/b/f");
+	FsSetOutput(fs, NULL, NULL, false); // back to stdout
+	assert(strcmp(out.text, "c\n    b\n        f\n    d\nold\n") == 0);
+
+	struct FsStats counts;
+	FsGetStats(fs, &counts); // tree gave c its own b/f
+	assert(counts.directories == 6 && counts.files == 3 && counts.contents == 3);
+	assert(counts.max_fanout == 3 && counts.max_depth == 3);
+	out.len = 0;
+	FsSetOutput(fs, capture, &out, false);
+	FsDumpStats(fs);
+	FsSetOutput(fs, NULL, NULL, false);
+	assert(strstr(out.text, "fs_files 3\n") != NULL);
+#ifdef STATS
+	assert(strstr(out.text, "fs_op_calls{op=\"tree\"} 2\n") != NULL);
+#endif
+
+	assert(FsSave(fs, "testFs.img"));
+	assert(FsSave(fs, "testFs.bad"));
+	FsFree(fs);
+	fs = FsLoad("testFs.img"); // the nodes are used where they are mapped
+	assert(fs != NULL);
+	remove("testFs.img");
+	// the root's next link, pointed far outside the image
+	FILE *img = fopen("testFs.bad", "r+b");
+	uint64_t nodes_off;
+	assert(fseek(img, 24, SEEK_SET) == 0 && fread(&nodes_off, 8, 1, img) == 1);
+#ifdef COMPACT_NODES
+	long next_at = 20;
+#else
+	long next_at = 16;
+#endif
+	int32_t far = 1 << 30;
+	assert(fseek(img, nodes_off + next_at, SEEK_SET) == 0 && fwrite(&far, 4, 1, img) == 1);
+	fclose(img);
+	assert(FsLoad("testFs.bad") == NULL);
+	remove("testFs.bad");
+	assert(FsPread(fs, "a/b/f", buf, sizeof(buf), 0) == 4);
+	assert(memcmp(buf, "new\n", 4) == 0);
+	FsAppend(fs, "c/b/f", "er\n");
+	assert(FsPread(fs, "c/b/f", buf, sizeof(buf), 0) == 7);
+	assert(FsRealpath(fs, "c/d", cwd));
+	FsTree(fs, NULL);
+
+	struct FsOp ops[] = {
+		{FS_MKFILE, "/batch/f", NULL}, // its parent comes first
+		{FS_MKDIR, "/batch", NULL},
+		{FS_PUT, "/batch/f", "put\n"},
+		{FS_MKFILE, "/batch/f", NULL},
+		{FS_MKDIR, "/batch/f/x", NULL},
+		{FS_PUT, "/batch/..", "x"},
+	};
+	FsStatus status[6];
+	FsBatch(fs, ops, 6, status);
+	assert(status[0] == FS_OK && status[1] == FS_OK && status[2] == FS_OK);
+	assert(status[3] == FS_EXISTS && status[4] == FS_NOT_DIR && status[5] == FS_IS_DIR);
+	assert(FsPread(fs, "/batch/f", buf, sizeof(buf), 0) == 4);
+
+	struct FsCacheStats stats;
+	FsGetCacheStats(fs, &stats);
+	assert(!FsRealpath(fs, "/batch/g", cwd)); // remembered as missing
+	FsMkfile(fs, "/batch/g");
+	assert(FsRealpath(fs, "/batch/g", cwd));
+	assert(FsRealpath(fs, "/batch//g/", cwd)); // the same path
+	struct FsCacheStats after;
+	FsGetCacheStats(fs, &after);
+	assert(after.misses == stats.misses + 2 && after.hits == stats.hits + 2);
+
+	FsMkdir(fs, "/rm");
+	FsMkfile(fs, "/rm/f");
+	FsPut(fs, "/rm/f", "kept\n");
+	FsDl(fs, false, "/rm"); // a directory needs -r
+	FsDldir(fs, "/rm"); // not empty
+	assert(FsRealpath(fs, "/rm/f", cwd));
+	char *rm[] = {"/rm", NULL};
+	FsCp(fs, true, rm, "/rmcopy");
+	FsDl(fs, true, "/rm");
+	assert(!FsRealpath(fs, "/rm", cwd));
+	assert(FsPread(fs, "/rmcopy/f", buf, sizeof(buf), 0) == 5); // the copy outlives its source
+	FsDl(fs, true, "/"); // busy
+	assert(FsRealpath(fs, "/rmcopy", cwd));
+	char name[32];
+	for (int i = 0; i < 100; i++) {
+		sprintf(name, "/rmcopy/%d", i);
+		FsMkfile(fs, name);
+	}
+	FsDl(fs, true, "/rmcopy"); // only unlinked, freed a few at a time
+	assert(FsReclaim(fs, 1));
+	assert(!FsReclaim(fs, 1000));
+
+	char *acopy[] = {"/a", NULL};
+	FsCp(fs, true, acopy, "/acopy"); // searched without making its entries
+	struct FsFindQuery query = {"f", false, FS_FIND_FILES, 0, -1, 1};
+	out.len = 0;
+	assert(FsFind(fs, "/", &query, collect, &out) == 4);
+	assert(strcmp(out.text, "/a/b/f\n/acopy/b/f\n/batch/f\n/c/b/f\n") == 0);
+	query = (struct FsFindQuery){"^[a-c]", true, FS_FIND_DIRECTORIES, 1, 1, 1};
+	out.len = 0;
+	assert(FsFind(fs, NULL, &query, collect, &out) == 4);
+	assert(strcmp(out.text, "/a\n/acopy\n/batch\n/c\n") == 0);
+	query = (struct FsFindQuery){"*", false, FS_FIND_ANY, 2, -1, 4};
+	assert(FsFind(fs, "/c/..", &query, NULL, NULL) == 9);
+	query.pattern = "(";
+	query.regex = true;
+	assert(FsFind(fs, "/", &query, NULL, NULL) == -1);
+
+	FsMkdir(fs, "/grep");
+	FsMkfile(fs, "/grep/a");
+	FsPut(fs, "/grep/a", "one\ntwo needle\nthree\nneedle needle\n");
+	FsMkfile(fs, "/grep/big");
+	assert(FsPwrite(fs, "/grep/big", "needle\n", 7, 64 * 1024 - 3) == 7); // across two chunks
+	struct FsGrepQuery grep = {"needle", false, 1};
+	out.len = 0;
+	assert(FsGrep(fs, "/grep", &grep, collect_line, &out) == 3);
+	assert(strcmp(out.text, "/grep/a:8:2\n/grep/a:21:4\n/grep/big:65533:1\n") == 0);
+	grep = (struct FsGrepQuery){"^t[a-z]+$", true, 1};
+	out.len = 0;
+	assert(FsGrep(fs, "/grep/a", &grep, collect_line, &out) == 1);
+	assert(strcmp(out.text, "/grep/a:15:3\n") == 0);
+	grep = (struct FsGrepQuery){"ne+dle", true, 4};
+	assert(FsGrep(fs, "/", &grep, NULL, NULL) == 3);
+	assert(FsGrep(fs, "/nowhere", &grep, NULL, NULL) == -1);
+	char deep[201];
+	memset(deep, 'd', 200);
+	deep[200] = '\0';
+	FsMkdir(fs, "/deep");
+	FsCd(fs, "/deep");
+	for (int i = 0; i < 25; i++) { // below PATH_MAX no more
+		FsMkdir(fs, deep);
+		FsCd(fs, deep);
+	}
+	query = (struct FsFindQuery){"*", false, FS_FIND_ANY, 0, -1, 1};
+	assert(FsFind(fs, ".", &query, NULL, NULL) == -1);
+	assert(FsGrep(fs, ".", &grep, NULL, NULL) == -1);
+	assert(FsImport(fs, ".", ".", 1) == -1 && FsExport(fs, ".", "testFs.deep", 1) == -1);
+	assert(access("testFs.deep", F_OK) != 0);
+	FsCd(fs, NULL);
+	FsDl(fs, true, "/deep");
+
+	assert(FsCompress(fs) > 0); // every content, compression being off
+	FsGetStats(fs, &counts);
+	assert(counts.compressed > 0 && counts.compressed_bytes < 4096);
+	assert(FsGrep(fs, "/grep", &grep, NULL, NULL) == 3);
+	assert(FsPread(fs, "/grep/big", buf, 7, 64 * 1024 - 3) == 7);
+	assert(memcmp(buf, "needle\n", 7) == 0);
+	assert(FsPwrite(fs, "/grep/big", "N", 1, 64 * 1024 - 3) == 1); // decompressed again
+	assert(FsPread(fs, "/grep/big", buf, 7, 64 * 1024 - 3) == 7);
+	assert(memcmp(buf, "Needle\n", 7) == 0);
+	FsSetCompression(fs, 0); // from here on, on the way out of every operation
+
+	char *text = malloc(100001);
+	text[0] = 'X';
+	unsigned seed = 1;
+	for (int i = 1; i < 100000; i++) {
+		seed = seed * 1103515245 + 12345;
+		text[i] = 'a' + (seed >> 16) % 26;
+	}
+	text[100000] = '\0';
+	FsSetDedup(fs, true);
+	FsMkdir(fs, "/dedup");
+	FsMkfile(fs, "/dedup/a");
+	FsMkfile(fs, "/dedup/b");
+	FsMkfile(fs, "/dedup/c");
+	FsPut(fs, "/dedup/a", text + 1);
+	FsPut(fs, "/dedup/b", text + 1); // takes no more memory
+	FsGetStats(fs, &counts);
+	assert(counts.block_bytes == 99999 && counts.block_referenced == 2 * 99999);
+	FsPut(fs, "/dedup/c", text); // the same, one byte further on
+	FsGetStats(fs, &counts);
+	assert(counts.block_bytes < 99999 + 99999 / 2 && counts.block_referenced == 3 * 99999 + 1);
+	assert(FsPread(fs, "/dedup/c", buf, sizeof(buf), 50000) == sizeof(buf));
+	assert(memcmp(buf, text + 50000, sizeof(buf)) == 0);
+	assert(FsPwrite(fs, "/dedup/a", "Y", 1, 0) == 1); // out of the blocks
+	assert(FsPread(fs, "/dedup/b", buf, 1, 0) == 1 && buf[0] == text[1]);
+	FsGetStats(fs, &counts);
+	assert(counts.block_referenced == 2 * 99999 + 1);
+	FsSetDedup(fs, false);
+
+	FsSetCompression(fs, -1);
+	assert(FsSetBudget(fs, 256 * 1024, "testFs.spill")); // the file is gone already
+	FsMkdir(fs, "/spill");
+	for (int i = 0; i < 8; i++) {
+		sprintf(name, "/spill/%d", i);
+		FsMkfile(fs, name);
+		text[1] = '0' + i;
+		FsPut(fs, name, text + 1);
+	}
+	FsGetStats(fs, &counts);
+	assert(counts.resident_bytes <= 256 * 1024 && counts.spilled >= 5);
+	for (int i = 0; i < 8; i++) {
+		sprintf(name, "/spill/%d", i);
+		assert(FsPread(fs, name, buf, sizeof(buf), 0) == sizeof(buf) && buf[0] == '0' + i);
+		assert(memcmp(buf + 1, text + 2, sizeof(buf) - 1) == 0);
+	}
+	FsAppend(fs, "/spill/0", "!"); // back in memory
+	assert(FsPread(fs, "/spill/0", buf, 2, 99998) == 2 && memcmp(buf, text + 99999, 1) == 0 && buf[1] == '!');
+	assert(FsSetBudget(fs, 0, NULL));
+
+	FsMkdir(fs, "/view");
+	FsMkfile(fs, "/view/a");
+	char *own = malloc(99999);
+	memcpy(own, text + 1, 99999);
+	assert(FsAdopt(fs, "/view/a", own, 99999)); // fs frees it
+	assert(!FsAdopt(fs, "/view/none", malloc(1), 1));
+	FsView view = FsOpenView(fs, "/view/a");
+	assert(view != NULL && FsViewSize(view) == 99999);
+	assert(FsOpenView(fs, "/view/none") == NULL);
+	struct iovec iov[4];
+	int n = FsViewRead(view, 60000, 39999, iov, 4);
+	size_t got = 0;
+	for (int i = 0; i < n; i++) {
+		assert(memcmp(iov[i].iov_base, text + 60001 + got, iov[i].iov_len) == 0);
+		got += iov[i].iov_len;
+	}
+	assert(got == 39999);
+	assert(FsViewRead(view, 99999, 1, iov, 4) == 0);
+	FsPut(fs, "/view/a", "new"); // the view keeps what it saw
+	assert(FsViewRead(view, 0, 3, iov, 4) == 1 && memcmp(iov[0].iov_base, text + 1, 3) == 0);
+	assert(FsPread(fs, "/view/a", buf, sizeof(buf), 0) == 3 && memcmp(buf, "new", 3) == 0);
+	FsCloseView(view);
+	free(text);
+
+	mkdir("testFs.host", 0755);
+	mkdir("testFs.host/d", 0755);
+	mkdir("testFs.host/d/e", 0755);
+	FILE *host = fopen("testFs.host/a", "w");
+	fwrite("x\0y", 1, 3, host);
+	fclose(host);
+	host = fopen("testFs.host/d/b", "w");
+	fputs("b\n", host);
+	fclose(host);
+	fclose(fopen("testFs.host/empty", "w"));
+	FsMkdir(fs, "/imp");
+	assert(FsImport(fs, "testFs.host", "/imp", 2) == 5);
+	assert(FsImport(fs, "testFs.none", "/imp", 2) == -1);
+	assert(FsPread(fs, "/imp/a", buf, sizeof(buf), 0) == 3 && memcmp(buf, "x\0y", 3) == 0);
+	assert(FsPread(fs, "/imp/d/b", buf, sizeof(buf), 0) == 2 && memcmp(buf, "b\n", 2) == 0);
+	assert(FsPread(fs, "/imp/empty", buf, sizeof(buf), 0) == 0);
+	assert(FsExport(fs, "/imp", "testFs.out", 2) == 5);
+	host = fopen("testFs.out/a", "r");
+	assert(fread(buf, 1, sizeof(buf), host) == 3 && memcmp(buf, "x\0y", 3) == 0);
+	fclose(host);
+	assert(FsImport(fs, "testFs.out", "/imp", 1) == 5); // the same again
+	remove("testFs.host/a");
+	remove("testFs.host/d/b");
+	remove("testFs.host/empty");
+	remove("testFs.host/d/e");
+	remove("testFs.host/d");
+	remove("testFs.host");
+	remove("testFs.out/a");
+	remove("testFs.out/d/b");
+	remove("testFs.out/empty");
+	remove("testFs.out/d/e");
+	remove("testFs.out/d");
+	remove("testFs.out");
+
+	remove("testFs.log");
+	assert(FsJournal(fs, "testFs.log", 0)); // from here on every change is logged
+	FsCd(fs, "c");
+	FsMkfile(fs, "d/g");
+	FsPut(fs, "d/g", "logged\n");
+	assert(FsCheckpoint(fs, "testFs.img"));
+	FsAppend(fs, "/c/d/g", "again\n");
+	FsMkfile(fs, "d/h");
+	assert(FsAdopt(fs, "d/h", memcpy(malloc(3), "a\0b", 3), 3));
+	FsFree(fs);
+	fs = FsLoad("testFs.img");
+	assert(FsJournal(fs, "testFs.log", -1)); // replays the append only
+	remove("testFs.img");
+	remove("testFs.log");
+	assert(FsPread(fs, "/c/d/g", buf, sizeof(buf), 0) == 13);
+	assert(memcmp(buf, "logged\nagain\n", 13) == 0);
+	assert(FsPread(fs, "/c/d/h", buf, sizeof(buf), 0) == 3 && memcmp(buf, "a\0b", 3) == 0);
+	FsFree(fs);
+
+#ifdef CONCURRENT
+	// a dl -r either finds the directory in use or takes it away first
+	fs = FsNew();
+	FsSetOutput(fs, discard, NULL, false);
+	pthread_t cd_thread;
+	pthread_create(&cd_thread, NULL, cd_loop, fs);
+	for (int i = 0; i < 200000; i++) {
+		FsMkdir(fs, "/race");
+		FsMkdir(fs, "/race/in");
+		FsDl(fs, true, "/race");
+	}
+	pthread_join(cd_thread, NULL);
+	FsDl(fs, true, "/race");
+	struct FsStats race;
+	FsGetStats(fs, &race);
+	assert(race.directories == 1 && race.files == 0);
+	FsFree(fs);
+#endif
 }
 
 	
@@ -0,0 +1,288 @@
+// Implementation of the Slab and Arena allocators
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "utility.h"
+
+// objects made usable at a time
+#define SLAB_BLOCK 4096
+
+// address space reserved by every slab; it is only backed by memory as
+// objects are handed out
+#define SLAB_RESERVE ((size_t)64 << 30)
+
+// bytes per arena block
+#define ARENA_BLOCK (1024 * 1024)
+
+// initial number of map slots, always a power of two
+#define MAP_SLOTS 16
+
+struct SlabRep {
+    size_t obj_size;
+    char *base;         // start of the reserved range, objects never move
+    size_t nblocks;     // blocks of SLAB_BLOCK objects made usable
+    size_t count;       // objects carved out of the blocks so far
+    void *free_list;    // freed objects, linked through their first word
+};
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    char data[];
+};
+
+struct ArenaRep {
+    struct ArenaBlock *blocks;  // most recent block first
+    size_t nblocks;
+    size_t used;                // bytes used in the most recent block
+    size_t cap;                 // bytes available in the most recent block
+    size_t bytes;               // in all the blocks
+};
+
+struct MapEntry {
+    void *key;          // NULL for an empty slot
+    void *value;
+};
+
+struct MapRep {
+    struct MapEntry *slots;
+    size_t nslots;
+    size_t size;
+};
+
+// helper function declaration
+static size_t map_home(Map m, void *key);
+static void map_grow(Map m);
+
+Slab SlabNew(size_t obj_size) {
+    Slab s = malloc(sizeof(struct SlabRep));
+    // every object must be able to hold the free list link
+    if (obj_size < sizeof(void *)) {
+        obj_size = sizeof(void *);
+    }
+    s->obj_size = obj_size;
+    s->base = mmap(NULL, SLAB_RESERVE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (s->base == MAP_FAILED) {
+        perror("slab");
+        exit(1);
+    }
+    s->nblocks = 0;
+    s->count = 0;
+    s->free_list = NULL;
+    return s;
+}
+
+void *SlabAlloc(Slab s) {
+    if (s->free_list != NULL) {
+        void *obj = s->free_list;
+        memcpy(&s->free_list, obj, sizeof(void *));
+        return obj;
+    }
+    if (s->count == s->nblocks * SLAB_BLOCK) {
+        // the last block is full, make the next one usable
+        size_t block = SLAB_BLOCK * s->obj_size;
+        if ((s->nblocks + 1) * block > SLAB_RESERVE ||
+            mprotect(s->base + s->nblocks * block, block, PROT_READ | PROT_WRITE) != 0) {
+            perror("slab");
+            exit(1);
+        }
+        s->nblocks++;
+    }
+    return SlabAt(s, s->count++);
+}
+
+void SlabFree(Slab s, void *obj) {
+    // obj_size need not be a multiple of a pointer's alignment, and object
+    // i starts i * obj_size past the base, so the link is copied in
+    memcpy(obj, &s->free_list, sizeof(void *));
+    s->free_list = obj;
+}
+
+size_t SlabCount(Slab s) {
+    return s->count;
+}
+
+void *SlabAt(Slab s, size_t i) {
+    return s->base + i * s->obj_size;
+}
+
+size_t SlabIndex(Slab s, void *obj) {
+    return ((char *)obj - s->base) / s->obj_size;
+}
+
+size_t SlabBlocks(Slab s) {
+    return s->nblocks;
+}
+
+size_t SlabBytes(Slab s) {
+    return s->nblocks * SLAB_BLOCK * s->obj_size;
+}
+
+bool SlabMap(Slab s, int fd, off_t offset, size_t count) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t block = SLAB_BLOCK * s->obj_size;
+    size_t nblocks = (count + SLAB_BLOCK - 1) / SLAB_BLOCK;
+    size_t len = (count * s->obj_size + page - 1) / page * page;
+    if (s->count != 0 || nblocks * block > SLAB_RESERVE) {
+        return false;
+    }
+    if (len > 0 && mmap(s->base, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        return false;
+    }
+    // the rest of the last block is fresh memory, as if allocated
+    if (nblocks * block > len &&
+        mprotect(s->base + len, nblocks * block - len, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    s->nblocks = nblocks;
+    s->count = count;
+    return true;
+}
+
+void SlabDestroy(Slab s) {
+    munmap(s->base, SLAB_RESERVE);
+    free(s);
+}
+
+Arena ArenaNew(void) {
+    Arena a = malloc(sizeof(struct ArenaRep));
+    a->blocks = NULL;
+    a->nblocks = 0;
+    a->used = 0;
+    a->cap = 0;
+    a->bytes = 0;
+    return a;
+}
+
+char *ArenaStrndup(Arena a, const char *str, size_t len) {
+    if (a->used + len + 1 > a->cap) {
+        // start a new block, a bigger one for a very long string
+        size_t cap = (len + 1 > ARENA_BLOCK) ? len + 1 : ARENA_BLOCK;
+        struct ArenaBlock *block = malloc(sizeof(struct ArenaBlock) + cap);
+        block->next = a->blocks;
+        a->blocks = block;
+        a->nblocks++;
+        a->bytes += cap;
+        a->used = 0;
+        a->cap = cap;
+    }
+    char *copy = a->blocks->data + a->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    a->used += len + 1;
+    return copy;
+}
+
+size_t ArenaBlocks(Arena a) {
+    return a->nblocks;
+}
+
+size_t ArenaBytes(Arena a) {
+    return a->bytes;
+}
+
+void ArenaDestroy(Arena a) {
+    struct ArenaBlock *block = a->blocks;
+    while (block != NULL) {
+        struct ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(a);
+}
+
+Map MapNew(void) {
+    Map m = malloc(sizeof(struct MapRep));
+    m->nslots = MAP_SLOTS;
+    m->slots = calloc(m->nslots, sizeof(struct MapEntry));
+    m->size = 0;
+    return m;
+}
+
+void *MapGet(Map m, void *key) {
+    for (size_t i = map_home(m, key); m->slots[i].key != NULL; i = (i + 1) & (m->nslots - 1)) {
+        if (m->slots[i].key == key) {
+            return m->slots[i].value;
+        }
+    }
+    return NULL;
+}
+
+void MapPut(Map m, void *key, void *value) {
+    if ((m->size + 1) * 2 > m->nslots) {
+        // keep the table at most half full
+        map_grow(m);
+    }
+    size_t i = map_home(m, key);
+    while (m->slots[i].key != NULL && m->slots[i].key != key) {
+        i = (i + 1) & (m->nslots - 1);
+    }
+    if (m->slots[i].key == NULL) {
+        m->slots[i].key = key;
+        m->size++;
+    }
+    m->slots[i].value = value;
+}
+
+void MapRemove(Map m, void *key) {
+    size_t mask = m->nslots - 1;
+    size_t i = map_home(m, key);
+    while (m->slots[i].key != key) {
+        if (m->slots[i].key == NULL) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    // shift back the entries after the hole that can't be found past it
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; m->slots[j].key != NULL; j = (j + 1) & mask) {
+        size_t home = map_home(m, m->slots[j].key);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            m->slots[hole] = m->slots[j];
+            hole = j;
+        }
+    }
+    m->slots[hole].key = NULL;
+    m->size--;
+}
+
+size_t MapSize(Map m) {
+    return m->size;
+}
+
+void MapFree(Map m) {
+    free(m->slots);
+    free(m);
+}
+
+//        helper functions         //
+
+// the slot a key is looked for first
+static size_t map_home(Map m, void *key) {
+    uint64_t h = (uintptr_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & (m->nslots - 1);
+}
+
+// double the number of slots and put every entry back
+static void map_grow(Map m) {
+    struct MapEntry *old = m->slots;
+    size_t nold = m->nslots;
+    m->nslots *= 2;
+    m->slots = calloc(m->nslots, sizeof(struct MapEntry));
+    m->size = 0;
+    for (size_t i = 0; i < nold; i++) {
+        if (old[i].key != NULL) {
+            MapPut(m, old[i].key, old[i].value);
+        }
+    }
+    free(old);
+}
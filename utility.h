@@ -0,0 +1,78 @@
+// Interface to the allocators shared by the File System ADT
+
+#ifndef UTILITY_H
+#define UTILITY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// a Slab hands out fixed-size objects from one contiguous range of
+// address space, so objects never move and the distance between two of
+// them fits in 32 bits. Freed objects go on a free list and are reused
+// before the slab grows, and SlabDestroy releases every object at once.
+typedef struct SlabRep *Slab;
+
+Slab SlabNew(size_t obj_size);
+
+void *SlabAlloc(Slab s);
+
+void SlabFree(Slab s, void *obj);
+
+// objects handed out so far, including freed ones; they can be visited
+// in allocation order with SlabAt
+size_t SlabCount(Slab s);
+
+void *SlabAt(Slab s, size_t i);
+
+// the i for which SlabAt gives obj
+size_t SlabIndex(Slab s, void *obj);
+
+// blocks of objects made usable so far
+size_t SlabBlocks(Slab s);
+
+// memory those blocks take up
+size_t SlabBytes(Slab s);
+
+// make the first count objects of an empty slab the ones stored in the
+// file fd from offset on, a multiple of the page size. They are mapped
+// privately: read in as they are touched and copied when changed.
+bool SlabMap(Slab s, int fd, off_t offset, size_t count);
+
+void SlabDestroy(Slab s);
+
+// an Arena bump-allocates strings out of large blocks; they are only
+// released all at once by ArenaDestroy
+typedef struct ArenaRep *Arena;
+
+Arena ArenaNew(void);
+
+// copies the first len characters of str and terminates the copy
+char *ArenaStrndup(Arena a, const char *str, size_t len);
+
+// blocks obtained from malloc
+size_t ArenaBlocks(Arena a);
+
+// memory those blocks take up
+size_t ArenaBytes(Arena a);
+
+void ArenaDestroy(Arena a);
+
+// a Map associates pointers with pointers, using open addressing
+typedef struct MapRep *Map;
+
+Map MapNew(void);
+
+// the value stored for key, NULL if there is none
+void *MapGet(Map m, void *key);
+
+// store value for key, replacing any previous value
+void MapPut(Map m, void *key, void *value);
+
+void MapRemove(Map m, void *key);
+
+size_t MapSize(Map m);
+
+void MapFree(Map m);
+
+#endif